@@ -9,12 +9,45 @@
 #include <cstdlib>
 #include <random>
 #include <limits>
+#include <algorithm>
+#include <cmath>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <malloc.h>
+#endif
 
 #include "bst.cpp"
+#include "compact_bst.cpp"
+#include "lean_bst.cpp"
+#include "intrusive_bst.cpp"
+#include "frozen_bst.cpp"
 
 
 #define __BENCHMARK_MAP
 #define __BENCHMARK_BSD
+#define __BENCHMARK_STORAGE
+#define __BENCHMARK_COMPACT
+#define __BENCHMARK_LEAN
+#define __BENCHMARK_SPLIT
+#define __BENCHMARK_SMALL
+#define __BENCHMARK_INTRUSIVE
+#define __BENCHMARK_COMPACTION
+#define __BENCHMARK_TEARDOWN
+#define __BENCHMARK_COPY
+#define __BENCHMARK_BALANCE
+#define __BENCHMARK_ZIPF
+#define __BENCHMARK_LATENCY
+#define __BENCHMARK_LOAD
+#define __BENCHMARK_BATCH
+#define __BENCHMARK_SHARDS
+#define __BENCHMARK_SETS
+#define __BENCHMARK_WINDOW
+#define __BENCHMARK_PURGE
+#define __BENCHMARK_FIND_MANY
+#define __BENCHMARK_THREE_WAY
+#define __BENCHMARK_PREFIX
+#define __BENCHMARK_FROZEN
 //#define __PROFILE_MAP
 //#define __PROFILE_BSD
 //#define __PROFILE_DEPTH
@@ -159,6 +192,44 @@ void print_table(Types&&... args) {
     }
 }
 
+/**
+ * Prints the distribution of per operation latencies (in nanoseconds).
+ */
+void print_latency(const std::string& name, std::vector<double>& samples, double elapsed, int depth) {
+    const auto WIDTH = 16ul;
+    const auto COLS = { "Action", "Took", "total", "p50", "p99", "p99.9", "max", "depth" };
+
+    auto line = [WIDTH](auto ROW) {
+        for (auto&& i : ROW) {
+            (void)i;
+            std::cout << std::setw(WIDTH) << std::setfill('-') << "";
+        }
+        std::cout << "--" << std::endl;
+    };
+    auto cell = [WIDTH](auto VALUE) {
+        std::cout << "| " << std::left << std::setw(WIDTH - 3) << std::setfill(' ') << VALUE << " ";
+    };
+    auto percentile = [&samples](double p) {
+        return samples[std::min<std::size_t>((std::size_t) (p * samples.size()), samples.size() - 1)];
+    };
+
+    std::sort(samples.begin(), samples.end());
+    line(COLS);
+    for (auto&& c : COLS) cell(c);
+    std::cout << " |" << std::endl;
+    line(COLS);
+    cell(name);
+    cell(elapsed);
+    cell(samples.size());
+    cell(percentile(0.5));
+    cell(percentile(0.99));
+    cell(percentile(0.999));
+    cell(samples.back());
+    cell(depth);
+    std::cout << " |" << std::endl;
+    line(COLS);
+}
+
 template<typename Map>
 std::size_t map_size(Map map, std::size_t size_over = 0) {
     // Estimate size
@@ -179,6 +250,844 @@ std::size_t bst_size(Bst bst, std::size_t size_over = 0) {
         * (sizeof(typename Bst::node_type)- sizeof(typename Bst::value_type));
 }
 
+std::size_t rss() {
+    // Resident set size of the process in bytes (0 when not available)
+#ifdef __linux__
+    std::size_t pages{0}, resident{0};
+    std::ifstream statm{"/proc/self/statm"};
+    statm >> pages >> resident;
+    return resident * (std::size_t) sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+template<typename Bst>
+void bench_storage(std::string&& name) {
+    using pair = typename Bst::value_type;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{
+            -INSERT,
+            +INSERT
+    };
+#ifdef __linux__
+    // Give back the memory freed by previous runs, so that this one starts clean
+    malloc_trim(0);
+#endif
+    const std::size_t rss_begin = rss();
+    {
+        Bst _map;
+
+        stats _insert{name + " Insert", INSERT};
+        for (std::size_t i = 0; i < INSERT; i++) {
+            if (_map.insert(pair{distribution(generator), 0}).second) {
+                _insert.positive++;
+            } else {
+                _insert.negative++;
+            }
+        }
+        _insert.done();
+        std::cout << name << " inserted=" << _map.size()
+                  << " rss_delta=" << ((long long) rss() - (long long) rss_begin) << std::endl;
+
+        stats _removes{name + " Erase", REMOVES};
+        for (std::size_t j = 0; j < REMOVES; j++) {
+            if (_map.erase(distribution(generator)) > 0) {
+                _removes.positive++;
+            } else {
+                _removes.negative++;
+            }
+        }
+        _removes.done();
+
+        stats _clear{name + " Clear", _map.size()};
+        _map.clear();
+        _clear.done();
+
+        print_table(_insert, _removes, _clear);
+    }
+}
+
+template<typename Bst>
+void bench_tree(std::string&& name) {
+    using pair = typename Bst::value_type;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{
+            -INSERT,
+            +INSERT
+    };
+    Bst _map;
+
+    // Estimate size
+    std::cout << "sizeof(" << name << "::node_type) " << sizeof(typename Bst::node_type) << std::endl;
+    std::cout << "estimated normalized size= " << bst_size(_map, INSERT) << std::endl;
+
+    stats _insert{name + " Insert", INSERT};
+    for (std::size_t i = 0; i < INSERT; i++) {
+        if (_map.insert(pair{distribution(generator), 0}).second) {
+            _insert.positive++;
+        } else {
+            _insert.negative++;
+        }
+    }
+    _insert.done();
+
+    stats _find{name + " Find", FIND};
+    for (std::size_t i = 0; i < FIND; i++) {
+        if (_map.find(distribution(generator)) != _map.end()) {
+            _find.positive++;
+        } else {
+            _find.negative++;
+        }
+    }
+    _find.done();
+
+    stats _iterate{name + " Iterate", _map.size()};
+    for (auto&& kv : _map) {
+        if (kv.second == 0) {
+            _iterate.positive++;
+        } else {
+            _iterate.negative++;
+        }
+    }
+    _iterate.done();
+
+    stats _removes{name + " Erase", REMOVES};
+    for (std::size_t j = 0; j < REMOVES; j++) {
+        if (_map.erase(distribution(generator)) > 0) {
+            _removes.positive++;
+        } else {
+            _removes.negative++;
+        }
+    }
+    _removes.done();
+
+    print_table(_insert, _find, _iterate, _removes);
+}
+
+// Large mapped value, to be kept away from the links
+struct payload {
+    char bytes[256];
+};
+
+template<typename Bst>
+void bench_find(std::string&& name) {
+    using pair = typename Bst::value_type;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{
+            -INSERT,
+            +INSERT
+    };
+    Bst _map;
+
+    std::cout << "sizeof(" << name << "::node_type) " << sizeof(typename Bst::node_type) << std::endl;
+
+    stats _insert{name + " Insert", INSERT};
+    for (std::size_t i = 0; i < INSERT; i++) {
+        if (_map.insert(pair{distribution(generator), payload{}}).second) {
+            _insert.positive++;
+        } else {
+            _insert.negative++;
+        }
+    }
+    _insert.done();
+
+    stats _find{name + " Find", FIND};
+    for (std::size_t i = 0; i < FIND; i++) {
+        if (_map.find(distribution(generator)) != _map.end()) {
+            _find.positive++;
+        } else {
+            _find.negative++;
+        }
+    }
+    _find.done();
+
+    print_table(_insert, _find);
+}
+
+template<typename Bst>
+void bench_small(std::string&& name) {
+    using pair = typename Bst::value_type;
+    // Many tiny maps of 1 to 8 entries
+    const std::size_t MAPS = INSERT / 4;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{0, 15};
+
+    stats _insert{name + " Insert", MAPS};
+    std::vector<Bst> maps(MAPS);
+    for (auto&& m : maps) {
+        const int entries = 1 + distribution(generator) % 8;
+        for (int i = 0; i < entries; i++) m.insert(pair{distribution(generator), i});
+        _insert.positive++;
+    }
+    _insert.done();
+
+    stats _find{name + " Find", FIND};
+    for (std::size_t i = 0; i < FIND; i++) {
+        if (maps[i % MAPS].find(distribution(generator)) != maps[i % MAPS].end()) {
+            _find.positive++;
+        } else {
+            _find.negative++;
+        }
+    }
+    _find.done();
+
+    stats _clear{name + " Clear", MAPS};
+    maps.clear();
+    _clear.done();
+
+    print_table(_insert, _find, _clear);
+}
+
+// Object living in a user pool, linkable in an intrusive tree
+struct record: bst_hook<> {
+    int key;
+    int value;
+};
+
+void bench_intrusive() {
+    using tree = intrusive_bst<record, int, &record::key>;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{
+            -INSERT,
+            +INSERT
+    };
+    std::vector<record> pool(INSERT);
+    for (auto&& r : pool) r.key = distribution(generator);
+    tree _tree;
+
+    stats _insert{"intrusive Insert", INSERT};
+    for (auto&& r : pool) {
+        if (_tree.insert(r).second) {
+            _insert.positive++;
+        } else {
+            _insert.negative++;
+        }
+    }
+    _insert.done();
+
+    stats _find{"intrusive Find", FIND};
+    for (std::size_t i = 0; i < FIND; i++) {
+        if (_tree.find(distribution(generator)) != _tree.end()) {
+            _find.positive++;
+        } else {
+            _find.negative++;
+        }
+    }
+    _find.done();
+
+    stats _removes{"intrusive Erase", REMOVES};
+    for (std::size_t j = 0; j < REMOVES; j++) {
+        if (_tree.erase(distribution(generator)) > 0) {
+            _removes.positive++;
+        } else {
+            _removes.negative++;
+        }
+    }
+    _removes.done();
+
+    print_table(_insert, _find, _removes);
+}
+
+template<typename Bst>
+void bench_compaction() {
+    using pair = typename Bst::value_type;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{
+            -INSERT,
+            +INSERT
+    };
+    Bst _map;
+    for (std::size_t i = 0; i < INSERT; i++) _map.insert(pair{distribution(generator), 0});
+    // Churn: erased slots are recycled by later insertions, scattering the nodes
+    for (std::size_t i = 0; i < 4 * REMOVES; i++) {
+        _map.erase(distribution(generator));
+        _map.insert(pair{distribution(generator), 0});
+    }
+
+    auto scan_and_find = [&](const std::string& name) {
+        stats _iterate{name + " Iterate", 10 * _map.size()};
+        for (int r = 0; r < 10; r++) {
+            for (auto&& kv : _map) {
+                if (kv.second == 0) {
+                    _iterate.positive++;
+                } else {
+                    _iterate.negative++;
+                }
+            }
+        }
+        _iterate.done();
+
+        std::default_random_engine find_generator{SEED};
+        stats _find{name + " Find", FIND};
+        for (std::size_t i = 0; i < FIND; i++) {
+            if (_map.find(distribution(find_generator)) != _map.end()) {
+                _find.positive++;
+            } else {
+                _find.negative++;
+            }
+        }
+        _find.done();
+        print_table(_iterate, _find);
+    };
+
+    scan_and_find("churned");
+    stats _compact{"compact()", _map.size()};
+    _map.compact();
+    _compact.done();
+    print_table(_compact);
+    scan_and_find("compacted");
+}
+
+template<typename Bst>
+void bench_teardown(std::string&& name, bst_reclaimer* reclaimer) {
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{
+            -INSERT,
+            +INSERT
+    };
+    Bst _map;
+    _map.set_reclaimer(reclaimer);
+    for (std::size_t i = 0; i < INSERT; i++) _map[distribution(generator)] = "a value too long for the small string buffer";
+
+    stats _clear{name + " Clear", _map.size()};
+    _map.clear();
+    _clear.done();
+    print_table(_clear);
+}
+
+template<typename Map>
+void bench_copy(std::string&& name, std::size_t entries) {
+    using pair = typename Map::value_type;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution;
+    Map _map;
+    for (std::size_t i = 0; i < entries; i++) _map.insert(pair{distribution(generator), 0});
+
+    stats _copy{name + " Copy", _map.size()};
+    Map _copied{_map};
+    _copy.done();
+    _copy.positive = _copied.size();
+    print_table(_copy);
+}
+
+template<typename Balance>
+void bench_balance(std::string&& name, std::size_t entries) {
+    using Bst = bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                    _node_pool, 0, Balance>;
+    using pair = typename Bst::value_type;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution;
+    std::vector<int> random(entries);
+    for (auto&& k : random) k = distribution(generator);
+    std::vector<int> ascending{random};
+    std::sort(ascending.begin(), ascending.end());
+    std::vector<int> descending{ascending.rbegin(), ascending.rend()};
+
+    auto run = [&](const std::string& order, const std::vector<int>& keys) {
+        Bst _map;
+        stats _insert{name + " " + order + " Insert", keys.size()};
+        for (auto k : keys) {
+            if (_map.insert(pair{k, 0}).second) {
+                _insert.positive++;
+            } else {
+                _insert.negative++;
+            }
+        }
+        _insert.done();
+
+        stats _find{name + " " + order + " Find", keys.size()};
+        for (auto k : random) {
+            if (_map.find(k) != _map.end()) {
+                _find.positive++;
+            } else {
+                _find.negative++;
+            }
+        }
+        _find.done();
+
+        stats _removes{name + " " + order + " Erase", keys.size()};
+        for (auto k : keys) {
+            if (_map.erase(k) > 0) {
+                _removes.positive++;
+            } else {
+                _removes.negative++;
+            }
+        }
+        _removes.done();
+        print_table(_insert, _find, _removes);
+    };
+
+    run("random", random);
+    run("ascending", ascending);
+    run("descending", descending);
+}
+
+/**
+ * Builds maps out of sorted and unsorted ranges, one insertion at a time
+ * versus bulk loaded (positive = size, negative = depth).
+ */
+template<typename Bst>
+void bench_load(std::string&& name, std::size_t entries) {
+    using pair = std::pair<int, int>;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution;
+    std::vector<pair> random(entries);
+    for (auto&& p : random) p = pair{distribution(generator), 0};
+    std::vector<pair> sorted{random};
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end(), [](const pair& a, const pair& b) {
+        return a.first == b.first;
+    }), sorted.end());
+
+    auto run = [&](std::string&& action, auto&& build) {
+        stats _load{name + " " + action, entries};
+        Bst _map = build();
+        _load.done();
+        _load.positive = _map.size();
+        _load.negative = _map.depth();
+        return _load;
+    };
+    print_table(
+        run("Iter sorted", [&] { return Bst{sorted.begin(), sorted.end()}; }),
+        run("Load sorted", [&] { return Bst{sorted_unique, sorted.begin(), sorted.end()}; }),
+        run("Iter random", [&] { return Bst{random.begin(), random.end()}; }),
+        run("Load random", [&] { return Bst{sorted_unique, random.begin(), random.end()}; })
+    );
+}
+
+/**
+ * Inserts sorted batches of random keys in a map of entries random keys,
+ * one insertion at a time versus insert_batch (positive = inserted,
+ * negative = depth).
+ */
+template<typename Bst>
+void bench_batch(std::string&& name, std::size_t entries) {
+    using pair = std::pair<int, int>;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution;
+    std::vector<pair> keys(entries);
+    for (auto&& p : keys) p = pair{distribution(generator), 0};
+    const Bst _base{keys.begin(), keys.end()};
+
+    for (std::size_t batch : {std::size_t{1000}, std::size_t{10000}, std::size_t{100000}, entries}) {
+        std::vector<pair> updates(batch);
+        for (auto&& p : updates) p = pair{distribution(generator), 1};
+        std::sort(updates.begin(), updates.end());
+        std::string size = std::to_string(batch / 1000) + "K";
+
+        Bst _loop{_base};
+        stats _insert{name + " loop " + size, batch};
+        for (auto&& p : updates) _insert.positive += _loop.insert(p).second;
+        _insert.done();
+        _insert.negative = _loop.depth();
+
+        Bst _batch{_base};
+        stats _merge{name + " batch " + size, batch};
+        _merge.positive = _batch.insert_batch(updates.begin(), updates.end());
+        _merge.done();
+        _merge.negative = _batch.depth();
+        print_table(_insert, _merge);
+    }
+}
+
+/**
+ * Moves the upper range of keys of a shard to the next one and back, by
+ * split / join versus one pop / insert at a time (positive = moved keys,
+ * negative = depth of the shards).
+ */
+template<typename Balance>
+void bench_shards(std::string&& name, std::size_t entries, std::size_t rounds) {
+    using Bst = bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                    _node_pool, 0, Balance>;
+    std::vector<std::pair<int, int>> keys(entries);
+    for (std::size_t i = 0; i < entries; i++) keys[i] = {(int) i, 0};
+    const int half = (int) entries / 2;
+
+    for (int range : {1000, half / 2}) {
+        std::string size = std::to_string(range / 1000) + "K";
+        Bst a{sorted_unique, keys.begin(), keys.begin() + half};
+        Bst b{sorted_unique, keys.begin() + half, keys.end()};
+        stats _loop{name + " loop " + size, rounds * range * 2};
+        for (std::size_t r = 0; r < rounds; r++) {
+            for (int k = half - range; k < half; k++) _loop.positive += b.insert(a.pop(k)).second;
+            for (int k = half - range; k < half; k++) _loop.positive += a.insert(b.pop(k)).second;
+        }
+        _loop.done();
+        _loop.negative = std::max(a.depth(), b.depth());
+
+        stats _split{name + " split " + size, rounds * range * 2};
+        for (std::size_t r = 0; r < rounds; r++) {
+            auto [lo, moved] = a.split(half - range);
+            _split.positive += range;
+            b = Bst::join(std::move(moved), std::move(b));
+            a = std::move(lo);
+            auto [back, hi] = b.split(half);
+            _split.positive += range;
+            a = Bst::join(std::move(a), std::move(back));
+            b = std::move(hi);
+        }
+        _split.done();
+        _split.negative = std::max(a.depth(), b.depth());
+        print_table(_loop, _split);
+    }
+}
+
+/**
+ * Evicts the oldest window of keys round after round, key by key versus
+ * one range erase, until half the keys are gone (positive = evicted
+ * keys, negative = depth).
+ */
+template<typename Balance>
+void bench_window(std::string&& name, std::size_t entries, std::size_t rounds) {
+    using Bst = bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                    _node_pool, 0, Balance>;
+    const int range = (int) (entries / rounds / 2);
+
+    for (int method = 0; method < 2; method++) {
+        Bst m;
+        for (int k = 0; k < (int) entries; k++) m.insert({k, k});
+        stats _window{name + (method ? " range" : " keys"), rounds * range};
+        for (int r = 0; r < (int) rounds; r++) {
+            int oldest = r * range;
+            if (method) {
+                _window.positive += m.erase(oldest, oldest + range - 1);
+            } else {
+                std::vector<int> keys;
+                for (auto it = m(oldest, oldest + range - 1); it != m.end(); ++it) keys.push_back(it->first);
+                for (int k : keys) _window.positive += m.erase(k);
+            }
+        }
+        _window.done();
+        _window.negative = m.depth();
+        print_table(_window);
+    }
+}
+
+/**
+ * Purges the keys matching a predicate, collected and erased one by one
+ * versus erase_if, for shares of 10% and 90% of the keys (positive =
+ * removed keys, negative = depth).
+ */
+template<typename Balance>
+void bench_purge(std::string&& name, std::size_t entries) {
+    using Bst = bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                    _node_pool, 0, Balance>;
+    std::vector<std::pair<int, int>> keys(entries);
+    for (std::size_t i = 0; i < entries; i++) keys[i] = {(int) i, 0};
+
+    for (int share : {1, 9}) {
+        auto pred = [share](const std::pair<const int, int>& kv) { return kv.first % 10 < share; };
+        std::string percent = " " + std::to_string(share * 10) + "%";
+        Bst a{sorted_unique, keys.begin(), keys.end()}, b{a};
+
+        stats _keys{name + " keys" + percent, entries};
+        std::vector<int> matching;
+        for (auto&& kv : a) if (pred(kv)) matching.push_back(kv.first);
+        for (int k : matching) _keys.positive += a.erase(k);
+        _keys.done();
+        _keys.negative = a.depth();
+
+        stats _erase_if{name + " erase_if" + percent, entries};
+        _erase_if.positive = erase_if(b, pred);
+        _erase_if.done();
+        _erase_if.negative = b.depth();
+        print_table(_keys, _erase_if);
+    }
+}
+
+/**
+ * Unions, intersects and subtracts two maps of random keys, one key at a
+ * time versus the set operations (positive = keys of the result,
+ * negative = its depth).
+ */
+template<typename Balance>
+void bench_sets(std::string&& name, std::size_t entries) {
+    using Bst = bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                    _node_pool, 0, Balance>;
+    std::mt19937 generator(SEED);
+    std::uniform_int_distribution<int> distribution(0, (int) (4 * entries));
+    Bst a, b;
+    for (std::size_t i = 0; i < entries; i++) {
+        a.insert({distribution(generator), 1});
+        b.insert({distribution(generator), 2});
+    }
+
+    for (int method = 0; method < 3; method++) {
+        const char* op = method == 0 ? " union" : method == 1 ? " intersection" : " difference";
+        Bst x{a}, y{b};
+        stats _loop{name + op + " loop", a.size() + b.size()};
+        if (method == 0) for (auto&& kv : y) x.insert(kv);
+        if (method == 1) {
+            Bst z;
+            for (auto&& kv : x) if (y.has(kv.first)) z.insert(kv);
+            x = std::move(z);
+        }
+        if (method == 2) for (auto&& kv : y) x.erase(kv.first);
+        _loop.done();
+        _loop.positive = x.size();
+        _loop.negative = x.depth();
+
+        Bst u{a}, v{b};
+        stats _set{name + op + " set", a.size() + b.size()};
+        Bst w = method == 0 ? Bst::set_union(std::move(u), std::move(v)) :
+                method == 1 ? Bst::set_intersection(std::move(u), std::move(v)) :
+                              Bst::set_difference(std::move(u), std::move(v));
+        _set.done();
+        _set.positive = w.size();
+        _set.negative = w.depth();
+        print_table(_loop, _set);
+    }
+}
+
+/**
+ * Bulk loads random keys, then times the lookups before and after a
+ * balance() rebuild, and the rebuild itself.
+ */
+template<typename Balance>
+void bench_rebuild(std::string&& name, std::size_t entries) {
+    using Bst = bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                    _node_pool, 0, Balance>;
+    using pair = typename Bst::value_type;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution;
+    std::vector<int> keys(entries);
+    for (auto&& k : keys) k = distribution(generator);
+
+    Bst _map;
+    for (auto k : keys) _map.insert(pair{k, 0});
+
+    auto find = [&](std::string&& action) {
+        stats _find{name + " " + action, keys.size()};
+        for (auto k : keys) {
+            if (_map.find(k) != _map.end()) {
+                _find.positive++;
+            } else {
+                _find.negative++;
+            }
+        }
+        _find.done();
+        return _find;
+    };
+
+    stats _before = find("Find");
+    stats _rebuild{name + " Rebuild", _map.size()};
+    _map.balance();
+    _rebuild.done();
+    _rebuild.positive = _map.depth();
+    stats _after = find("Find after");
+    print_table(_before, _rebuild, _after);
+}
+
+/**
+ * Times every operation of an ascending insertion stream mixed with random
+ * erasures, the maintenance (a balance() every so many operations, or a
+ * rebalance_step() of budget nodes after each) is charged to the operation
+ * it follows.
+ */
+template<typename Balance>
+void bench_latency(std::string&& name, std::size_t entries, std::size_t every, std::size_t budget) {
+    using Bst = bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                    _node_pool, 0, Balance>;
+    using pair = typename Bst::value_type;
+    using clock = std::chrono::high_resolution_clock;
+    std::default_random_engine generator{SEED};
+    std::vector<double> samples;
+    samples.reserve(entries);
+
+    Bst _map;
+    auto begin = clock::now();
+    for (std::size_t i = 0; i < entries; i++) {
+        auto start = clock::now();
+        if (i % 4 == 3) {
+            _map.erase((int) (generator() % i));
+        } else {
+            _map.insert(pair{(int) i, 0});
+        }
+        if (budget > 0) _map.rebalance_step(budget);
+        if (every > 0 && i % every == every - 1) _map.balance();
+        samples.push_back(std::chrono::duration<double, std::nano>(clock::now() - start).count());
+    }
+    double elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+    print_latency(name, samples, elapsed, _map.depth());
+}
+
+/**
+ * Draws lookups among keys with a Zipf law: the i-th key is looked up
+ * with probability proportional to 1 / (i + 1)^s.
+ */
+std::vector<int> zipf_lookups(const std::vector<int>& keys, std::size_t lookups, double s) {
+    std::vector<double> cdf(keys.size());
+    double total = 0;
+    for (std::size_t i = 0; i < keys.size(); i++) {
+        total += 1.0 / std::pow((double) (i + 1), s);
+        cdf[i] = total;
+    }
+    std::default_random_engine generator{SEED};
+    std::uniform_real_distribution<double> distribution{0, total};
+    std::vector<int> drawn(lookups);
+    for (auto&& k : drawn) {
+        auto i = std::lower_bound(cdf.begin(), cdf.end(), distribution(generator)) - cdf.begin();
+        k = keys[std::min<std::size_t>(i, keys.size() - 1)];
+    }
+    return drawn;
+}
+
+/**
+ * Random lookups on a tree larger than the caches, one find() after the
+ * other versus the interleaved descents of find_many() / has_many()
+ * (positive = keys found).
+ */
+template<typename Balance>
+void bench_find_many(std::string&& name, std::size_t entries, std::size_t lookups) {
+    using Bst = bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                    _node_pool, 0, Balance>;
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{0, (int) (2 * entries)};
+    Bst _map;
+    for (std::size_t i = 0; i < entries; i++) _map.insert({distribution(generator), 0});
+    std::vector<int> keys(lookups);
+    for (auto& k : keys) k = distribution(generator);
+
+    stats _find{name + " find", lookups};
+    for (auto k : keys) _find.positive += _map.find(k) != _map.end();
+    _find.done();
+
+    std::vector<typename Bst::iterator> found(lookups);
+    stats _find_many{name + " find_many", lookups};
+    _find_many.positive = _map.find_many(keys.begin(), keys.end(), found.begin());
+    _find_many.done();
+
+    std::vector<char> has(lookups);
+    stats _has_many{name + " has_many", lookups};
+    _has_many.positive = _map.has_many(keys.begin(), keys.end(), has.begin());
+    _has_many.done();
+    print_table(_find, _find_many, _has_many);
+}
+
+/**
+ * Lookups of string keys sharing a prefix: std::less (two comparisons
+ * per node) versus a three-way comparator, then looking up string views
+ * by building a key versus transparently (positive = keys found).
+ */
+void bench_three_way(std::size_t entries) {
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{0, (int) (2 * entries)};
+    auto make_key = [](int i) { return "users/" + std::to_string(i) + "/profile"; };
+    bst<std::string, int> less_map;
+    bst<std::string, int, bst_string_compare> three_way_map;
+    for (std::size_t i = 0; i < entries; i++) {
+        auto k = make_key(distribution(generator));
+        less_map.insert({k, 0});
+        three_way_map.insert({k, 0});
+    }
+    std::vector<std::string> keys(FIND);
+    for (auto& k : keys) k = make_key(distribution(generator));
+
+    stats _less{"std::less find", FIND};
+    for (auto& k : keys) _less.positive += less_map.find(k) != less_map.end();
+    _less.done();
+    stats _three_way{"three-way find", FIND};
+    for (auto& k : keys) _three_way.positive += three_way_map.find(k) != three_way_map.end();
+    _three_way.done();
+
+    std::vector<std::string_view> views{keys.begin(), keys.end()};
+    stats _built{"view find (built)", FIND};
+    for (auto k : views) _built.positive += less_map.find(std::string{k}) != less_map.end();
+    _built.done();
+    stats _transparent{"view find (transparent)", FIND};
+    for (auto k : views) _transparent.positive += three_way_map.find(k) != three_way_map.end();
+    _transparent.done();
+    print_table(_less, _three_way, _built, _transparent);
+}
+
+/**
+ * Lookups of URL keys, longer than the inline string buffer, without and
+ * with the key prefixes cached in the nodes: first with distinct hosts
+ * leading, then behind a shared scheme (the prefixes tie, positive = keys
+ * found).
+ */
+void bench_prefix(std::size_t entries) {
+    for (std::string scheme : {"", "https://"}) {
+        std::default_random_engine generator{SEED};
+        std::uniform_int_distribution<int> distribution{0, (int) (2 * entries)};
+        auto make_key = [&scheme](int i) {
+            std::string host;
+            for (int h = i; h > 0 || host.size() < 6; h /= 26) host += (char) ('a' + h % 26);
+            return scheme + host + ".example.com/users/" + std::to_string(i);
+        };
+        bst<std::string, int, bst_string_compare> plain;
+        bst<std::string, int, bst_prefix_compare> prefixed;
+        for (std::size_t i = 0; i < entries; i++) {
+            auto k = make_key(distribution(generator));
+            plain.insert({k, 0});
+            prefixed.insert({k, 0});
+        }
+        std::vector<std::string> keys(FIND);
+        for (auto& k : keys) k = make_key(distribution(generator));
+
+        std::string name = scheme.empty() ? "host" : "https";
+        stats _plain{name + " find", FIND};
+        for (auto& k : keys) _plain.positive += plain.find(k) != plain.end();
+        _plain.done();
+        stats _prefixed{name + " find (prefix)", FIND};
+        for (auto& k : keys) _prefixed.positive += prefixed.find(k) != prefixed.end();
+        _prefixed.done();
+        print_table(_plain, _prefixed);
+    }
+}
+
+/**
+ * Lookups on a map, on a std::map and on the frozen snapshot of the map
+ * (Eytzinger layout, branchless descents, positive = keys found).
+ */
+void bench_frozen(std::string&& name, std::size_t entries, std::size_t lookups) {
+    std::default_random_engine generator{SEED};
+    std::uniform_int_distribution<int> distribution{0, (int) (2 * entries)};
+    bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+        _node_pool, 0, balance_avl> _map;
+    std::map<int, int> _std;
+    for (std::size_t i = 0; i < entries; i++) {
+        int k = distribution(generator);
+        _map.insert({k, 0});
+        _std.insert({k, 0});
+    }
+    auto _frozen = _map.freeze();
+    std::vector<int> keys(lookups);
+    for (auto& k : keys) k = distribution(generator);
+
+    stats _find{name + " bst find", lookups};
+    for (auto k : keys) _find.positive += _map.find(k) != _map.end();
+    _find.done();
+    stats _std_find{name + " std::map find", lookups};
+    for (auto k : keys) _std_find.positive += _std.find(k) != _std.end();
+    _std_find.done();
+    stats _frozen_find{name + " frozen find", lookups};
+    for (auto k : keys) _frozen_find.positive += _frozen.find(k) != _frozen.end();
+    _frozen_find.done();
+    print_table(_find, _std_find, _frozen_find);
+}
+
+template<typename Balance>
+void bench_lookups(std::string&& name, const std::vector<int>& keys, const std::vector<int>& lookups) {
+    using Bst = bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                    _node_pool, 0, Balance>;
+    using pair = typename Bst::value_type;
+    Bst _map;
+    for (auto k : keys) _map.insert(pair{k, 0});
+
+    stats _find{name + " Find", lookups.size()};
+    for (auto k : lookups) {
+        if (_map.find(k) != _map.end()) {
+            _find.positive++;
+        } else {
+            _find.negative++;
+        }
+    }
+    _find.done();
+    print_table(_find);
+}
+
 
 int main() {
 
@@ -293,6 +1202,173 @@ int main() {
     }
 #endif
 
+#ifdef __BENCHMARK_STORAGE
+    // Node storage: plain new / delete versus node pool
+    bench_storage<bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>, _node_heap>>("heap");
+    bench_storage<bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>, _node_pool>>("pool");
+#endif
+
+#ifdef __BENCHMARK_COMPACT
+    // Index linked nodes in a contiguous array
+    bench_tree<compact_bst<K, V>>("compact");
+#endif
+
+#ifdef __BENCHMARK_LEAN
+    // Nodes without parent pointer versus bst<> nodes
+    bench_tree<bst<K, V>>("bst");
+    bench_tree<lean_bst<K, V>>("lean");
+#endif
+
+#ifdef __BENCHMARK_SPLIT
+    // 256 bytes values: inline in the nodes versus hot/cold split
+    bench_find<bst<K, payload>>("bst");
+    bench_find<compact_bst<K, payload>>("compact");
+    bench_find<compact_bst<K, payload, std::less<K>, std::uint32_t, 0, true>>("split");
+#endif
+
+#ifdef __BENCHMARK_SMALL
+    // Tiny maps: a tree per map versus inline pairs
+    bench_small<bst<K, V>>("bst");
+    bench_small<small_bst<K, V, 8>>("small");
+#endif
+
+#ifdef __BENCHMARK_INTRUSIVE
+    // Linking pooled objects versus copying them in nodes
+    bench_tree<bst<K, V>>("bst");
+    bench_intrusive();
+#endif
+
+#ifdef __BENCHMARK_COMPACTION
+    // Full scans and lookups on a churned tree, before and after compact()
+    bench_compaction<bst<K, V>>();
+#endif
+
+#ifdef __BENCHMARK_TEARDOWN
+    // Time spent by clear() on the calling thread
+    {
+        bst_reclaimer background{true};
+        bench_teardown<bst<K, std::string>>("eager", nullptr);
+        bench_teardown<bst<K, std::string>>("background", &background);
+    }
+#endif
+
+#ifdef __BENCHMARK_COPY
+    // Deep copy of 500K and 5M entries
+    bench_copy<std::map<K, V>>("map<> 500K", INSERT);
+    bench_copy<bst<K, V>>("bst<> 500K", INSERT);
+    bench_copy<std::map<K, V>>("map<> 5M", 10 * INSERT);
+    bench_copy<bst<K, V>>("bst<> 5M", 10 * INSERT);
+#endif
+
+#ifdef __BENCHMARK_BALANCE
+    // Balancing policies on random, ascending and descending insertions
+    // (the unbalanced tree is quadratic on sorted ones, it gets less entries)
+    bench_balance<balance_heuristic>("heuristic", INSERT);
+    bench_balance<balance_avl>("avl", INSERT);
+    bench_balance<balance_red_black>("red-black", INSERT);
+    bench_balance<balance_treap>("treap", INSERT);
+    bench_balance<balance_none>("none", INSERT / 50);
+
+    // Rebuild after a bulk load (positive = depth once rebuilt)
+    bench_rebuild<balance_none>("none", INSERT);
+    bench_rebuild<balance_heuristic>("heuristic", INSERT);
+    bench_rebuild<balance_red_black>("red-black", INSERT);
+#endif
+
+#ifdef __BENCHMARK_ZIPF
+    // Skewed lookups (1% of the keys get ~90% of them, long enough for the
+    // adaptive trees to settle) then uniform ones, adapting versus balancing
+    {
+        std::default_random_engine generator{SEED};
+        std::uniform_int_distribution<int> distribution;
+        std::vector<int> keys(INSERT);
+        for (auto&& k : keys) k = distribution(generator);
+
+        const auto skewed = zipf_lookups(keys, 10 * FIND, 1.2);
+        bench_lookups<balance_heuristic>("zipf heuristic", keys, skewed);
+        bench_lookups<balance_avl>("zipf avl", keys, skewed);
+        bench_lookups<balance_red_black>("zipf red-black", keys, skewed);
+        bench_lookups<balance_splay>("zipf splay", keys, skewed);
+        bench_lookups<balance_adaptive>("zipf adaptive", keys, skewed);
+
+        const auto uniform = zipf_lookups(keys, FIND, 0);
+        bench_lookups<balance_heuristic>("uniform heuristic", keys, uniform);
+        bench_lookups<balance_splay>("uniform splay", keys, uniform);
+        bench_lookups<balance_adaptive>("uniform adaptive", keys, uniform);
+    }
+#endif
+
+#ifdef __BENCHMARK_LATENCY
+    // Per operation latencies: rebalancing on every operation, all at once
+    // every so often, or deferred and spread by a budget
+    bench_latency<balance_heuristic>("heuristic", INSERT / 5, 0, 0);
+    bench_latency<balance_avl>("avl", INSERT / 5, 0, 0);
+    bench_latency<balance_red_black>("red-black", INSERT / 5, 0, 0);
+    bench_latency<balance_none>("none 1k bal", INSERT / 5, 1000, 0);
+    bench_latency<balance_incremental<>>("incr 1k bal", INSERT / 5, 1000, 0);
+    bench_latency<balance_incremental<>>("incr step 1", INSERT / 5, 0, 1);
+    bench_latency<balance_incremental<2, 2>>("incr per-op 2", INSERT / 5, 0, 0);
+#endif
+
+#ifdef __BENCHMARK_LOAD
+    // Cold start: the iteration constructor versus the bulk load
+    bench_load<bst<int, int>>("bst<>", 10 * INSERT);
+    bench_load<bst<int, int, std::less<int>, std::size_t, std::allocator<std::pair<const int, int>>,
+                   _node_pool, 0, balance_red_black>>("red-black", 10 * INSERT);
+#endif
+
+#ifdef __BENCHMARK_BATCH
+    // Sorted batches of updates, one by one versus merged
+    bench_batch<bst<int, int>>("bst<>", INSERT);
+#endif
+
+#ifdef __BENCHMARK_SHARDS
+    // Key ranges moved between two shards
+    bench_shards<balance_avl>("avl", 2 * INSERT, 10);
+    bench_shards<balance_red_black>("red-black", 2 * INSERT, 10);
+#endif
+
+#ifdef __BENCHMARK_SETS
+    // Set operations between two maps of random keys
+    bench_sets<balance_avl>("avl", INSERT);
+    bench_sets<balance_red_black>("red-black", INSERT);
+#endif
+
+#ifdef __BENCHMARK_WINDOW
+    // Sliding window eviction
+    bench_window<balance_avl>("avl", 2 * INSERT, 100);
+    bench_window<balance_red_black>("red-black", 2 * INSERT, 100);
+#endif
+
+#ifdef __BENCHMARK_PURGE
+    // Removal of the keys matching a predicate
+    bench_purge<balance_avl>("avl", 2 * INSERT);
+    bench_purge<balance_red_black>("red-black", 2 * INSERT);
+    bench_purge<balance_treap>("treap", 2 * INSERT);
+#endif
+
+#ifdef __BENCHMARK_FIND_MANY
+    // Batches of lookups on trees larger than the caches
+    bench_find_many<balance_avl>("avl", 10 * INSERT, 2 * FIND);
+    bench_find_many<balance_red_black>("red-black", 10 * INSERT, 2 * FIND);
+#endif
+
+#ifdef __BENCHMARK_THREE_WAY
+    // String keys, three-way and transparent comparators
+    bench_three_way(INSERT);
+#endif
+
+#ifdef __BENCHMARK_PREFIX
+    // URL keys, key prefixes cached in the nodes
+    bench_prefix(2 * INSERT);
+#endif
+
+#ifdef __BENCHMARK_FROZEN
+    // Lookups on frozen snapshots, within and beyond the caches
+    bench_frozen(std::to_string(INSERT), INSERT, 2 * FIND);
+    bench_frozen(std::to_string(10 * INSERT), 10 * INSERT, 2 * FIND);
+#endif
+
 #ifdef __PROFILE_MAP
     {
         using rnd_t = unsigned int;
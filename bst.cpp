@@ -3,6 +3,25 @@
 #include <iostream>
 #include <utility>
 #include <sstream>
+#include <string>
+#include <string_view>
+#include <new>
+#include <type_traits>
+#include <memory>
+#include <memory_resource>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <array>
+#include <exception>
+#include <cstdint>
+#include <iterator>
+#include <algorithm>
+#if __cplusplus > 201703L && __has_include(<compare>)
+#include <compare>
+#endif
 
 #define __EXPERIMENTAL_AUTO_BALANCE
 #define __ITERATOR_RECOVERABLE
@@ -22,10 +41,17 @@
 #define MIN(a, b) (b) < (a) ? (b) : (a)
 #define NNL(_1, _2) (_1) != nullptr ? (_1) : (_2)
 
-// Build a conditional block for comparison
-#define TRIPLE_COMPARE(cmp, a, b, less, gt, eq) \
-    if (cmp(a, b)) { less; }                    \
-    else if (cmp(b, a)) { gt; }                 \
+// Build a conditional block on a three-way result
+#define TRIPLE_BRANCH(c, less, gt, eq)         \
+    if (int __c = (c); __c < 0) { less; }      \
+    else if (__c > 0) { gt; }                  \
+    else { eq; }
+
+// Build a conditional block for comparison (one call for three-way
+// comparators, see _three_way)
+#define TRIPLE_COMPARE(cmp, a, b, less, gt, eq)              \
+    if (int __c = _three_way(cmp, a, b); __c < 0) { less; }  \
+    else if (__c > 0) { gt; }                                \
     else { eq; }
 
 // No insertion return pair
@@ -59,65 +85,215 @@
 // Get right branch depth for a node
 #define DEPTH_RIGHT(node) (node)->right ? ((node)->right->depth + 1) : 0
 
+// Depths saturate, degenerate trees (eg. splayed ones) keep depth() meaningful
+#define __DEPTH_MAX 254
+
 // Update node depth value
-#define REFRESH_DEPTH(node) (node)->depth = MAX(DEPTH_LEFT(node), DEPTH_RIGHT(node))
+#define REFRESH_DEPTH(node) (node)->depth = MIN(MAX(DEPTH_LEFT(node), DEPTH_RIGHT(node)), __DEPTH_MAX)
 
 // Detach node's children
 #define DETACH(node) (node)->left = nullptr; (node)->right = nullptr;
 
+// Hint the cache to fetch a node about to be visited
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(node) __builtin_prefetch(node)
+#else
+#define PREFETCH(node)
+#endif
+
+// Node pool slab sizes (in nodes), slabs double up to the maximum
+#define __POOL_SLAB_FIRST 16
+#define __POOL_SLAB_MAX 4096
+
+// Trees of at least this many nodes are copied by parallel workers
+#define __PARALLEL_CLONE_MIN (1 << 16)
+#define __PARALLEL_CLONE_WORKERS 8
+
+// Set operations on maps of at least this many nodes are divided among
+// parallel workers
+#define __PARALLEL_SET_MIN (1 << 16)
+#define __PARALLEL_SET_WORKERS 8
+
+// Batches of at least size / __BATCH_MERGE_RATIO pairs are merged with the
+// tree (linear in the size), smaller ones inserted one by one
+#define __BATCH_MERGE_RATIO 2
+
+// Descents run at once by find_many() / has_many(), interleaved level by level
+#define __FIND_MANY_LANES 16
+
 
 template <typename K, typename V>
+struct _value_traits;
+
+template <typename K, typename V, typename Prefix = void>
 struct _node;
 
 template<typename elem_type, typename VT>
 class _iterator;
 
+template <typename node, typename Alloc>
+class _node_pool;
+
+template <typename node, typename Alloc>
+class _node_heap;
+
+template <typename node, std::size_t N>
+class _inline_nodes;
+
+template <typename node, typename Balance>
+class _tree_core;
+
+struct balance_heuristic;
+struct balance_none;
+struct balance_avl;
+struct balance_red_black;
+template <bool Adaptive>
+struct _balance_treap;
+using balance_treap = _balance_treap<false>;
+using balance_adaptive = _balance_treap<true>;
+struct balance_splay;
+template <unsigned char Threshold = 2, std::size_t PerOp = 0>
+struct balance_incremental;
+
+class bst_reclaimer;
+
+template <typename K, typename V, typename Compare = std::less<K>, typename size_type = std::uint32_t>
+class frozen_bst;
+
+/**
+ * Tags a range of values sorted by key, without duplicated keys, to be
+ * bulk loaded (see bst).
+ */
+struct sorted_unique_t { explicit sorted_unique_t() = default; };
+inline constexpr sorted_unique_t sorted_unique{};
+
+/**
+ * The map whose value is kept on equal keys by set operations (see bst).
+ */
+enum class bst_keep { left, right };
+
+
+/**
+ * Comparators either tell whether a key is lower than another (returning
+ * bool, or anything convertible to it, as std::less) or compare them in one
+ * call, returning a three-way result: negative, zero or positive. Three-way
+ * comparators opt in by declaring is_three_way (an int as
+ * std::string::compare()), or by returning an operator<=> ordering.
+ */
+template <typename Compare, typename = void>
+struct _declares_three_way: std::false_type {};
+
+template <typename Compare>
+struct _declares_three_way<Compare, std::void_t<typename Compare::is_three_way>>: std::true_type {};
+
+template <typename T>
+struct _is_ordering: std::false_type {};
+
+#ifdef __cpp_lib_three_way_comparison
+template <>
+struct _is_ordering<std::strong_ordering>: std::true_type {};
+template <>
+struct _is_ordering<std::weak_ordering>: std::true_type {};
+template <>
+struct _is_ordering<std::partial_ordering>: std::true_type {};
+#endif
 
-template <typename K, typename V, typename Compare = std::less<K>, typename size_type = std::size_t>
-class bst {
-
-// DEFINITIONS
+template <typename Compare, typename A, typename B>
+struct _is_three_way: std::integral_constant<bool, _declares_three_way<Compare>::value || _is_ordering<
+        typename std::decay<decltype(std::declval<const Compare&>()(std::declval<const A&>(),
+                                                                    std::declval<const B&>()))>::type>::value> {};
+
+/**
+ * Compares two keys, with two calls of a less comparator at most.
+ * @param cmp   the comparator
+ * @param a     the first key
+ * @param b     the second key
+ * @return      -1, 0 or 1 as a is lower, equal or greater than b
+ */
+template <typename Compare, typename A, typename B>
+int _three_way(const Compare& cmp, const A& a, const B& b) {
+    if constexpr (_is_three_way<Compare, A, B>::value) {
+        auto c = cmp(a, b);
+        return (c > 0) - (c < 0);
+    } else {
+        return cmp(a, b) ? -1 : (cmp(b, a) ? 1 : 0);
+    }
+}
 
-    Compare compare;
+/**
+ * Whether a key is lower than another one.
+ * @param cmp   the comparator
+ * @param a     the first key
+ * @param b     the second key
+ * @return      true if a is lower than b
+ */
+template <typename Compare, typename A, typename B>
+bool _less(const Compare& cmp, const A& a, const B& b) {
+    if constexpr (_is_three_way<Compare, A, B>::value) {
+        return cmp(a, b) < 0;
+    } else {
+        return cmp(a, b);
+    }
+}
 
-    using node = _node<K, V>;
-    using pair_type = std::pair<const K, V>;
+/**
+ * Three-way transparent comparator of string keys: one pass over the
+ * bytes per node, and lookups by std::string_view or const char* without
+ * building a K.
+ */
+struct bst_string_compare {
+    using is_transparent = void;
+    using is_three_way = void;
+
+    int operator()(std::string_view a, std::string_view b) const noexcept {
+        return a.compare(b);
+    }
+};
 
-    node* root{nullptr};
-    size_type _size{0};
+/**
+ * bst_string_compare whose nodes cache a prefix of their key: the first 8
+ * bytes big endian (zero padded), ordered as the keys. Descents compare
+ * the prefixes first and read the keys (often a miss on their own buffer)
+ * only when they are equal. Nodes take 8 more bytes.
+ */
+struct bst_prefix_compare: bst_string_compare {
+
+    static std::uint64_t prefix(std::string_view s) noexcept {
+        std::uint64_t p = 0;
+        for (std::size_t i = 0; i < sizeof(p); i++) {
+            p = p << 8 | (i < s.size() ? static_cast<unsigned char>(s[i]) : 0u);
+        }
+        return p;
+    }
+};
 
-// INTERNAL
+/**
+ * The comparator if it provides an order preserving prefix of the keys,
+ * prefix(k): distinct prefixes order the keys as the comparator does,
+ * equal ones tell nothing. Nodes cache it (see bst_prefix_compare).
+ */
+template <typename K, typename Compare, typename = void>
+struct _key_prefix { using type = void; };
+
+template <typename K, typename Compare>
+struct _key_prefix<K, Compare, std::void_t<decltype(Compare::prefix(std::declval<const K&>()))>> {
+    using type = Compare;
+};
 
-    // INNER
-    enum find_method{EXACT, LEFT, RIGHT};
 
-    /**
-     * Provided a local root, find a node by key within the downstream tree.
-     * If method is different from EXACT, the function will always return
-     * a node that will be the LEFT (or RIGHT) closest node to the searched key.
-     * @param current   local root to start from
-     * @param k         key to search for
-     * @param method    EXACT, LEFT, RIGHT
-     * @return          the found node or nullptr
-     */
-    node* __find_key(node* current, const K& k, const find_method method) noexcept {
-        node *lastl{nullptr}, *lastr{nullptr}, *found{nullptr};
+/**
+ * Links and balancing of a tree whose nodes provide parent, left, right,
+ * depth and mark (bst nodes or intrusive hooks). Neither allocates nor
+ * compares. Depths are kept by every policy, the Balance policy decides
+ * the rotations (and the meaning of mark). Trees inherit it privately,
+ * its members are public for the policies only.
+ */
+template <typename node, typename Balance>
+class _tree_core {
 
-        while (current != nullptr && found == nullptr) {
-            TRIPLE_COMPARE(compare, k, current->data.first,
-                           lastr = current; current = current->left,
-                           lastl = current; current = current->right,
-                           found = current
-            );
-        }
+public:
 
-        switch (method) {
-            case EXACT: return found;
-            case LEFT: return NNL(found, lastl);
-            case RIGHT: return NNL(found, lastr);
-            default: return nullptr;
-        }
-    }
+    node* root{nullptr};
 
     /**
      * Traverses the tree from the local root and returns the left-most node
@@ -141,6 +317,17 @@ class bst {
         return n;
     }
 
+    /**
+     * Returns the next node in key order
+     * @param n     the node
+     * @return      the successor or nullptr
+     */
+    static node* __successor(node* n) noexcept {
+        if (n->right) return __left_most(n->right);
+        while (n->parent && n->parent->right == n) n = n->parent;
+        return n->parent;
+    }
+
     /**
      * Given a local-root performs a left rotation of the tree below.
      * @param n     local root to rotate
@@ -179,6 +366,32 @@ class bst {
         return NNL(nnew, n);
     }
 
+    /**
+     * Rotates a local root and refreshes the depths above the new one.
+     * @param n     local root to rotate
+     * @param left  left rotation if true, right otherwise
+     * @return      the new local root for this sub tree
+     */
+    node* __rotate_refresh(node* n, bool left) noexcept {
+        node* top = left ? __rotate_left(n) : __rotate_right(n);
+        __refresh_up(top->parent);
+        return top;
+    }
+
+    /**
+     * Refreshes depths from the node up, stopping at the first one whose
+     * depth did not change (the ones above are then up to date).
+     * @param n     the node to start from
+     */
+    void __refresh_up(node* n) noexcept {
+        while (n != nullptr) {
+            unsigned char before = n->depth;
+            REFRESH_DEPTH(n);
+            if (n->depth == before) return;
+            n = n->parent;
+        }
+    }
+
     /**
      * Given a local-root performs rotation if required.
      *
@@ -232,13 +445,14 @@ class bst {
 #ifdef __DEBUG_BALANCE
             std::cout << std::endl;
 #endif
-            n->depth = MAX(dl, dr);
+            n->depth = MIN(MAX(dl, dr), __DEPTH_MAX);
             return n;
         }
     }
 
     /**
-     * Given a node it balances it and all its parents up to the root.
+     * Given a node it balances it and its parents up to the first one
+     * neither rotated nor changed in depth.
      * @param n     the node to start from
      */
     void __balance_node(node* n) noexcept {
@@ -247,234 +461,2474 @@ class bst {
             // deep depths has already been updated. The new local root
             // may be the same node `n` or a `n`'s ex-children, in both
             // cases those nodes has been already evaluated.
-            n = __if_required_rotate(n)->parent;
+            unsigned char before = n->depth;
+            node* top = __if_required_rotate(n);
+            if (top == n && n->depth == before) return;
+            n = top->parent;
+        }
+    }
+
+    /**
+     * Rotates left count nodes along the right vine hanging from the root,
+     * every other one (a fold of the Day-Stout-Warren rebuild).
+     * @param count     the number of rotations
+     */
+    void __fold(std::size_t count) noexcept {
+        node** link = &root;
+        node* parent = nullptr;
+        for (std::size_t i = 0; i < count; i++) {
+            node* n = *link;
+            node* nnew = n->right;
+            n->right = nnew->left;
+            if (nnew->left) nnew->left->parent = n;
+            nnew->left = n;
+            n->parent = nnew;
+            nnew->parent = parent;
+            *link = nnew;
+            parent = nnew;
+            link = &nnew->right;
         }
     }
 
     /**
-     * Balances the entire tree.
+     * Rebuilds the tree in place with the minimum depth (Day-Stout-Warren),
+     * in linear time and without allocating.
      *
      * ALGORITHM:
-     * Performing a deep first iteration (where it is granted LEFT-CHILD,
-     * RIGHT-CHILD, PARENT visit order) on the tree and apply `__if_required_rotate`
-     * on the node.
-     *
+     * Right rotations straighten the tree into a right vine of n nodes,
+     * then the vine is folded by left rotations of every other node, first
+     * the n - m exceeding a perfect tree of m nodes, then halving. Leaves
+     * end up on the last two levels. Depths are recomputed (and marks
+     * cleared) with a deep first iteration.
      */
-    void __balance_tree(/*node* tree*/) noexcept {
+    void __rebuild() noexcept {
+        if (root == nullptr) return;
+
+        // Tree to vine
+        node* tail = nullptr;
+        node* rest = root;
+        std::size_t size = 0;
+        while (rest != nullptr) {
+            if (rest->left) {
+                node* nnew = rest->left;
+                rest->left = nnew->right;
+                if (nnew->right) nnew->right->parent = rest;
+                nnew->right = rest;
+                rest->parent = nnew;
+                rest = nnew;
+            } else {
+                rest->parent = tail;
+                if (tail) tail->right = rest; else root = rest;
+                tail = rest;
+                rest = rest->right;
+                size++;
+            }
+        }
+
+        // Vine to tree
+        std::size_t perfect = 1;
+        while (perfect * 2 + 1 <= size) perfect = perfect * 2 + 1;
+        __fold(size - perfect);
+        while (perfect > 1) {
+            perfect /= 2;
+            __fold(perfect);
+        }
 
-        // Deep first iteration strategy
+        // Depths, deep first
         node* current = root;
         char dir_flag = 0; // 0 = NONE, 1 = UP_FROM_LEFT, 2 = UP_FROM_RIGHT
-
-        while(current != nullptr) {
+        while (current != nullptr) {
             if (dir_flag == 0 && current->left) {
-                // Go down on the left (nothing visited yet)
-                dir_flag = 0;
                 current = current->left;
             } else if (dir_flag != 2 && current->right) {
-                // Go down on the right (left was visited, but right not)
                 dir_flag = 0;
                 current = current->right;
             } else {
-                // Im a leaf OR my children were already visited
-
-                // Re-balance by evaluating children depths (being the iteration
-                // deep-first we have already computed updated depths for the
-                // children nodes.
-
-                // The parent node is evaluated after L/R children hence for any
-                // type of rotation the new LOCAL ROOT has been evaluated
-                // hence continue from the new LOCAL ROOT
-                current = __if_required_rotate(current);
-                // Go up
+                REFRESH_DEPTH(current);
+                current->mark = 0;
                 dir_flag = current->parent && current == current->parent->left ? 1 : 2;
                 current = current->parent;
             }
         }
+        Balance::rebuilt(*this);
     }
 
     /**
-     * Inserts a pair in the tree, returning the node.
-     * @param x     pair to be inserted
-     * @return      the inserted node or nullptr if key already present
+     * Sets the children of a middle node between two trees, placing it on
+     * the spine of the deeper one at the first node not deeper than the
+     * other tree by more than one (the root if their depths are close).
+     * The tree root becomes the one of the whole, m is left to be linked.
+     * @param l     the tree of the lower keys (maybe nullptr)
+     * @param m     the middle node, detached
+     * @param r     the tree of the greater keys (maybe nullptr)
+     * @return      the child slot (or &root) where m goes
      */
-    node* __insert(pair_type&& x) {
-        node* parent = nullptr;
+    node** __attach(node* l, node* m, node* r) noexcept {
+        unsigned int hl = l ? l->depth + 1 : 0;
+        unsigned int hr = r ? r->depth + 1 : 0;
+        node* p = nullptr;
         node** handle = &root;
+        if (hl > hr + 1) {
+            root = l;
+            while (l != nullptr && l->depth > hr) {
+                p = l;
+                handle = &l->right;
+                l = l->right;
+            }
+        } else if (hr > hl + 1) {
+            root = r;
+            while (r != nullptr && r->depth > hl) {
+                p = r;
+                handle = &r->left;
+                r = r->left;
+            }
+        }
+        m->parent = p;
+        CHILD_LEFT(m, l);
+        CHILD_RIGHT(m, r);
+        REFRESH_DEPTH(m);
+        return handle;
+    }
 
-        while (*handle != nullptr) {
-            parent = *handle;
-            TRIPLE_COMPARE(compare, x.first, parent->data.first,
-                           handle = &(parent->left),
-                           handle = &(parent->right),
-                           return nullptr
-            )
+    /**
+     * Joins two trees through a middle node: the keys of l are lower than
+     * the one of m, lower than the ones of r. The tree root is overwritten.
+     * @param l     the tree of the lower keys (maybe nullptr)
+     * @param m     the middle node, detached
+     * @param r     the tree of the greater keys (maybe nullptr)
+     * @return      the root of the whole
+     */
+    node* __join(node* l, node* m, node* r) noexcept {
+        Balance::join(*this, l, m, r);
+        return root;
+    }
+
+    /**
+     * Joins as __join(), given the ranks the policy may need (black heights
+     * of red-black trees, 0 with the other policies): callers joining
+     * repeatedly track them instead of having each join count them.
+     * @param l     the tree of the lower keys (maybe nullptr)
+     * @param rl    the rank of l
+     * @param m     the middle node, detached
+     * @param r     the tree of the greater keys (maybe nullptr)
+     * @param rr    the rank of r
+     * @param rank  set to the rank of the whole
+     * @return      the root of the whole
+     */
+    node* __join(node* l, std::size_t rl, node* m, node* r, std::size_t rr, std::size_t& rank) noexcept {
+        if constexpr (Balance::ranked) {
+            rank = Balance::join(*this, l, rl, m, r, rr);
+        } else {
+            Balance::join(*this, l, m, r);
+            rank = 0;
         }
+        return root;
+    }
 
-        // If here we have an allocable branch
-        *handle = new node{parent, std::move(x)};
+    /**
+     * @return      the rank of a tree (see __join), O(log n) at most
+     */
+    static std::size_t __rank(const node* n) noexcept {
+        return Balance::rank(n);
+    }
 
-#ifdef __EXPERIMENTAL_AUTO_BALANCE
-        __balance_node((*handle)->parent);
-#endif
+    /**
+     * Lets the policy adapt a sub tree that became a tree of its own.
+     * @param n     its root (maybe nullptr)
+     */
+    static void __rooted(node* n) noexcept {
+        Balance::rooted(n);
+    }
 
-        _size ++;
-        return *handle;
+    /**
+     * @return      the rank of a node, given the one of its children
+     */
+    static std::size_t __rank_above(const node* n, std::size_t below) noexcept {
+        return Balance::rank_above(n, below);
     }
 
     /**
-     * Extracts a node from the tree by key. The extracted node
-     * is completely detached from the tree and should be deleted
-     * after use.
-     * @param k     the key to search for
-     * @return      the node or nullptr if key was not found
+     * Links a new leaf to the tree and balances from its parent.
+     * @param handle    the free child slot of the parent (or &root)
+     * @param n         the new leaf, its parent already set
      */
-    node* __extract(const K& k) noexcept {
-        node* n = __find_key(root, k, EXACT);
-        if (n == nullptr) return n;
+    void __link(node** handle, node* n) noexcept {
+        *handle = n;
+        Balance::inserted(*this, n);
+    }
 
-        // Key node was found, take:
+    /**
+     * Detaches a node from the tree, putting in its place the closest
+     * node of its deeper branch, and balances the amputation area.
+     * @param n     the node to be detached
+     */
+    void __unlink(node* n) noexcept {
+        // Take:
         // - right-most in left branch
         // - left-most in right branch
         // them on this node place
         node* p = n->parent;
+        // The node taking the freed position, its parent and the node
+        // implanted in place of n (if any)
+        node *x, *x_parent, *implanted{nullptr};
 
         if (n->left && n->right) {
             // Multiple branches present
             // Choose left or right based on depths
             node* nnew;
-            node* nnew_parent;
 
             if (n->right->depth > n->left->depth) {
                 // Go right
                 nnew = __left_most(n->right);
-                // extract from tree: It is a left child and has no left child
-                // !! If we do not move (eg there are no LEFT children) nnew->parent
-                // !! is a RIGHT child
-                CHILD_AS(nnew->parent, nnew, nnew->right);
+                x = nnew->right;
             } else {
                 // Go left
                 nnew = __right_most(n->left);
-                // extract from tree: It is a right child and has no right child
-                // !! If we do not move (eg there are no RIGHT children) nnew->parent
-                // !! is a RIGHT child
-                CHILD_AS(nnew->parent, nnew, nnew->left);
+                x = nnew->left;
             }
+            // extract from tree: it has no child on the side we came from
+            // !! If we do not move nnew->parent is n itself
+            CHILD_AS(nnew->parent, nnew, x);
 
-            nnew_parent = nnew->parent;
+            // The implanted node may have been a child of the extracted one
+            x_parent = nnew->parent == n ? nnew : nnew->parent;
 
-            // Inplace it in the tree
+            // Inplace it in the tree, the position keeps its depth and mark,
+            // n leaves with the mark of the freed position
             CHILD_LEFT(nnew, n->left);
             CHILD_RIGHT(nnew, n->right);
             CHILD_AS(p, n, nnew);
             DETACH(n);
-
-            // Balance starting from the amputation area, both the extracted
-            // and the implanted nodes will be balanced
-
-#ifdef __EXPERIMENTAL_AUTO_BALANCE
-            __balance_node(nnew_parent);
-#endif
+            nnew->depth = n->depth;
+            std::swap(nnew->mark, n->mark);
+            implanted = nnew;
         } else {
             // Only one branch present, move it
-            node* nnew = n->left ? n->left : n->right;
-            CHILD_AS(p, n, nnew);
+            x = n->left ? n->left : n->right;
+            CHILD_AS(p, n, x);
             DETACH(n);
+            x_parent = p;
+        }
 
-            // Balance node parents (balance is unlikely required, but the
-            // function is used to propagate depths)
-#ifdef __EXPERIMENTAL_AUTO_BALANCE
-            __balance_node(p);
-#endif
+        // Balance starting from the amputation area
+        Balance::erased(*this, x, x_parent, implanted, n->mark);
+    }
+
+    /**
+     * Lets the policy adapt to a lookup that found the node.
+     * @param n     the node found
+     */
+    void __accessed(node* n) noexcept {
+        Balance::accessed(*this, n);
+    }
+
+    /**
+     * Lets the policy restore its invariants on a tree built anew.
+     */
+    void __rebuilt() noexcept {
+        Balance::rebuilt(*this);
+    }
+
+    /**
+     * Lets the policy restore its invariants on nodes moved to other
+     * addresses.
+     */
+    void __relocated() noexcept {
+        Balance::relocated(*this);
+    }
+
+    /**
+     * Checks the links and the depths of every node, and the invariants
+     * of the policy (DEBUG).
+     * @return      true if they hold
+     */
+    bool __valid() const noexcept {
+        if (root && root->parent) return false;
+        node* current = root;
+        char dir_flag = 0; // 0 = NONE, 1 = UP_FROM_LEFT, 2 = UP_FROM_RIGHT
+        while (current != nullptr) {
+            if (dir_flag == 0) {
+                if ((current->left && current->left->parent != current) ||
+                    (current->right && current->right->parent != current)) return false;
+                unsigned int depth = MIN(MAX(DEPTH_LEFT(current), DEPTH_RIGHT(current)), __DEPTH_MAX);
+                if (current->depth != depth || !Balance::valid(*this, current)) return false;
+            }
+            if (dir_flag == 0 && current->left) {
+                current = current->left;
+            } else if (dir_flag != 2 && current->right) {
+                dir_flag = 0;
+                current = current->right;
+            } else {
+                dir_flag = current->parent && current == current->parent->left ? 1 : 2;
+                current = current->parent;
+            }
         }
+        return true;
+    }
 
-        _size--;
-        return n;
+    /**
+     * Performs a bounded share of the deferred rebalancing, if any.
+     * @param budget    the number of nodes to fix at most
+     * @return          true if some rebalancing is still pending
+     */
+    bool __rebalance_step(std::size_t budget) noexcept {
+        return Balance::step(*this, budget);
     }
 
-// API
+    /**
+     * Balances the entire tree as the policy requires.
+     */
+    void __rebalance() noexcept {
+        Balance::rebalance(*this);
+    }
 
-public:
+};
 
-    // Mimic std::map
-    // https://en.cppreference.com/w/cpp/container/map
-    using key_type = K;
-    using mapped_type = V;
-    using value_type = pair_type;
-    using key_compare = Compare;
 
-    using iterator = _iterator<node, pair_type>;
-    using const_iterator = _iterator<node, const pair_type>;
-    using node_type = node;
+/**
+ * Balancing policies of _tree_core. Each one provides:
+ *
+ * - inserted(tree, n): n is a new leaf just linked
+ * - erased(tree, x, parent, implanted, mark): a node was unlinked, x (maybe
+ *   nullptr) took the freed position below parent, implanted took the place
+ *   of the unlinked node (if it had two children), mark is the one the
+ *   freed position had
+ * - accessed(tree, n): a lookup found n
+ * - rebuilt(tree): the tree was built anew, depths are up to date and
+ *   marks cleared
+ * - relocated(tree): the nodes moved to other addresses (copy, compact),
+ *   shape, depths and marks are kept
+ * - valid(tree, n): whether the invariants of the policy hold at n (DEBUG)
+ * - rooted(n): the sub tree below n became a tree of its own
+ * - ranked, rank(n), rank_above(n, below), join(tree, l, rl, m, r, rr):
+ *   policies whose joins depend on a rank of the trees (the black height)
+ *   take it from the callers able to track it, see _tree_core::__join
+ * - rebalance(tree): explicit balance() request, a rebuild by default
+ * - step(tree, budget): bounded share of the deferred rebalancing, returns
+ *   true if some is still pending
+ * - join(tree, l, m, r): links two trees through a detached middle node
+ *   (see _tree_core::__join), by default m goes on the spine of the deeper
+ *   one as a new leaf would (see _tree_core::__attach)
+ * - rebuildable: whether trees may be linked anew in any balanced shape
+ *
+ * and keeps depths up to date, climbing only until they stop changing.
+ * _balance_hooks provides the ones a policy does not need.
+ */
+struct _balance_hooks {
+
+    // Trees may be linked anew in any balanced shape
+    static constexpr bool rebuildable = true;
+
+    // Joins do not take the ranks of the trees
+    static constexpr bool ranked = false;
+
+    template <typename node>
+    static std::size_t rank(const node*) noexcept { return 0; }
+
+    template <typename node>
+    static std::size_t rank_above(const node*, std::size_t) noexcept { return 0; }
+
+    template <typename Tree, typename node>
+    static void join(Tree& t, node* l, node* m, node* r) noexcept {
+        t.__link(t.__attach(l, m, r), m);
+    }
 
-    // RAII & Copy and move
+    template <typename Tree, typename node>
+    static void accessed(Tree&, node*) noexcept {}
 
-    bst() noexcept {}
+    template <typename Tree>
+    static void rebuilt(Tree&) noexcept {}
 
-    bst(const bst& src) {
-        // Make a copy of the other tree
-        root = src.root == nullptr ? nullptr : new node{*src.root};
-        _size = src._size;
+    template <typename Tree>
+    static void relocated(Tree&) noexcept {}
+
+    template <typename Tree, typename node>
+    static bool valid(const Tree&, const node*) noexcept { return true; }
+
+    template <typename node>
+    static void rooted(node*) noexcept {}
+
+    template <typename Tree>
+    static void rebalance(Tree& t) noexcept {
+        t.__rebuild();
     }
-    bst& operator=(bst const& src) {
-        // Self assign guard
-        if (this == &src) return *this;
-        // Assignment copy
-        delete root;
-        root = src.root == nullptr ? nullptr : new node{*src.root};
-        _size = src._size;
-        return *this;
-    };
 
-    bst(bst&& src) noexcept:
-        root{std::exchange(src.root, nullptr)},
-        _size{std::exchange(src._size, 0)}
-    { /* steal the tree */ }
+    template <typename Tree>
+    static bool step(Tree&, std::size_t) noexcept { return false; }
+};
 
-    bst& operator=(bst&& src) noexcept {
-        delete root;
-        root = std::exchange(src.root, nullptr);
-        _size = std::exchange(src._size, 0);
-        return *this;
+/**
+ * The historical heuristic (see _tree_core::__if_required_rotate),
+ * no depth upper bound is granted.
+ */
+struct balance_heuristic: _balance_hooks {
+
+    template <typename Tree, typename node>
+    static void inserted(Tree& t, node* n) noexcept {
+        t.__balance_node(n->parent);
+    }
+
+    template <typename Tree, typename node>
+    static void erased(Tree& t, node*, node* parent, node*, unsigned char) noexcept {
+        t.__balance_node(parent);
+    }
+};
+
+/**
+ * No rotation on insertion and removal, the tree is balanced on balance()
+ * only (append-free workloads, bulk loads).
+ */
+struct balance_none: _balance_hooks {
+
+    template <typename Tree, typename node>
+    static void inserted(Tree& t, node* n) noexcept {
+        t.__refresh_up(n->parent);
+    }
+
+    template <typename Tree, typename node>
+    static void erased(Tree& t, node*, node* parent, node*, unsigned char) noexcept {
+        t.__refresh_up(parent);
     }
+};
+
+/**
+ * AVL: the branch depths of every node differ at most by one.
+ */
+struct balance_avl: _balance_hooks {
 
     /**
-     * Create a map from an iterable iterable source of
-     * pair<K,V> values.
-     * @tparam Iter
-     * @param begin     The iterator
-     * @param end       The end() iterator
+     * Restores the AVL condition of a local root whose sub trees are AVL,
+     * (single or double rotation).
+     * @param n     local root
+     * @return      the new local root
      */
-    template<typename Iter>
-    bst(Iter begin, Iter end) {
-        while(begin != end) {
-            insert(*begin);
-            ++begin;
+    template <typename Tree, typename node>
+    static node* __fix(Tree& t, node* n) noexcept {
+        int dl = DEPTH_LEFT(n);
+        int dr = DEPTH_RIGHT(n);
+        if (dl > dr + 1) {
+            int cl = DEPTH_LEFT(n->left);
+            int cr = DEPTH_RIGHT(n->left);
+            if (cr > cl) t.__rotate_left(n->left);
+            return t.__rotate_right(n);
+        } else if (dr > dl + 1) {
+            int cl = DEPTH_LEFT(n->right);
+            int cr = DEPTH_RIGHT(n->right);
+            if (cl > cr) t.__rotate_right(n->right);
+            return t.__rotate_left(n);
         }
+        n->depth = MIN(MAX(dl, dr), __DEPTH_MAX);
+        return n;
     }
 
-    ~bst() {
-#ifdef __DEBUG_BST_RAII
-        std::cout << "~bst() size=" << _size << std::endl;
-#endif
-        delete root; // Delete root node and let RAII do the rest
+    /**
+     * Fixes the node and its parents until a local root keeps its depth.
+     */
+    template <typename Tree, typename node>
+    static void __climb(Tree& t, node* n) noexcept {
+        while (n != nullptr) {
+            unsigned char before = n->depth;
+            node* top = __fix(t, n);
+            if (top->depth == before) return;
+            n = top->parent;
+        }
     }
 
-// MODIFIERS
+    template <typename Tree, typename node>
+    static void inserted(Tree& t, node* n) noexcept {
+        __climb(t, n->parent);
+    }
 
-    /**
-     * Inserts a pair in the map. If insertion is successful returns an
-     * iterator to the pair and true, else the end() iterator and false.
-     * @param x     The pair to be inserted
-     * @return      a pair<iterator, bool>
-     */
-    std::pair<iterator, bool> insert(const pair_type& x) { // ✓ testing
-        node* ref = __insert(pair_type{x}); // Clone the pair
-        return ref == nullptr ? NOINSERT : std::pair<iterator, bool>{ iterator{root, ref} , true };
+    template <typename Tree, typename node>
+    static void erased(Tree& t, node*, node* parent, node*, unsigned char) noexcept {
+        __climb(t, parent);
     }
-    std::pair<iterator, bool> insert(pair_type&& x) { // ✓ testing
-        node* ref = __insert(std::move(x));
-        return ref == nullptr ? NOINSERT : std::pair<iterator, bool>{ iterator{root, ref} , true };
+
+    template <typename Tree, typename node>
+    static bool valid(const Tree&, const node* n) noexcept {
+        int dl = DEPTH_LEFT(n);
+        int dr = DEPTH_RIGHT(n);
+        return dl <= dr + 1 && dr <= dl + 1;
+    }
+};
+
+/**
+ * Red-black: the mark holds the color, at most 2 rotations per insertion
+ * and 3 per removal.
+ */
+struct balance_red_black: _balance_hooks {
+
+    enum : unsigned char { BLACK = 0, RED = 1 };
+
+    template <typename node>
+    static bool __black(const node* n) noexcept { return n == nullptr || n->mark == BLACK; }
+
+    /**
+     * @return      the black nodes from n up to the root
+     */
+    template <typename node>
+    static unsigned int __blacks_above(const node* n) noexcept {
+        unsigned int b = 0;
+        for (; n != nullptr; n = n->parent) b += __black(n);
+        return b;
+    }
+
+    /**
+     * Red nodes have black parent and children, and the paths from a node
+     * missing a child up to the root hold as many black nodes as the left
+     * spine.
+     */
+    template <typename Tree, typename node>
+    static bool valid(const Tree& t, const node* n) noexcept {
+        if (!__black(n) && (n->parent == nullptr || !__black(n->parent) || !__black(n->left) || !__black(n->right))) {
+            return false;
+        }
+        if (n->left && n->right) return true;
+        return __blacks_above(n) == __blacks_above(Tree::__left_most(t.root));
+    }
+
+    /**
+     * Fixes a red node whose parent may be red, up to the root.
+     * @return      true if the root ended red (turned black, the black
+     *              height grows)
+     */
+    template <typename Tree, typename node>
+    static bool __fix_red(Tree& t, node* n) noexcept {
+        while (n->parent && n->parent->mark == RED) {
+            // A red parent is never the root
+            node* p = n->parent;
+            node* g = p->parent;
+            bool left = g->left == p;
+            node* u = left ? g->right : g->left;
+
+            if (!__black(u)) {
+                // Red uncle: push the black down from the grand parent
+                p->mark = u->mark = BLACK;
+                g->mark = RED;
+                n = g;
+                continue;
+            }
+            if (left != (p->left == n)) {
+                // Zig-zag: make it a straight line
+                t.__rotate_refresh(p, left);
+                p = n;
+            }
+            p->mark = BLACK;
+            g->mark = RED;
+            t.__rotate_refresh(g, !left);
+            break;
+        }
+        bool grown = t.root->mark == RED;
+        t.root->mark = BLACK;
+        return grown;
+    }
+
+    template <typename Tree, typename node>
+    static void inserted(Tree& t, node* n) noexcept {
+        t.__refresh_up(n->parent);
+        n->mark = RED;
+        __fix_red(t, n);
+    }
+
+    template <typename Tree, typename node>
+    static void erased(Tree& t, node* x, node* parent, node*, unsigned char mark) noexcept {
+        t.__refresh_up(parent);
+        if (mark == RED) return;
+
+        // x carries an extra black, with a black freed position its sibling
+        // is never missing
+        while (x != t.root && __black(x)) {
+            bool left = x == parent->left;
+            node* w = left ? parent->right : parent->left;
+
+            if (w->mark == RED) {
+                w->mark = BLACK;
+                parent->mark = RED;
+                t.__rotate_refresh(parent, left);
+                w = left ? parent->right : parent->left;
+            }
+            if (__black(w->left) && __black(w->right)) {
+                w->mark = RED;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (__black(left ? w->right : w->left)) {
+                (left ? w->left : w->right)->mark = BLACK;
+                w->mark = RED;
+                t.__rotate_refresh(w, !left);
+                w = left ? parent->right : parent->left;
+            }
+            w->mark = parent->mark;
+            parent->mark = BLACK;
+            (left ? w->right : w->left)->mark = BLACK;
+            t.__rotate_refresh(parent, left);
+            x = t.root;
+        }
+        if (x) x->mark = BLACK;
+    }
+
+    /**
+     * @return      the number of black nodes on the paths down to the leaves
+     */
+    template <typename node>
+    static std::size_t __black_height(const node* n) noexcept {
+        std::size_t h = 0;
+        for (; n != nullptr; n = n->left) h += __black(n);
+        return h;
+    }
+
+    template <typename node>
+    static void rooted(node* n) noexcept {
+        if (n) n->mark = BLACK;
+    }
+
+    // Joins take the black heights, tracked by __split
+    static constexpr bool ranked = true;
+
+    template <typename node>
+    static std::size_t rank(const node* n) noexcept { return __black_height(n); }
+
+    template <typename node>
+    static std::size_t rank_above(const node* n, std::size_t below) noexcept { return below + __black(n); }
+
+    template <typename Tree, typename node>
+    static void join(Tree& t, node* l, node* m, node* r) noexcept {
+        join(t, l, __black_height(l), m, r, __black_height(r));
+    }
+
+    /**
+     * Both roots turned black, m goes red on the spine of the tree with
+     * more black nodes, above a black node with as many as the other tree
+     * (the root if they are even), then it is fixed up as a new leaf.
+     * @param bl    the black height of l (before turning its root black)
+     * @param br    the black height of r (as well)
+     * @return      the black height of the whole
+     */
+    template <typename Tree, typename node>
+    static std::size_t join(Tree& t, node* l, std::size_t bl, node* m, node* r, std::size_t br) noexcept {
+        if (!__black(l)) {
+            l->mark = BLACK;
+            bl++;
+        }
+        if (!__black(r)) {
+            r->mark = BLACK;
+            br++;
+        }
+        std::size_t height = MAX(bl, br);
+        node* p = nullptr;
+        node** handle = &t.root;
+        if (bl > br) {
+            t.root = l;
+            while (!__black(l) || bl > br) {
+                bl -= __black(l);
+                p = l;
+                handle = &l->right;
+                l = l->right;
+            }
+        } else if (br > bl) {
+            t.root = r;
+            while (!__black(r) || br > bl) {
+                br -= __black(r);
+                p = r;
+                handle = &r->left;
+                r = r->left;
+            }
+        }
+        m->parent = p;
+        CHILD_LEFT(m, l);
+        CHILD_RIGHT(m, r);
+        REFRESH_DEPTH(m);
+        *handle = m;
+        t.__refresh_up(m->parent);
+        m->mark = RED;
+        return height + __fix_red(t, m);
+    }
+
+    /**
+     * Colors a tree built by halving (leaves differ in depth by one at
+     * most): red the nodes of the deepest level, black the others.
+     */
+    template <typename Tree>
+    static void rebuilt(Tree& t) noexcept {
+        if (t.root == nullptr) return;
+        auto* n = t.root;
+        unsigned int level = 0, deepest = t.root->depth;
+        char dir_flag = 0; // 0 = NONE, 1 = UP_FROM_LEFT, 2 = UP_FROM_RIGHT
+
+        while (n != nullptr) {
+            if (dir_flag == 0) n->mark = level == deepest && level > 0 ? RED : BLACK;
+            if (dir_flag == 0 && n->left) {
+                n = n->left;
+                level++;
+            } else if (dir_flag != 2 && n->right) {
+                dir_flag = 0;
+                n = n->right;
+                level++;
+            } else {
+                dir_flag = n->parent && n == n->parent->left ? 1 : 2;
+                n = n->parent;
+                level--;
+            }
+        }
+    }
+};
+
+/**
+ * Treap: nodes form a heap on a priority hashed from their address, no
+ * space is taken (copies get new priorities, they stay balanced in shape).
+ *
+ * Adaptive: the priority is first an approximate log2 of the lookups of
+ * the node (a counter in the mark, bumped with probability 2^-mark), the
+ * hash breaks the ties. Looked up keys climb towards the root as their
+ * counter grows, once in place lookups do not write (Seidel & Aragon,
+ * weighted randomized search trees). Iterators stay valid on lookups
+ * but end() iterators shall not be recovered with ++/--, as after an
+ * insertion.
+ */
+template <bool Adaptive>
+struct _balance_treap: _balance_hooks {
+
+    static constexpr unsigned char COUNTER_MAX = 63;
+
+    template <typename node>
+    static std::uint64_t __priority(const node* n) noexcept {
+        auto x = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(n));
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        if constexpr (Adaptive) {
+            return (static_cast<std::uint64_t>(n->mark) << 58) | (x >> 6);
+        } else {
+            return x;
+        }
+    }
+
+    /**
+     * @return      a pseudo random number (xorshift, per thread)
+     */
+    static std::uint64_t __random() noexcept {
+        static thread_local std::uint64_t state = 0x9e3779b97f4a7c15ULL;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    /**
+     * Lifts a node up to its priority.
+     */
+    template <typename Tree, typename node>
+    static void __lift(Tree& t, node* n) noexcept {
+        while (n->parent && __priority(n) > __priority(n->parent)) {
+            t.__rotate_refresh(n->parent, n->parent->right == n);
+        }
+    }
+
+    /**
+     * Sinks a node down to its priority.
+     */
+    template <typename Tree, typename node>
+    static void __sink(Tree& t, node* n) noexcept {
+        while (true) {
+            node* c = n->left;
+            if (c == nullptr || (n->right && __priority(n->right) > __priority(c))) {
+                c = n->right;
+            }
+            if (c == nullptr || __priority(c) <= __priority(n)) return;
+            t.__rotate_refresh(n, c == n->right);
+        }
+    }
+
+    /**
+     * Sinks the root of a sub tree whose branches are heaps, then refreshes
+     * the depths up to the new root of the sub tree (not above).
+     */
+    template <typename Tree, typename node>
+    static void __heapify(Tree& t, node* n) noexcept {
+        node* top = n->parent;
+        REFRESH_DEPTH(n);
+        while (true) {
+            node* c = n->left;
+            if (c == nullptr || (n->right && __priority(n->right) > __priority(c))) {
+                c = n->right;
+            }
+            if (c == nullptr || __priority(c) <= __priority(n)) break;
+            if (c == n->right) t.__rotate_left(n); else t.__rotate_right(n);
+        }
+        for (node* a = n->parent; a != top; a = a->parent) REFRESH_DEPTH(a);
+    }
+
+    template <typename Tree, typename node>
+    static void inserted(Tree& t, node* n) noexcept {
+        t.__refresh_up(n->parent);
+        __lift(t, n);
+    }
+
+    template <typename Tree, typename node>
+    static void erased(Tree& t, node*, node* parent, node* implanted, unsigned char mark) noexcept {
+        t.__refresh_up(parent);
+        if (implanted == nullptr) return;
+        // Counters belong to the nodes, not to their positions
+        if constexpr (Adaptive) implanted->mark = mark;
+        __sink(t, implanted);
+    }
+
+    /**
+     * m goes on top of both trees, then sinks (nothing to do when it was
+     * their ancestor, as when splitting).
+     */
+    template <typename Tree, typename node>
+    static void join(Tree& t, node* l, node* m, node* r) noexcept {
+        m->parent = nullptr;
+        CHILD_LEFT(m, l);
+        CHILD_RIGHT(m, r);
+        REFRESH_DEPTH(m);
+        t.root = m;
+        __sink(t, m);
+    }
+
+    template <typename Tree, typename node>
+    static void accessed(Tree& t, node* n) noexcept {
+        if constexpr (Adaptive) {
+            if (n->mark >= COUNTER_MAX || (__random() & ((std::uint64_t{1} << n->mark) - 1)) != 0) return;
+            n->mark++;
+            __lift(t, n);
+        }
+    }
+
+    /**
+     * Restores the heap on a tree linked anew (priorities do not follow
+     * the shape), heapifying each sub tree once its branches are heaps,
+     * deep first. O(n) on a balanced tree.
+     */
+    template <typename Tree>
+    static void rebuilt(Tree& t) noexcept {
+        auto* current = t.root;
+        char dir_flag = 0; // 0 = NONE, 1 = UP_FROM_LEFT, 2 = UP_FROM_RIGHT
+        while (current != nullptr) {
+            if (dir_flag == 0 && current->left) {
+                current = current->left;
+            } else if (dir_flag != 2 && current->right) {
+                dir_flag = 0;
+                current = current->right;
+            } else {
+                auto* parent = current->parent;
+                dir_flag = parent && current == parent->left ? 1 : 2;
+                __heapify(t, current);
+                current = parent;
+            }
+        }
+    }
+
+    // Priorities hash the addresses, moved nodes take new ones
+    template <typename Tree>
+    static void relocated(Tree& t) noexcept {
+        rebuilt(t);
+    }
+
+    template <typename Tree, typename node>
+    static bool valid(const Tree&, const node* n) noexcept {
+        return (n->left == nullptr || __priority(n->left) <= __priority(n)) &&
+               (n->right == nullptr || __priority(n->right) <= __priority(n));
+    }
+
+    // The shape follows the priorities, a rebuild would break the heap
+    static constexpr bool rebuildable = false;
+
+    template <typename Tree>
+    static void rebalance(Tree&) noexcept {}
+};
+
+/**
+ * Splay: nodes found by lookups (and inserted ones) are rotated up to the
+ * root, hot keys stay close to it. O(log n) amortized, no depth bound.
+ * Lookups change the shape: iterators stay valid (nodes do not move) but
+ * end() iterators shall not be recovered with ++/-- after a lookup, as
+ * after an insertion.
+ */
+struct balance_splay: _balance_hooks {
+
+    /**
+     * Rotates a node up to the root (bottom-up splaying). All the nodes
+     * above it are rotated below it, hence their depths are refreshed.
+     * @param x     the node to splay
+     */
+    template <typename Tree, typename node>
+    static void __splay(Tree& t, node* x) noexcept {
+        while (node* p = x->parent) {
+            node* g = p->parent;
+            bool left = p->left == x;
+            if (g == nullptr) {
+                // Zig
+                left ? t.__rotate_right(p) : t.__rotate_left(p);
+            } else if (left == (g->left == p)) {
+                // Zig-zig: the parent goes up first
+                left ? t.__rotate_right(g) : t.__rotate_left(g);
+                left ? t.__rotate_right(p) : t.__rotate_left(p);
+            } else {
+                // Zig-zag
+                left ? t.__rotate_right(p) : t.__rotate_left(p);
+                left ? t.__rotate_left(g) : t.__rotate_right(g);
+            }
+        }
+    }
+
+    template <typename Tree, typename node>
+    static void inserted(Tree& t, node* n) noexcept {
+        __splay(t, n);
+    }
+
+    template <typename Tree, typename node>
+    static void erased(Tree& t, node*, node* parent, node*, unsigned char) noexcept {
+        t.__refresh_up(parent);
+    }
+
+    template <typename Tree, typename node>
+    static void accessed(Tree& t, node* n) noexcept {
+        __splay(t, n);
+    }
+};
+
+/**
+ * Incremental: insertions and erasures only refresh depths and flag the
+ * nodes whose branch depths drift apart by more than Threshold, the flags
+ * are summarized up to the root. Rebalancing is carried out by steps of a
+ * bounded number of nodes (rebalance_step(), plus PerOp steps after each
+ * insertion or erasure), deepest flagged nodes first, with AVL rotations.
+ * The mark holds the flags (of the position, not of the node).
+ */
+template <unsigned char Threshold, std::size_t PerOp>
+struct balance_incremental: _balance_hooks {
+
+    static_assert(Threshold > 0, "a drift of one is the best a rotation can do");
+
+    enum : unsigned char { DRIFTED = 1, BELOW = 2 };
+
+    template <typename node>
+    static bool __flagged(const node* n) noexcept { return n != nullptr && n->mark != 0; }
+
+    /**
+     * Flags (or clears) a node by its drift, a flagged node gets its
+     * parents flagged as having drifted nodes below.
+     */
+    template <typename node>
+    static void __check(node* n) noexcept {
+        int dl = DEPTH_LEFT(n);
+        int dr = DEPTH_RIGHT(n);
+        if (dl > dr + Threshold || dr > dl + Threshold) {
+            n->mark |= DRIFTED;
+            for (node* p = n->parent; p != nullptr && !(p->mark & BELOW); p = p->parent) p->mark |= BELOW;
+        } else {
+            n->mark &= ~DRIFTED;
+        }
+    }
+
+    /**
+     * Refreshes depths from the node up while they change, checking the
+     * drift of every node whose branches changed.
+     */
+    template <typename Tree, typename node>
+    static void __climb(Tree&, node* n) noexcept {
+        while (n != nullptr) {
+            unsigned char before = n->depth;
+            REFRESH_DEPTH(n);
+            __check(n);
+            if (n->depth == before) return;
+            n = n->parent;
+        }
+    }
+
+    template <typename Tree, typename node>
+    static void inserted(Tree& t, node* n) noexcept {
+        __climb(t, n->parent);
+        if constexpr (PerOp > 0) step(t, PerOp);
+    }
+
+    template <typename Tree, typename node>
+    static void erased(Tree& t, node*, node* parent, node*, unsigned char) noexcept {
+        __climb(t, parent);
+        if constexpr (PerOp > 0) step(t, PerOp);
+    }
+
+    /**
+     * The flags below m stay those of their positions, m summarizes them
+     * up to the root.
+     */
+    template <typename Tree, typename node>
+    static void join(Tree& t, node* l, node* m, node* r) noexcept {
+        node** handle = t.__attach(l, m, r);
+        *handle = m;
+        m->mark = __flagged(m->left) || __flagged(m->right) ? BELOW : 0;
+        if (m->mark) {
+            for (node* p = m->parent; p != nullptr && !(p->mark & BELOW); p = p->parent) p->mark |= BELOW;
+        }
+        __check(m);
+        __climb(t, m->parent);
+    }
+
+    /**
+     * Fixes up to budget drifted nodes. The node fixed has no flagged node
+     * below, so its branches are within the threshold and a single or
+     * double rotation moves it towards balance, the rotated nodes are
+     * checked again. The search resumes from there, summaries found stale
+     * are cleared on the way up.
+     */
+    template <typename Tree>
+    static bool step(Tree& t, std::size_t budget) noexcept {
+        auto* n = t.root;
+        while (budget > 0 && n != nullptr) {
+            if (!__flagged(n)) { n = n->parent; continue; }
+            if (__flagged(n->left)) { n = n->left; continue; }
+            if (__flagged(n->right)) { n = n->right; continue; }
+
+            n->mark = 0;
+            __check(n);
+            if (n->mark == 0) { n = n->parent; continue; }
+
+            budget--;
+            n->mark = 0;
+            auto* top = balance_avl::__fix(t, n);
+            for (auto* c : {top->left, top->right}) {
+                if (c == nullptr) continue;
+                c->mark = __flagged(c->left) || __flagged(c->right) ? BELOW : 0;
+                __check(c);
+            }
+            top->mark = __flagged(top->left) || __flagged(top->right) ? BELOW : 0;
+            __check(top);
+            __climb(t, top->parent);
+            n = top;
+        }
+        return __flagged(t.root);
+    }
+};
+
+// Balancing of trees not naming a policy
+#ifdef __EXPERIMENTAL_AUTO_BALANCE
+using balance_default = balance_heuristic;
+#else
+using balance_default = balance_none;
+#endif
+
+
+/**
+ * Destroys up to budget nodes of a detached tree, leaves first, without
+ * recursion: a node is destroyed once it has no children left. Slots of
+ * storages releasing all at once are recycled only on request.
+ * @param n         the tree root, updated to the node to resume from
+ *                  (nullptr when the tree is gone)
+ * @param storage   the storage the nodes belong to
+ * @param budget    the maximum number of nodes to destroy, decremented
+ */
+template <bool Recycle = false, typename node, typename storage_type>
+void _drop_nodes(node*& n, storage_type& storage, std::size_t& budget) noexcept {
+    while (n != nullptr && budget > 0) {
+        if (n->left) {
+            n = n->left;
+        } else if (n->right) {
+            n = n->right;
+        } else {
+            node* p = n->parent;
+            if (p) {
+                if (p->left == n) p->left = nullptr;
+                else p->right = nullptr;
+            }
+            if (storage_type::releases_all && !Recycle) {
+                n->~node();
+            } else {
+                storage.drop(n);
+            }
+            n = p;
+            budget--;
+        }
+    }
+}
+
+
+/**
+ * A detached tree waiting to be freed by a bst_reclaimer.
+ */
+struct _garbage {
+
+    _garbage* next{nullptr};
+
+    virtual ~_garbage() = default;
+
+    /**
+     * Frees up to budget nodes.
+     * @param budget    the maximum number of nodes to free, decremented
+     * @return          true when nothing is left but the memory, freed
+     *                  by the destructor
+     */
+    virtual bool free_some(std::size_t& budget) noexcept = 0;
+};
+
+template <typename node, typename storage_type>
+struct _tree_garbage: _garbage {
+
+    node* root;
+    storage_type storage;
+
+    _tree_garbage(node* root, storage_type&& storage) noexcept:
+            root{root}, storage{std::move(storage)} {}
+
+    bool free_some(std::size_t& budget) noexcept override {
+        // Whole slabs are released without visiting the nodes
+        if (storage_type::releases_all && std::is_trivially_destructible<node>::value) return true;
+        _drop_nodes(root, storage, budget);
+        return root == nullptr;
+    }
+};
+
+
+/**
+ * Frees the trees dropped by clear(), ~bst() and the assignments of the
+ * maps using it, so that they only detach the root O(1). Either a
+ * background thread frees them, or every insertion and erase of those
+ * maps frees a bounded number of nodes (incremental).
+ *
+ * The reclaimer must outlive the maps using it. In background mode the
+ * allocators must be thread safe.
+ */
+class bst_reclaimer {
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    _garbage* head{nullptr};
+    std::atomic<std::size_t> _pending{0};
+    std::size_t budget;
+    bool stop{false};
+    std::thread worker;
+
+    void __run() noexcept {
+        std::unique_lock<std::mutex> l{lock};
+        while (true) {
+            wake.wait(l, [this] { return stop || head != nullptr; });
+            if (head == nullptr) return;
+            _garbage* g = head;
+            head = g->next;
+            l.unlock();
+            std::size_t all = static_cast<std::size_t>(-1);
+            g->free_some(all);
+            delete g;
+            l.lock();
+            _pending--;
+            idle.notify_all();
+        }
+    }
+
+public:
+
+    /**
+     * @param background    free the trees on a background thread
+     * @param budget        nodes freed per operation (incremental mode)
+     */
+    explicit bst_reclaimer(bool background = false, std::size_t budget = 256):
+            budget{budget}
+    {
+        if (background) worker = std::thread{&bst_reclaimer::__run, this};
+    }
+
+    bst_reclaimer(const bst_reclaimer&) = delete;
+    bst_reclaimer& operator=(const bst_reclaimer&) = delete;
+
+    ~bst_reclaimer() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> l{lock};
+                stop = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+        drain();
+    }
+
+    /**
+     * Takes a detached tree.
+     * @param g     the tree
+     */
+    void push(_garbage* g) noexcept {
+        {
+            std::lock_guard<std::mutex> l{lock};
+            g->next = head;
+            head = g;
+            _pending++;
+        }
+        wake.notify_one();
+    }
+
+    /**
+     * Frees up to budget nodes (incremental mode only).
+     */
+    void step() noexcept {
+        if (worker.joinable() || _pending == 0) return;
+        std::lock_guard<std::mutex> l{lock};
+        std::size_t b = budget;
+        while (head != nullptr && b > 0) {
+            if (!head->free_some(b)) break;
+            _garbage* g = head;
+            head = g->next;
+            delete g;
+            _pending--;
+        }
+    }
+
+    /**
+     * Frees everything now, or waits for the background thread to.
+     */
+    void drain() noexcept {
+        std::unique_lock<std::mutex> l{lock};
+        if (worker.joinable()) {
+            idle.wait(l, [this] { return _pending == 0; });
+            return;
+        }
+        while (head != nullptr) {
+            std::size_t all = static_cast<std::size_t>(-1);
+            head->free_some(all);
+            _garbage* g = head;
+            head = g->next;
+            delete g;
+            _pending--;
+        }
+    }
+
+    /**
+     * @return      the number of trees not yet freed
+     */
+    std::size_t pending() const noexcept { return _pending; }
+};
+
+
+template <typename K, typename V, typename Compare = std::less<K>, typename size_type = std::size_t,
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          template<typename, typename> class Storage = _node_pool,
+          std::size_t Inline = 0,
+          typename Balance = balance_default>
+class bst: private _tree_core<_node<K, V, typename _key_prefix<K, Compare>::type>, Balance> {
+
+// DEFINITIONS
+
+    Compare compare;
+
+    using node = _node<K, V, typename _key_prefix<K, Compare>::type>;
+    using core = _tree_core<node, Balance>;
+    using core::root;
+    using core::__left_most;
+    using core::__right_most;
+    using core::__link;
+    using core::__unlink;
+    using core::__accessed;
+    using core::__rebuilt;
+    using core::__relocated;
+    using core::__rebalance;
+    using core::__rebalance_step;
+    using traits = _value_traits<K, V>;
+    using pair_type = typename traits::value_type;
+    using storage_type = Storage<node, Allocator>;
+    using alloc_traits = std::allocator_traits<Allocator>;
+
+    _inline_nodes<node, Inline> small;
+    size_type _size{0};
+    bool _counted{true}; // false after split(), until size() counts the nodes
+    storage_type storage;
+    bst_reclaimer* reclaimer{nullptr};
+
+// INTERNAL
+
+    // INNER
+    enum find_method{EXACT, LEFT, RIGHT};
+
+    // Nodes cache a prefix of their key (see _key_prefix)
+    static constexpr bool prefixed = !std::is_void<typename _key_prefix<K, Compare>::type>::value;
+
+    /**
+     * The prefix of a key when nodes cache them (else 0, unused).
+     * @param k     the key
+     * @return      the prefix
+     */
+    template <typename Q>
+    static std::uint64_t __prefix(const Q& k) noexcept {
+        if constexpr (prefixed) {
+            return Compare::prefix(k);
+        } else {
+            return 0;
+        }
+    }
+
+    /**
+     * Compares a key to the one of a node, by their prefixes first when
+     * nodes cache them: the node key is read on equal prefixes only.
+     * @param k     the key
+     * @param kp    the prefix of k (see __prefix)
+     * @param n     the node
+     * @return      -1, 0 or 1 as k is lower, equal or greater
+     */
+    template <typename Q>
+    int __order(const Q& k, std::uint64_t kp, const node* n) const {
+        if constexpr (prefixed) {
+            if (kp != n->prefix) return kp < n->prefix ? -1 : 1;
+        }
+        return _three_way(compare, k, traits::key(n->data));
+    }
+
+    /**
+     * Provided a local root, find a node by key within the downstream tree.
+     * If method is different from EXACT, the function will always return
+     * a node that will be the LEFT (or RIGHT) closest node to the searched key.
+     * @param current   local root to start from
+     * @param k         key to search for
+     * @param method    EXACT, LEFT, RIGHT
+     * @return          the found node or nullptr
+     */
+    template <typename Q>
+    node* __find_key(node* current, const Q& k, const find_method method) noexcept {
+        if (small.active()) return __find_inline(k, method);
+
+        node *lastl{nullptr}, *lastr{nullptr}, *found{nullptr};
+        std::uint64_t kp = __prefix(k);
+
+        while (current != nullptr && found == nullptr) {
+            TRIPLE_BRANCH(__order(k, kp, current),
+                           lastr = current; current = current->left,
+                           lastl = current; current = current->right,
+                           found = current
+            );
+        }
+
+        switch (method) {
+            case EXACT: return found;
+            case LEFT: return NNL(found, lastl);
+            case RIGHT: return NNL(found, lastr);
+            default: return nullptr;
+        }
+    }
+
+    /**
+     * Inserts a pair in the tree, returning the node.
+     * @param x     pair to be inserted
+     * @return      the inserted node or nullptr if key already present
+     */
+    node* __insert(pair_type&& x) {
+        if (reclaimer != nullptr) reclaimer->step();
+        if (small.active()) {
+            std::size_t i = __lower_inline(traits::key(x));
+            node* d = small.data();
+            if (i < _size && !_less(compare, traits::key(x), traits::key(d[i].data))) return nullptr;
+            if (_size < small.capacity()) return __insert_inline(i, std::move(x));
+            __materialize();
+        }
+
+        node* parent = nullptr;
+        node** handle = &root;
+        std::uint64_t kp = __prefix(traits::key(x));
+
+        while (*handle != nullptr) {
+            parent = *handle;
+            TRIPLE_BRANCH(__order(traits::key(x), kp, parent),
+                           handle = &(parent->left),
+                           handle = &(parent->right),
+                           return nullptr
+            )
+        }
+
+        // If here we have an allocable branch
+        // (rotations may re-link the handle, keep the node)
+        node* n = storage.make(parent, std::move(x));
+        __link(handle, n);
+
+        _size ++;
+        return n;
+    }
+
+    /**
+     * Links a detached node (finger search): the descent starts from the
+     * lowest node on the path from a node with a lower key to the root
+     * whose sub tree spans the key. The upper bound of a sub tree is the
+     * first ancestor holding it on its left.
+     * @param from  a node with a lower key, or nullptr (from the root)
+     * @param n     the node to be linked
+     * @return      false if the key was already present (n is not linked)
+     */
+    bool __insert_after(node* from, node* n) {
+        const K& k = traits::key(n->data);
+        node* top = from;
+        while (top != nullptr) {
+            node* c = top;
+            while (c->parent != nullptr && c->parent->right == c) c = c->parent;
+            if (c->parent == nullptr || _less(compare, k, traits::key(c->parent->data))) break;
+            top = c->parent;
+        }
+
+        node* parent = top != nullptr ? top->parent : nullptr;
+        node** handle = parent == nullptr ? &root : (parent->left == top ? &parent->left : &parent->right);
+        std::uint64_t kp = __prefix(k);
+        while (*handle != nullptr) {
+            parent = *handle;
+            TRIPLE_BRANCH(__order(k, kp, parent),
+                           handle = &(parent->left),
+                           handle = &(parent->right),
+                           return false
+            )
+        }
+        n->parent = parent;
+        __link(handle, n);
+        _size++;
+        return true;
+    }
+
+    /**
+     * Merges detached nodes sorted by key with the tree, then links the
+     * whole anew by halving. Nodes whose key is already present are
+     * dropped. Nothing is changed if an exception is thrown.
+     * @param nodes     the nodes, sorted by key without duplicates
+     */
+    void __merge(std::vector<node*>& nodes) {
+        std::vector<node*> all, dropped;
+        all.reserve(_size + nodes.size());
+        node* t = __left_most(root);
+        std::size_t i = 0;
+        while (t != nullptr && i < nodes.size()) {
+            TRIPLE_COMPARE(compare, traits::key(nodes[i]->data), traits::key(t->data),
+                           all.push_back(nodes[i++]),
+                           all.push_back(t); t = core::__successor(t),
+                           dropped.push_back(nodes[i++])
+            )
+        }
+        for (; t != nullptr; t = core::__successor(t)) all.push_back(t);
+        for (; i < nodes.size(); i++) all.push_back(nodes[i]);
+
+        for (node* d : dropped) storage.drop(d);
+        _size = static_cast<size_type>(all.size());
+        root = __link_sorted(all.data(), 0, all.size(), nullptr);
+        __rebuilt();
+    }
+
+    /**
+     * Finds a node by key on behalf of a lookup, the balancing policy
+     * may adapt to it (see balance_splay).
+     * @param k     the key to search for
+     * @return      the node or nullptr if key was not found
+     */
+    template <typename Q>
+    node* __lookup(const Q& k) noexcept {
+        node* found = __find_key(root, k, EXACT);
+        if (found != nullptr && !small.active()) __accessed(found);
+        return found;
+    }
+
+    /**
+     * Finds nodes by key on behalf of a batch of lookups. Up to
+     * __FIND_MANY_LANES descents are in flight: each round moves all of
+     * them one level down and prefetches the next nodes, so their cache
+     * misses overlap instead of following one another.
+     * @param first     the first key
+     * @param last      past the last key
+     * @param found     called with each node found (or nullptr), in order
+     * @return          the number of keys found
+     */
+    template<typename Iter, typename Found>
+    size_type __find_many(Iter first, Iter last, Found&& found) {
+        using category = typename std::iterator_traits<Iter>::iterator_category;
+        static_assert(std::is_base_of<std::forward_iterator_tag, category>::value,
+                      "keys are read again at every level");
+        size_type count = 0;
+        if (small.active()) {
+            for (; first != last; ++first) {
+                node* n = __find_inline(*first, EXACT);
+                count += n != nullptr;
+                found(n);
+            }
+            return count;
+        }
+
+        std::array<Iter, __FIND_MANY_LANES> keys;
+        std::array<std::uint64_t, __FIND_MANY_LANES> prefixes;
+        std::array<node*, __FIND_MANY_LANES> lanes;
+        std::array<bool, __FIND_MANY_LANES> done;
+        while (first != last) {
+            std::size_t width = 0;
+            for (; width < __FIND_MANY_LANES && first != last; ++first, width++) {
+                keys[width] = first;
+                prefixes[width] = __prefix(*first);
+                lanes[width] = root;
+                done[width] = root == nullptr;
+            }
+            for (std::size_t active = root == nullptr ? 0 : width; active > 0;) {
+                for (std::size_t i = 0; i < width; i++) {
+                    if (done[i]) continue;
+                    node* n = lanes[i];
+                    TRIPLE_BRANCH(__order(*keys[i], prefixes[i], n),
+                                   n = n->left,
+                                   n = n->right,
+                                   done[i] = true
+                    )
+                    if (done[i]) {
+                        active--;
+                    } else if (n == nullptr) {
+                        lanes[i] = nullptr;
+                        done[i] = true;
+                        active--;
+                    } else {
+                        PREFETCH(n);
+                        lanes[i] = n;
+                    }
+                }
+            }
+            for (std::size_t i = 0; i < width; i++) {
+                if (lanes[i] != nullptr) {
+                    count++;
+                    __accessed(lanes[i]);
+                }
+                found(lanes[i]);
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Extracts a node from the tree by key. The extracted node
+     * is completely detached from the tree and should be deleted
+     * after use.
+     * @param k     the key to search for
+     * @return      the node or nullptr if key was not found
+     */
+    template <typename Q>
+    node* __extract(const Q& k) noexcept {
+        if (reclaimer != nullptr) reclaimer->step();
+        node* n = __find_key(root, k, EXACT);
+        if (n == nullptr) return n;
+        __unlink(n);
+        _size--;
+        return n;
+    }
+
+    /**
+     * Removes a key from the map (see erase()).
+     * @param k     the key to remove
+     * @return      the number of values removed
+     */
+    template <typename Q>
+    size_type __erase(const Q& k) noexcept {
+        if (small.active()) {
+            node* n = __find_inline(k, EXACT);
+            if (n == nullptr) return 0;
+            __remove_inline(n);
+            return 1;
+        }
+        node* n = __extract(k);
+        if (n == nullptr) return 0;
+        storage.drop(n);
+        return 1;
+    }
+
+    /**
+     * Finds the first and last nodes of a slice of the map (see operator()).
+     * @param lower     the lower inclusive bound
+     * @param upper     the upper inclusive bound
+     * @param first     set to the first node of the slice
+     * @param last      set to the last node of the slice
+     * @return          false if the slice is empty
+     */
+    template <typename L, typename U>
+    bool __slice(const L& lower, const U& upper, node*& first, node*& last) noexcept {
+        if (_less(compare, upper, lower)) return false;
+        // Check that the RIGHT neighbour is not greater than upper
+        first = __find_key(root, lower, RIGHT);
+        if (first == nullptr || _less(compare, upper, traits::key(first->data))) return false;
+        // Check that the LEFT neighbour is not lower than lower
+        last = __find_key(root, upper, LEFT);
+        return last != nullptr && !_less(compare, traits::key(last->data), lower);
+    }
+
+    /**
+     * Splits a tree at a key. The descent compares (nothing is changed if
+     * an exception is thrown), then climbing back each node of the path is
+     * joined to the tree of its side along with its branch on that side.
+     * The joins climb as much as the path descended, O(log n) for balanced
+     * trees (the ranks the joins take are tracked along the path: both
+     * children of a node have the same).
+     * @param n     the tree root
+     * @param k     the key
+     * @param lo    set to the root of the lower keys
+     * @param hi    set to the root of the greater keys
+     * @return      the node holding k, detached, or nullptr
+     */
+    node* __split(node* n, const K& k, node*& lo, node*& hi) {
+        node *last{nullptr}, *found{nullptr};
+        bool left = false;
+        while (n != nullptr && found == nullptr) {
+            last = n;
+            TRIPLE_COMPARE(compare, k, traits::key(n->data),
+                           left = true; n = n->left,
+                           left = false; n = n->right,
+                           found = n
+            )
+        }
+
+        core t;
+        lo = hi = nullptr;
+        // Ranks of lo, of hi and of the sub tree the path comes from
+        std::size_t rlo = 0, rhi = 0, below = 0;
+        if (found != nullptr) {
+            // Its branches are the first of both sides
+            lo = found->left;
+            hi = found->right;
+            rlo = rhi = core::__rank(lo);
+            below = core::__rank_above(found, rlo);
+            if (lo) lo->parent = nullptr;
+            if (hi) hi->parent = nullptr;
+            last = found->parent;
+            left = last != nullptr && last->left == found;
+            found->parent = nullptr;
+            DETACH(found);
+        }
+        while (last != nullptr) {
+            node* p = last->parent;
+            bool from_left = p != nullptr && p->left == last;
+            node* branch = left ? last->right : last->left;
+            // Before the join recolors it
+            std::size_t above = core::__rank_above(last, below);
+            if (branch) branch->parent = nullptr;
+            if (left) {
+                hi = t.__join(hi, rhi, last, branch, below, rhi);
+            } else {
+                lo = t.__join(branch, below, last, lo, rlo, rlo);
+            }
+            below = above;
+            left = from_left;
+            last = p;
+        }
+        // The branches of the found node may have been joined to nothing
+        core::__rooted(lo);
+        core::__rooted(hi);
+        return found;
+    }
+
+    /**
+     * Joins two trees through a middle node, or through the greatest node
+     * of l if none is given.
+     * @param l     the tree of the lower keys (maybe nullptr)
+     * @param m     the middle node, detached, or nullptr
+     * @param r     the tree of the greater keys (maybe nullptr)
+     * @return      the root of the whole
+     */
+    static node* __concat(node* l, node* m, node* r) noexcept {
+        core t;
+        if (m == nullptr) {
+            if (l == nullptr || r == nullptr) return NNL(l, r);
+            m = __right_most(l);
+            t.root = l;
+            t.__unlink(m);
+            l = t.root;
+        }
+        return t.__join(l, m, r);
+    }
+
+    // SET OPERATIONS
+    enum set_method{UNION, INTERSECTION, DIFFERENCE};
+
+    // Sub problem of a set operation: trees of the first and second map,
+    // the tree merged out of them (or the middle node kept at a divide)
+    struct set_task {
+        node* a;
+        node* b;
+        node* result;
+    };
+
+    /**
+     * Pushes a detached tree on the stack of the ones to be dropped, linked
+     * through the parent of their roots (from any worker).
+     * @param dropped   the stack
+     * @param n         the tree root, or nullptr
+     */
+    static void __discard(std::atomic<node*>& dropped, node* n) noexcept {
+        if (n == nullptr) return;
+        n->parent = dropped.load(std::memory_order_relaxed);
+        while (!dropped.compare_exchange_weak(n->parent, n, std::memory_order_release,
+                                              std::memory_order_relaxed)) {}
+    }
+
+    /**
+     * Divides a set operation: the root of b splits a, the branches of
+     * both on each side make the sub problems. Of the root and the node of
+     * a holding its key (if any), the one the operation keeps is returned,
+     * the others are discarded.
+     * @param method    UNION, INTERSECTION, DIFFERENCE
+     * @param keep_a    on equal keys keep the node of a, else the one of b
+     * @param t         the sub problem, both trees not empty
+     * @param lo        set to the sub problem of the lower keys
+     * @param hi        set to the sub problem of the greater keys
+     * @param dropped   the trees to be dropped
+     * @return          the middle node kept, or nullptr
+     */
+    node* __set_divide(set_method method, bool keep_a, const set_task& t, set_task& lo, set_task& hi,
+                       std::atomic<node*>& dropped) noexcept {
+        node* b = t.b;
+        node* f = __split(t.a, traits::key(b->data), lo.a, hi.a);
+        lo.b = b->left;
+        hi.b = b->right;
+        if (lo.b) lo.b->parent = nullptr;
+        if (hi.b) hi.b->parent = nullptr;
+        DETACH(b);
+
+        node* kept = nullptr;
+        switch (method) {
+            case UNION: kept = f != nullptr && keep_a ? f : b; break;
+            case INTERSECTION: kept = f == nullptr ? nullptr : (keep_a ? f : b); break;
+            case DIFFERENCE: break;
+        }
+        if (f != kept) __discard(dropped, f);
+        if (b != kept) __discard(dropped, b);
+        return kept;
+    }
+
+    /**
+     * Runs a set operation between two trees by divide and conquer, the
+     * recursion follows the shape of b.
+     * @param method    UNION, INTERSECTION, DIFFERENCE
+     * @param keep_a    on equal keys keep the node of a, else the one of b
+     * @param a         the tree of the first map
+     * @param b         the tree of the second map
+     * @param dropped   the trees to be dropped
+     * @return          the root of the result
+     */
+    node* __set_walk(set_method method, bool keep_a, node* a, node* b, std::atomic<node*>& dropped) noexcept {
+        if (a == nullptr || b == nullptr) {
+            if (method == UNION) return NNL(a, b);
+            __discard(dropped, b);
+            if (method == DIFFERENCE) return a;
+            __discard(dropped, a);
+            return nullptr;
+        }
+        set_task lo, hi;
+        node* m = __set_divide(method, keep_a, set_task{a, b, nullptr}, lo, hi, dropped);
+        node* l = __set_walk(method, keep_a, lo.a, lo.b, dropped);
+        node* r = __set_walk(method, keep_a, hi.a, hi.b, dropped);
+        return __concat(l, m, r);
+    }
+
+    /**
+     * Runs a set operation with the tree of another map, adopting its
+     * storage. For big maps (hint) the top levels are divided here, the
+     * sub problems below left to parallel workers, about 4 per worker,
+     * then the top levels are joined back. The discarded nodes are
+     * dropped afterward.
+     * @param method    UNION, INTERSECTION, DIFFERENCE
+     * @param keep_a    on equal keys keep the node of this map
+     * @param other     the second map, its tree is taken
+     * @param hint      the number of nodes of both maps
+     * @return          the number of nodes dropped
+     */
+    std::size_t __set(set_method method, bool keep_a, bst& other, std::size_t hint) {
+        unsigned int workers = MIN(std::thread::hardware_concurrency(), __PARALLEL_SET_WORKERS);
+        std::size_t cut = 0;
+        if (hint < __PARALLEL_SET_MIN || workers < 2) {
+            workers = 1;
+        } else {
+            cut = 2;
+            while ((std::size_t(1) << cut) < 4 * workers) cut++;
+        }
+        std::vector<set_task> tasks((std::size_t(2) << cut) - 1);
+        storage.adopt(other.storage);
+        std::atomic<node*> dropped{nullptr};
+
+        // The tasks form a complete tree, the inner ones are divided
+        std::size_t inner = (std::size_t(1) << cut) - 1;
+        tasks[0] = set_task{root, std::exchange(other.root, nullptr), nullptr};
+        for (std::size_t i = 0; i < inner; i++) {
+            set_task& t = tasks[i];
+            if (t.a == nullptr || t.b == nullptr) {
+                // Nothing left to divide
+                tasks[2 * i + 1] = set_task{t.a, t.b, nullptr};
+                tasks[2 * i + 2] = set_task{nullptr, nullptr, nullptr};
+            } else {
+                t.result = __set_divide(method, keep_a, t, tasks[2 * i + 1], tasks[2 * i + 2], dropped);
+            }
+        }
+
+        auto run = [&](unsigned int w) {
+            for (std::size_t i = inner + w; i < tasks.size(); i += workers) {
+                tasks[i].result = __set_walk(method, keep_a, tasks[i].a, tasks[i].b, dropped);
+            }
+        };
+        std::vector<std::thread> threads;
+        unsigned int spawned = 1;
+        try {
+            threads.reserve(workers - 1);
+            for (; spawned < workers; spawned++) threads.emplace_back(run, spawned);
+        } catch (...) {
+            // Fewer workers, the others' share is run here
+        }
+        run(0);
+        for (unsigned int w = spawned; w < workers; w++) run(w);
+        for (auto&& t : threads) t.join();
+
+        for (std::size_t i = inner; i-- > 0;) {
+            tasks[i].result = __concat(tasks[2 * i + 1].result, tasks[i].result, tasks[2 * i + 2].result);
+        }
+        root = tasks[0].result;
+
+        std::size_t count = 0;
+        node* n = dropped.load(std::memory_order_acquire);
+        while (n != nullptr) {
+            node* next = std::exchange(n->parent, nullptr);
+            std::size_t budget = static_cast<std::size_t>(-1);
+            _drop_nodes<true>(n, storage, budget);
+            count += static_cast<std::size_t>(-1) - budget;
+            n = next;
+        }
+        return count;
+    }
+
+    /**
+     * Set operation between two maps, see set_union().
+     */
+    static bst __set_operation(set_method method, bst&& a, bst&& b, bool keep_a) {
+        if (a.small.active()) a.__materialize();
+        if (b.small.active()) b.__materialize();
+        // The work is bound by the shallower map, whose shape is followed
+        if (method != DIFFERENCE && a.depth() < b.depth()) {
+            return __set_operation(method, std::move(b), std::move(a), !keep_a);
+        }
+        // Nor too deep for the recursion
+        if (b.depth() > __DEPTH_MAX) b.balance();
+
+        bool counted = a._counted && b._counted;
+        std::size_t total = static_cast<std::size_t>(a._size) + b._size;
+        std::size_t dropped = a.__set(method, keep_a, b, counted ? total : static_cast<std::size_t>(-1));
+        a._size = counted ? static_cast<size_type>(total - dropped) : 0;
+        a._counted = counted;
+        b._size = 0;
+        b._counted = true;
+        b.small.activate(true);
+        return bst{std::move(a)};
+    }
+
+    // A sub tree left to a clone worker: src to be cloned as a child of parent
+    struct clone_task {
+        const node* src;
+        node* parent;
+        bool is_left;
+    };
+
+    /**
+     * Clones a single node, copying (or moving) its value, depth and mark.
+     */
+    template<bool Move>
+    static node* __clone_node(const node* src, node* parent, storage_type& to) {
+        node* n;
+        if constexpr (Move) {
+            n = to.make(parent, std::move(const_cast<node*>(src)->data));
+        } else {
+            n = to.make(parent, pair_type{src->data});
+        }
+        n->depth = src->depth;
+        n->mark = src->mark;
+        return n;
+    }
+
+    /**
+     * Clones a sub tree without recursion, preserving its shape and depths.
+     * The source is walked through its parent links while the clone is
+     * built alongside. Nodes `cut` levels below src are not cloned but
+     * listed in tasks instead. On exceptions the partial clone is dropped.
+     * @tparam Move     move the values out of the source nodes
+     * @param src       local root to be cloned
+     * @param parent    parent of the cloned local root
+     * @param to        storage of the cloned nodes
+     * @param cut       the level of the sub trees left to tasks
+     * @param tasks     the sub trees left (required with a cut)
+     * @return          the cloned local root
+     */
+    template<bool Move = false>
+    static node* __clone_walk(const node* src, node* parent, storage_type& to,
+                              std::size_t cut = static_cast<std::size_t>(-1),
+                              std::vector<clone_task>* tasks = nullptr) {
+        if (src == nullptr) return nullptr;
+        node* top = __clone_node<Move>(src, parent, to);
+        const node* s = src;
+        node* d = top;
+        std::size_t level = 0;
+
+        try {
+            while (true) {
+                if (level + 1 == cut) {
+                    // Leave the children to the tasks, then go up
+                    if (s->left) tasks->push_back(clone_task{s->left, d, true});
+                    if (s->right) tasks->push_back(clone_task{s->right, d, false});
+                } else if (s->left && !d->left) {
+                    s = s->left;
+                    d->left = __clone_node<Move>(s, d, to);
+                    d = d->left;
+                    level++;
+                    continue;
+                } else if (s->right && !d->right) {
+                    s = s->right;
+                    d->right = __clone_node<Move>(s, d, to);
+                    d = d->right;
+                    level++;
+                    continue;
+                }
+                if (s == src) break;
+                // Both children were cloned, go up
+                s = s->parent;
+                d = d->parent;
+                level--;
+            }
+        } catch (...) {
+            // Not linked to the parent yet
+            top->parent = nullptr;
+            std::size_t all = static_cast<std::size_t>(-1);
+            _drop_nodes(top, to, all);
+            throw;
+        }
+        return top;
+    }
+
+    /**
+     * Counts the nodes of a sub tree without recursion.
+     * @param n     local root
+     * @return      the number of nodes
+     */
+    static std::size_t __count(const node* top) noexcept {
+        std::size_t c = 0;
+        const node* n = top;
+        while (n != nullptr && n->left) n = n->left;
+        while (n != nullptr) {
+            c++;
+            // In-order successor within the sub tree
+            if (n->right) {
+                n = n->right;
+                while (n->left) n = n->left;
+            } else {
+                while (n != top && n == n->parent->right) n = n->parent;
+                n = n == top ? nullptr : n->parent;
+            }
+        }
+        return c;
+    }
+
+    /**
+     * Clones a whole tree of n nodes in the storage. Nodes are allocated
+     * in one block, or for big trees (and stateless allocators) the sub
+     * trees below the top levels are cloned in parallel, each in its own
+     * block, adopted by the storage afterward.
+     * @param src       the root to be cloned
+     * @param n         the number of nodes
+     * @return          the cloned root
+     */
+    node* __clone_tree(const node* src, std::size_t n) {
+        unsigned int workers = MIN(std::thread::hardware_concurrency(), __PARALLEL_CLONE_WORKERS);
+        if (n < __PARALLEL_CLONE_MIN || workers < 2 || !alloc_traits::is_always_equal::value) {
+            storage.reserve(n);
+            return __clone_walk(src, nullptr, storage);
+        }
+
+        // About 4 sub trees per worker
+        std::size_t cut = 2;
+        while ((std::size_t(1) << cut) < 4 * workers) cut++;
+        std::vector<clone_task> tasks;
+        storage.reserve(std::size_t(1) << cut);
+        node* top = __clone_walk(src, nullptr, storage, cut, &tasks);
+
+        std::vector<storage_type> blocks;
+        blocks.reserve(tasks.size());
+        for (std::size_t i = 0; i < tasks.size(); i++) blocks.emplace_back(get_allocator());
+        std::vector<std::exception_ptr> errors(workers);
+        auto run = [&](unsigned int w) {
+            try {
+                for (std::size_t i = w; i < tasks.size(); i += workers) {
+                    const clone_task& t = tasks[i];
+                    blocks[i].reserve(__count(t.src));
+                    node* c = __clone_walk(t.src, t.parent, blocks[i]);
+                    if (t.is_left) t.parent->left = c;
+                    else t.parent->right = c;
+                }
+            } catch (...) {
+                errors[w] = std::current_exception();
+            }
+        };
+        std::vector<std::thread> threads;
+        unsigned int spawned = 1;
+        try {
+            threads.reserve(workers - 1);
+            for (; spawned < workers; spawned++) threads.emplace_back(run, spawned);
+        } catch (...) {
+            // Fewer workers, the others' share is run here
+        }
+        run(0);
+        for (unsigned int w = spawned; w < workers; w++) run(w);
+        for (auto&& t : threads) t.join();
+        for (auto&& b : blocks) storage.adopt(b);
+        for (auto&& e : errors) {
+            if (!e) continue;
+            // The sub trees cloned so far are linked to the top levels
+            std::size_t all = static_cast<std::size_t>(-1);
+            _drop_nodes(top, storage, all);
+            std::rethrow_exception(e);
+        }
+        return top;
+    }
+
+// SMALL MAP
+
+    /**
+     * Counts the inline nodes with a key lower than k (they are sorted).
+     * The scan is branchless, it does not stop at the first greater key.
+     * @param k     the key
+     * @return      the index of the first node not lower than k
+     */
+    template <typename Q>
+    std::size_t __lower_inline(const Q& k) const noexcept {
+        const node* d = small.data();
+        std::size_t i = 0;
+        for (std::size_t j = 0; j < _size; j++) {
+            i += _less(compare, traits::key(d[j].data), k);
+        }
+        return i;
+    }
+
+    /**
+     * Finds a key within the inline nodes (see __find_key).
+     * @param k         key to search for
+     * @param method    EXACT, LEFT, RIGHT
+     * @return          the found node or nullptr
+     */
+    template <typename Q>
+    node* __find_inline(const Q& k, const find_method method) noexcept {
+        node* d = small.data();
+        std::size_t i = __lower_inline(k);
+        bool found = i < _size && !_less(compare, k, traits::key(d[i].data));
+
+        switch (method) {
+            case EXACT: return found ? d + i : nullptr;
+            case LEFT: return found ? d + i : (i > 0 ? d + i - 1 : nullptr);
+            case RIGHT: return i < _size ? d + i : nullptr;
+            default: return nullptr;
+        }
+    }
+
+    /**
+     * Moves n nodes from a buffer to another (they may overlap if to < from).
+     * @param to    the destination
+     * @param from  the source, destroyed
+     * @param n     the number of nodes
+     */
+    static void __move_nodes(node* to, node* from, std::size_t n) noexcept {
+        for (std::size_t i = 0; i < n; i++) {
+            new (to + i) node(nullptr, std::move(from[i].data));
+            from[i].~node();
+        }
+    }
+
+    /**
+     * Inserts a pair at position i of the inline nodes, shifting the
+     * following ones (there must be a free slot).
+     * @param i     the position
+     * @param x     pair to be inserted
+     * @return      the inserted node
+     */
+    node* __insert_inline(std::size_t i, pair_type&& x) {
+        // Constructed before the nodes shift, they stay put if it throws
+        node fresh{nullptr, std::move(x)};
+        node* d = small.data();
+        for (std::size_t j = _size; j > i; j--) {
+            new (d + j) node(nullptr, std::move(d[j - 1].data));
+            d[j - 1].~node();
+        }
+        new (d + i) node(nullptr, std::move(fresh.data));
+        _size++;
+        root = small.link(_size);
+        return d + i;
+    }
+
+    /**
+     * Removes an inline node, shifting the following ones.
+     * @param n     the node
+     */
+    void __remove_inline(node* n) noexcept {
+        node* d = small.data();
+        std::size_t i = n - d;
+        n->~node();
+        __move_nodes(n, n + 1, _size - i - 1);
+        _size--;
+        root = small.link(_size);
+    }
+
+    /**
+     * Switches from the inline nodes to a tree in the storage, linked by
+     * halving once every node is made. If an allocation throws, the values
+     * moved out go back and the map stays inline.
+     */
+    void __materialize() {
+        node* d = small.data();
+        node* made[small.capacity() > 0 ? small.capacity() : 1];
+        std::size_t n = 0;
+        try {
+            for (; n < _size; n++) made[n] = storage.make(nullptr, std::move(d[n].data));
+        } catch (...) {
+            for (std::size_t i = 0; i < n; i++) {
+                d[i].~node();
+                new (d + i) node(nullptr, std::move(made[i]->data));
+                storage.drop(made[i]);
+            }
+            root = small.link(_size);
+            throw;
+        }
+        for (std::size_t i = 0; i < _size; i++) d[i].~node();
+        small.activate(false);
+        root = __link_sorted(made, 0, _size, nullptr);
+        __rebuilt();
+    }
+
+    /**
+     * Links a balanced tree out of nodes sorted by key, by halving (marks
+     * are cleared, see __rebuilt).
+     * @param nodes     the nodes
+     * @param lo        first index
+     * @param hi        past the last index
+     * @param parent    parent of the linked local root
+     * @return          the linked local root
+     */
+    static node* __link_sorted(node* const* nodes, std::size_t lo, std::size_t hi, node* parent) noexcept {
+        if (lo >= hi) return nullptr;
+        std::size_t mid = lo + (hi - lo) / 2;
+        node* n = nodes[mid];
+        n->parent = parent;
+        n->left = __link_sorted(nodes, lo, mid, n);
+        n->right = __link_sorted(nodes, mid + 1, hi, n);
+        REFRESH_DEPTH(n);
+        n->mark = 0;
+        return n;
+    }
+
+    /**
+     * Loads a range in the empty tree, in linear time if sorted by key:
+     * nodes are allocated in one batch if the size is known, indexed, then
+     * linked by halving. An unsorted range is sorted by the index (keeping
+     * the first of duplicated keys). Until then nodes are kept as a right
+     * vine, a valid tree to be dropped on exceptions. An empty range keeps
+     * the inline nodes. Treaps then sink the nodes into heap order (see
+     * _balance_treap::rebuilt), the depth is the one of a treap.
+     * @param begin     the first value
+     * @param end       past the last value
+     */
+    template<typename Iter>
+    void __load(Iter begin, Iter end) {
+        using category = typename std::iterator_traits<Iter>::iterator_category;
+        if (begin == end) return;
+        std::vector<node*> nodes;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+            std::size_t n = static_cast<std::size_t>(std::distance(begin, end));
+            nodes.reserve(n);
+            storage.reserve(n);
+        }
+        small.activate(false);
+
+        node* tail = nullptr;
+        bool sorted = true;
+        for (; begin != end; ++begin) {
+            node* n = storage.make(tail, pair_type{*begin});
+            if (tail) {
+                tail->right = n;
+                sorted = sorted && _less(compare, traits::key(tail->data), traits::key(n->data));
+            } else {
+                root = n;
+            }
+            tail = n;
+            _size++;
+            nodes.push_back(n);
+        }
+        if (nodes.empty()) return;
+
+        std::size_t kept = nodes.size();
+        if (!sorted) {
+            auto less = [this](const node* a, const node* b) {
+                return _less(compare, traits::key(a->data), traits::key(b->data));
+            };
+            std::stable_sort(nodes.begin(), nodes.end(), less);
+            // Duplicates to the back, dropped once nothing can throw
+            kept = 1;
+            for (std::size_t i = 1; i < nodes.size(); i++) {
+                if (less(nodes[kept - 1], nodes[i])) std::swap(nodes[kept++], nodes[i]);
+            }
+            for (std::size_t i = kept; i < nodes.size(); i++) storage.drop(nodes[i]);
+        }
+        _size = static_cast<size_type>(kept);
+        root = __link_sorted(nodes.data(), 0, kept, nullptr);
+        __rebuilt();
+    }
+
+    /**
+     * Copies the content of src, in the same representation
+     * (the map must be empty).
+     * @param src   the map to copy
+     */
+    void __clone_from(const bst& src) {
+        size_type n = src._counted ? src._size : static_cast<size_type>(__count(src.root));
+        if (src.small.active()) {
+            const node* s = src.small.data();
+            std::size_t i = 0;
+            try {
+                for (; i < n; i++) new (small.data() + i) node(nullptr, pair_type{s[i].data});
+            } catch (...) {
+                while (i-- > 0) small.data()[i].~node();
+                throw;
+            }
+            root = small.link(n);
+        } else {
+            small.activate(false);
+            root = __clone_tree(src.root, n);
+            __relocated();
+        }
+        _size = n;
+    }
+
+    /**
+     * Takes the content of src leaving it empty. The tree is adopted as
+     * is, hence the caller must adopt the src storage as well.
+     * @param src   the map to steal from
+     */
+    void __steal(bst& src) noexcept {
+        if (src.small.active()) {
+            __move_nodes(small.data(), src.small.data(), src._size);
+            root = small.link(src._size);
+            src.root = nullptr;
+        } else {
+            small.activate(false);
+            src.small.activate(true);
+            root = std::exchange(src.root, nullptr);
+        }
+        _size = std::exchange(src._size, 0);
+        _counted = std::exchange(src._counted, true);
+    }
+
+    /**
+     * Moves the tree in another storage allocating its nodes in key order,
+     * without recursion (splayed trees may be degenerate): in turn, each
+     * node is replaced by its copy and destroyed.
+     * @param to        the destination storage
+     */
+    void __relocate(storage_type& to) {
+        node* src = __left_most(root);
+        while (src != nullptr) {
+            node* n = to.make(nullptr, std::move(src->data));
+            n->depth = src->depth;
+            n->mark = src->mark;
+            CHILD_AS(src->parent, src, n);
+            CHILD_LEFT(n, src->left);
+            CHILD_RIGHT(n, src->right);
+            if (storage_type::releases_all) {
+                src->~node();
+            } else {
+                storage.drop(src);
+            }
+
+            // Next in key order
+            if (n->right) {
+                src = __left_most(n->right);
+            } else {
+                node* c = n;
+                src = n->parent;
+                while (src != nullptr && src->right == c) {
+                    c = src;
+                    src = src->parent;
+                }
+            }
+        }
+    }
+
+    /**
+     * Hands the tree and its storage to the reclaimer O(1).
+     * @return      false if the tree could not be handed over
+     */
+    bool __defer_tree() noexcept {
+        auto g = new (std::nothrow) _tree_garbage<node, storage_type>{root, std::move(storage)};
+        if (g == nullptr) return false;
+        reclaimer->push(g);
+        return true;
+    }
+
+    /**
+     * Destroys the whole tree (without recursion), or hands it to the
+     * reclaimer if any. If the storage can release whole slabs and nodes
+     * do not require destruction the tree is not even visited.
+     */
+    void __drop_tree() noexcept {
+        if (small.active()) {
+            node* d = small.data();
+            for (std::size_t i = 0; i < _size; i++) d[i].~node();
+        } else if (reclaimer != nullptr && root != nullptr && __defer_tree()) {
+            // The storage was moved out along with the tree
+        } else if (!storage_type::releases_all || !std::is_trivially_destructible<node>::value) {
+            std::size_t all = static_cast<std::size_t>(-1);
+            _drop_nodes(root, storage, all);
+        }
+        storage.release();
+        // An empty map starts small again
+        small.activate(true);
+        root = nullptr;
+        _size = 0;
+        _counted = true;
+    }
+
+// API
+
+public:
+
+    // Mimic std::map
+    // https://en.cppreference.com/w/cpp/container/map
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = pair_type;
+    using key_compare = Compare;
+
+    using iterator = _iterator<node, typename traits::stored_type>;
+    using const_iterator = _iterator<node, const pair_type>;
+    using node_type = node;
+
+    // RAII & Copy and move
+
+    bst() noexcept {}
+
+    explicit bst(const Allocator& alloc) noexcept: storage{alloc} {}
+
+    bst(const bst& src):
+        compare{src.compare},
+        storage{alloc_traits::select_on_container_copy_construction(src.get_allocator())}
+    {
+        // Make a copy of the other tree
+        __clone_from(src);
+    }
+    bst& operator=(bst const& src) {
+        // Self assign guard
+        if (this == &src) return *this;
+        // Assignment copy
+        __drop_tree();
+        if constexpr (alloc_traits::propagate_on_container_copy_assignment::value) {
+            storage.reset(src.get_allocator());
+        }
+        compare = src.compare;
+        __clone_from(src);
+        return *this;
+    };
+
+    bst(bst&& src) noexcept:
+        storage{std::move(src.storage)},
+        reclaimer{src.reclaimer}
+    {
+        // Steal the tree
+        __steal(src);
+    }
+
+    bst& operator=(bst&& src) noexcept(alloc_traits::is_always_equal::value ||
+                                       alloc_traits::propagate_on_container_move_assignment::value) {
+        if (this == &src) return *this;
+        __drop_tree();
+        if (src.small.active()) {
+            // Inline nodes do not belong to the storage
+            __steal(src);
+        } else if (alloc_traits::propagate_on_container_move_assignment::value ||
+                get_allocator() == src.get_allocator()) {
+            // Steal the tree
+            storage = std::move(src.storage);
+            __steal(src);
+        } else {
+            // Memory can not be adopted, move the values one by one
+            small.activate(false);
+            storage.reserve(src.size());
+            root = __clone_walk<true>(src.root, nullptr, storage);
+            _size = src._size;
+            src.clear();
+        }
+        return *this;
+    }
+
+    /**
+     * Swaps the content of two maps. Allocators are swapped only if they
+     * propagate on swap, otherwise they must compare equal.
+     * @param other     The map to swap with
+     */
+    void swap(bst& other) noexcept {
+        std::swap(compare, other.compare);
+        storage.swap(other.storage);
+        if (small.active() || other.small.active()) {
+            // Inline nodes live within the maps, pass them through a buffer
+            bst tmp;
+            tmp.__steal(*this);
+            __steal(other);
+            other.__steal(tmp);
+        } else {
+            std::swap(root, other.root);
+            std::swap(_size, other._size);
+            std::swap(_counted, other._counted);
+        }
+    }
+    friend void swap(bst& a, bst& b) noexcept { a.swap(b); }
+
+    /**
+     * Create a map from an iterable iterable source of
+     * pair<K,V> values.
+     * @tparam Iter
+     * @param begin     The iterator
+     * @param end       The end() iterator
+     * @param alloc     The allocator
+     */
+    template<typename Iter>
+    bst(Iter begin, Iter end, const Allocator& alloc = Allocator{}): storage{alloc} {
+        while(begin != end) {
+            insert(*begin);
+            ++begin;
+        }
+    }
+
+    /**
+     * Bulk loads a range of pair<K,V> values sorted by key without
+     * duplicates in linear time, into a tree of minimum depth (treaps are
+     * then heapified, in linear time as well). Nodes are allocated in one
+     * batch (forward iterators). A range found unsorted is sorted (the
+     * first of duplicated keys is kept).
+     * @tparam Iter
+     * @param begin     The iterator
+     * @param end       The end() iterator
+     * @param alloc     The allocator
+     */
+    template<typename Iter>
+    bst(sorted_unique_t, Iter begin, Iter end, const Allocator& alloc = Allocator{}): storage{alloc} {
+        try {
+            __load(begin, end);
+        } catch (...) {
+            __drop_tree();
+            throw;
+        }
+    }
+
+    ~bst() {
+#ifdef __DEBUG_BST_RAII
+        std::cout << "~bst() size=" << _size << std::endl;
+#endif
+        __drop_tree();
+    }
+
+// MODIFIERS
+
+    /**
+     * Inserts a pair in the map. If insertion is successful returns an
+     * iterator to the pair and true, else the end() iterator and false.
+     * @param x     The pair to be inserted
+     * @return      a pair<iterator, bool>
+     */
+    std::pair<iterator, bool> insert(const pair_type& x) { // ✓ testing
+        node* ref = __insert(pair_type{x}); // Clone the pair
+        return ref == nullptr ? NOINSERT : std::pair<iterator, bool>{ iterator{root, ref} , true };
+    }
+    std::pair<iterator, bool> insert(pair_type&& x) { // ✓ testing
+        node* ref = __insert(std::move(x));
+        return ref == nullptr ? NOINSERT : std::pair<iterator, bool>{ iterator{root, ref} , true };
     }
 
     /**
@@ -484,22 +2938,187 @@ public:
      * @param x     The pair to be inserted
      * @return      a pair<iterator, bool>
      */
-    template<class... Types>
-    std::pair<iterator, bool> emplace(Types&&... args) { // ✓ testing
-        node *ref{nullptr}, *ins{nullptr};
-        (..., ((ins = __insert(std::move(args))) && (ref || (ref = ins))));
-        return ref == nullptr ? NOINSERT : std::pair<iterator, bool>{ iterator{root, ref} , true };
+    template<class... Types>
+    std::pair<iterator, bool> emplace(Types&&... args) { // ✓ testing
+        node *ref{nullptr}, *ins{nullptr};
+        (..., ((ins = __insert(std::move(args))) && (ref || (ref = ins))));
+        return ref == nullptr ? NOINSERT : std::pair<iterator, bool>{ iterator{root, ref} , true };
+    }
+
+    /**
+     * Inserts a batch of pairs (sorted by key first, if not). Keys already
+     * present, and the duplicated keys of the batch but the first, are not
+     * inserted. Batches fitting the inline nodes (forward iterators) are
+     * inserted there. Batches small compared to the tree are inserted in key
+     * order, each descent starting from the previous insertion; larger
+     * ones are merged with the tree, linked anew by halving in linear
+     * time (not for treaps, their shape follows the priorities). The tree
+     * is balanced either way.
+     * @param first     The first pair
+     * @param last      The past the last pair
+     * @return          The number of pairs inserted
+     */
+    template<typename Iter>
+    size_type insert_batch(Iter first, Iter last) {
+        if (reclaimer != nullptr) reclaimer->step();
+        if (first == last) return 0;
+
+        using category = typename std::iterator_traits<Iter>::iterator_category;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+            // Batches fitting the inline nodes stay there
+            if (small.active() && _size + static_cast<std::size_t>(std::distance(first, last)) <= small.capacity()) {
+                size_type inserted = 0;
+                for (; first != last; ++first) inserted += __insert(pair_type{*first}) != nullptr;
+                return inserted;
+            }
+        }
+        if (small.active()) __materialize();
+
+        std::vector<node*> nodes;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+            std::size_t n = static_cast<std::size_t>(std::distance(first, last));
+            nodes.reserve(n);
+            storage.reserve(n);
+        }
+        size_type before = size();
+        std::size_t linked = 0; // nodes before are in the tree (or dropped)
+        auto less = [this](const node* a, const node* b) {
+            return _less(compare, traits::key(a->data), traits::key(b->data));
+        };
+
+        try {
+            bool sorted = true;
+            for (; first != last; ++first) {
+                nodes.push_back(nullptr);
+                nodes.back() = storage.make(nullptr, pair_type{*first});
+                sorted = sorted && (nodes.size() == 1 || less(nodes[nodes.size() - 2], nodes.back()));
+            }
+            if (!sorted) {
+                std::stable_sort(nodes.begin(), nodes.end(), less);
+                std::size_t kept = 1;
+                for (std::size_t i = 1; i < nodes.size(); i++) {
+                    if (less(nodes[kept - 1], nodes[i])) std::swap(nodes[kept++], nodes[i]);
+                }
+                for (std::size_t i = kept; i < nodes.size(); i++) storage.drop(nodes[i]);
+                nodes.resize(kept);
+            }
+
+            if (Balance::rebuildable && nodes.size() * __BATCH_MERGE_RATIO >= _size) {
+                __merge(nodes);
+                linked = nodes.size();
+            } else {
+                node* from = nullptr;
+                for (; linked < nodes.size(); linked++) {
+                    if (__insert_after(from, nodes[linked])) {
+                        from = nodes[linked];
+                    } else {
+                        storage.drop(nodes[linked]);
+                    }
+                }
+            }
+        } catch (...) {
+            for (std::size_t i = linked; i < nodes.size(); i++) {
+                if (nodes[i] != nullptr) storage.drop(nodes[i]);
+            }
+            throw;
+        }
+        return _size - before;
+    }
+
+    /**
+     * Removes a key from the map. With a transparent comparator (declaring
+     * is_transparent) any type comparable with K is accepted.
+     * @param k     The key to remove
+     * @return      The number of values removed
+     */
+    size_type erase(const K& k) noexcept { // ✓ testing
+        return __erase(k);
+    }
+    template <typename Q, typename C = Compare, typename = typename C::is_transparent>
+    size_type erase(const Q& k) noexcept { // ✓ testing
+        return __erase(k);
+    }
+
+    /**
+     * Removes the keys of a range in O(log n + k): the tree is split at
+     * both bounds, the range cut out freed at once, and both sides joined
+     * back (instead of k searches and rebalances).
+     * @param lower     The lower inclusive bound
+     * @param upper     The upper inclusive bound
+     * @return          The number of values removed
+     */
+    size_type erase(const K& lower, const K& upper) noexcept { // ✓ testing
+        if (_less(compare, upper, lower)) return 0;
+        if (small.active()) {
+            node* d = small.data();
+            std::size_t i = __lower_inline(lower), j = i;
+            while (j < _size && !_less(compare, upper, traits::key(d[j].data))) d[j++].~node();
+            __move_nodes(d + i, d + j, _size - j);
+            _size -= j - i;
+            root = small.link(_size);
+            return j - i;
+        }
+        node *lo, *range, *mid, *hi;
+        node* first = __split(root, lower, lo, range);
+        node* last = __split(range, upper, mid, hi);
+        root = __concat(lo, nullptr, hi);
+
+        std::size_t budget = static_cast<std::size_t>(-1);
+        if (first) storage.drop(first), budget--;
+        if (last) storage.drop(last), budget--;
+        _drop_nodes<true>(mid, storage, budget);
+        std::size_t count = static_cast<std::size_t>(-1) - budget;
+        if (_counted) _size -= count;
+        return count;
     }
 
     /**
-     * Removes a key from the map.
-     * @param k     The key to remove
+     * Removes the values matching a predicate in one pass over the map.
+     * The nodes are sorted out in key order, then if at least 1 in
+     * __BATCH_MERGE_RATIO matches, the matching ones are freed and the
+     * others linked anew by halving, O(n) in all. Fewer matching nodes (or
+     * the ones of treaps) are unlinked one by one. Nothing is changed if
+     * the predicate throws.
+     * @param m     The map
+     * @param pred  Called with each value, true to remove it
      * @return      The number of values removed
      */
-    size_type erase(const K& k) noexcept { // ✓ testing
-        node* n = __extract(k);
-        delete n;
-        return (n == nullptr) ? 0 : 1;
+    template <typename Pred>
+    friend size_type erase_if(bst& m, Pred pred) { // ✓ testing
+        std::size_t count = 0;
+        if (m.small.active()) {
+            node* d = m.small.data();
+            std::array<bool, Inline + 1> matches{};
+            for (std::size_t j = 0; j < m._size; j++) matches[j] = pred(std::as_const(d[j].data));
+            for (std::size_t j = 0; j < m._size; j++) {
+                if (matches[j]) {
+                    d[j].~node();
+                    count++;
+                } else if (count > 0) {
+                    __move_nodes(d + j - count, d + j, 1);
+                }
+            }
+            m._size -= count;
+            m.root = m.small.link(m._size);
+            return count;
+        }
+        std::vector<node*> kept, matching;
+        for (node* n = __left_most(m.root); n != nullptr; n = core::__successor(n)) {
+            if (pred(std::as_const(n->data))) matching.push_back(n); else kept.push_back(n);
+        }
+        count = matching.size();
+        if (Balance::rebuildable && count * __BATCH_MERGE_RATIO >= count + kept.size()) {
+            for (node* n : matching) m.storage.drop(n);
+            m.root = __link_sorted(kept.data(), 0, kept.size(), nullptr);
+            m.__rebuilt();
+        } else {
+            for (node* n : matching) {
+                m.__unlink(n);
+                m.storage.drop(n);
+            }
+        }
+        if (m._counted) m._size -= count;
+        return count;
     }
 
     /**
@@ -509,12 +3128,19 @@ public:
      *              or default value for value_type
      */
     value_type pop(const K& k) noexcept { // ✓ testing
+        if (small.active()) {
+            node* n = __find_inline(k, EXACT);
+            if (n == nullptr) return value_type{};
+            value_type old = n->data;
+            __remove_inline(n);
+            return old;
+        }
         node* n = __extract(k);
         if (n == nullptr) {
             return value_type{};
         } else {
             value_type old = n->data;
-            delete n;
+            storage.drop(n);
             return old;
         }
     }
@@ -523,38 +3149,191 @@ public:
      * Removes all the values from the map
      */
     void clear() noexcept { // ✓ testing
-        delete root;
-        root = nullptr;
-        _size = 0;
+        __drop_tree();
+    }
+
+    /**
+     * Sets the reclaimer freeing the trees dropped by clear(), ~bst() and
+     * the assignments (see bst_reclaimer). With nullptr, the default,
+     * they are freed right away. The reclaimer must outlive the map.
+     * @param r     the reclaimer
+     */
+    void set_reclaimer(bst_reclaimer* r) noexcept { reclaimer = r; }
+
+    /**
+     * Relocates all the nodes in a fresh contiguous block, laid out in key
+     * order, and frees the old memory. After heavy insert / erase traffic
+     * this brings back sequential scans and denser lookups.
+     * Invalidates all the iterators.
+     */
+    void compact() {
+        if (small.active() || root == nullptr) return;
+        storage_type fresh{storage.get_allocator()};
+        fresh.reserve(size());
+        __relocate(fresh);
+        __relocated();
+        // The old memory is freed along with fresh
+        storage.swap(fresh);
+    }
+
+    /**
+     * Performs a bounded share of the rebalancing deferred by the policy
+     * (see balance_incremental), to be spread among operations. Other
+     * policies have nothing pending.
+     * @param budget    the number of nodes to fix at most
+     * @return          true if some rebalancing is still pending
+     */
+    bool rebalance_step(std::size_t budget = 1) noexcept {
+        if (small.active()) return false;
+        return __rebalance_step(budget);
     }
 
     /**
-     * Balances the tree
+     * Rebuilds the tree in place with the minimum depth, in linear time and
+     * without allocating (treaps keep the shape of their priorities)
      */
     void balance() noexcept { // ✓ testing
-        __balance_tree();
+        // Inline nodes are a list, not a tree
+        if (small.active()) return;
+        __rebalance();
+    }
+
+    /**
+     * Splits the map at a key in O(log n): the first map gets the keys
+     * lower than k, the second the others, this one is left empty. Both
+     * keep the balancing invariants. Their nodes stay where they are: the
+     * node pools co-own the slabs, freed once both maps released them
+     * (compact() moves a map out). Sizes are counted on the first size()
+     * call, unless the whole map goes to one side.
+     * @param k     The key to split at
+     * @return      The maps of the lower and of the greater or equal keys
+     */
+    std::pair<bst, bst> split(const K& k) {
+        if (small.active()) __materialize();
+        std::pair<bst, bst> halves{bst{get_allocator()}, bst{get_allocator()}};
+        storage.share(halves.second.storage);
+        node *lo, *hi;
+        node* found = __split(root, k, lo, hi);
+        if (found != nullptr) hi = __concat(nullptr, found, hi);
+
+        bst& second = halves.second;
+        second.compare = compare;
+        second.reclaimer = reclaimer;
+        second.small.activate(false);
+        second.root = hi;
+        second._size = lo == nullptr ? _size : 0;
+        second._counted = hi == nullptr || (lo == nullptr && _counted);
+        root = lo;
+        _size = hi == nullptr ? _size : 0;
+        _counted = lo == nullptr || (hi == nullptr && _counted);
+
+        halves.first.compare = compare;
+        halves.first.reclaimer = reclaimer;
+        halves.first = std::move(*this);
+        return halves;
+    }
+
+    /**
+     * Concatenates two maps in O(log n): all the keys of left must be lower
+     * than the ones of right. The nodes stay where they are, the storage of
+     * right is adopted (allocators must compare equal). Both are left empty.
+     * @param left      The map of the lower keys
+     * @param right     The map of the greater keys
+     * @return          The map of all the keys
+     */
+    static bst join(bst&& left, bst&& right) {
+        if (left.small.active()) left.__materialize();
+        if (right.small.active()) right.__materialize();
+        left.storage.adopt(right.storage);
+
+        left.root = __concat(left.root, nullptr, right.root);
+        left._size += right._size;
+        left._counted = left._counted && right._counted;
+        right.root = nullptr;
+        right._size = 0;
+        right._counted = true;
+        right.small.activate(true);
+        return bst{std::move(left)};
+    }
+
+    /**
+     * Merges two maps into the map of the keys of either, in
+     * O(m log(n / m + 1)) for maps of m <= n keys. The divide and conquer
+     * follows the shallower tree: its root splits the other one, the
+     * branches on each side are merged independently (by parallel workers
+     * for big maps, see __PARALLEL_SET_MIN) and joined back through the
+     * root. Nodes do not move, the storage of one map is adopted by the
+     * other (allocators must compare equal), both are left empty.
+     * The comparator shall not throw.
+     * @param a         The first map
+     * @param b         The second map
+     * @param keep      The map whose value is kept on equal keys
+     * @return          The map of the keys of either
+     */
+    static bst set_union(bst&& a, bst&& b, bst_keep keep = bst_keep::left) {
+        return __set_operation(UNION, std::move(a), std::move(b), keep == bst_keep::left);
+    }
+
+    /**
+     * Intersects two maps into the map of the keys of both, as set_union().
+     * @param a         The first map
+     * @param b         The second map
+     * @param keep      The map whose value is kept
+     * @return          The map of the keys of both
+     */
+    static bst set_intersection(bst&& a, bst&& b, bst_keep keep = bst_keep::left) {
+        return __set_operation(INTERSECTION, std::move(a), std::move(b), keep == bst_keep::left);
+    }
+
+    /**
+     * Subtracts a map from another into the map of the keys of the first
+     * not in the second, as set_union() (the divide and conquer follows
+     * the second map).
+     * @param a         The first map
+     * @param b         The map of the keys to remove
+     * @return          The map of the keys of a only
+     */
+    static bst set_difference(bst&& a, bst&& b) {
+        return __set_operation(DIFFERENCE, std::move(a), std::move(b), true);
     }
 
 // GETTERS
 
     /**
-     * Weather the map contains a given key
+     * Returns the allocator associated with the map
+     * @return      The allocator
+     */
+    Allocator get_allocator() const noexcept { return storage.get_allocator(); }
+
+    /**
+     * Weather the map contains a given key (any comparable type with a
+     * transparent comparator, see erase())
      * @param k     The key to search for
      * @return      True if value is present
      */
     bool has(const K& k) noexcept { // ✓ testing
-        return __find_key(root, k, EXACT) != nullptr;
+        return __lookup(k) != nullptr;
+    }
+    template <typename Q, typename C = Compare, typename = typename C::is_transparent>
+    bool has(const Q& k) noexcept { // ✓ testing
+        return __lookup(k) != nullptr;
     }
 
     /**
      * Searches for a key, if the key is present
      * an iterator that starts at that key is returned
-     * else end() is returned.
+     * else end() is returned (any comparable type with a transparent
+     * comparator, see erase()).
      * @param k     The key to search for
      * @return      The iterator
      */
     iterator find(const K& k) noexcept { // ✓ testing
-        node* found = __find_key(root, k, EXACT);
+        node* found = __lookup(k);
+        return found == nullptr ? end() : iterator{root, found};
+    }
+    template <typename Q, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const Q& k) noexcept { // ✓ testing
+        node* found = __lookup(k);
         return found == nullptr ? end() : iterator{root, found};
     }
     const_iterator find(const K& k) const noexcept {
@@ -563,16 +3342,61 @@ public:
     }
 
     /**
-     * Returns the size of the map O(1)
+     * Searches for a batch of keys, writing for each one an iterator that
+     * starts at the key, or end() if not present. The descents are
+     * interleaved to overlap their cache misses (see __FIND_MANY_LANES),
+     * worthwhile on trees larger than the caches.
+     * @param first     The first key (forward iterator)
+     * @param last      The past the last key
+     * @param out       The output iterator of the iterators
+     * @return          The number of keys found
+     */
+    template<typename Iter, typename Out>
+    size_type find_many(Iter first, Iter last, Out out) { // ✓ testing
+        return __find_many(first, last, [&](node* n) { *out++ = n == nullptr ? end() : iterator{root, n}; });
+    }
+
+    /**
+     * Whether the map contains each key of a batch, as find_many().
+     * @param first     The first key (forward iterator)
+     * @param last      The past the last key
+     * @param out       The output iterator of the bools
+     * @return          The number of keys found
+     */
+    template<typename Iter, typename Out>
+    size_type has_many(Iter first, Iter last, Out out) { // ✓ testing
+        return __find_many(first, last, [&](node* n) { *out++ = n != nullptr; });
+    }
+
+    /**
+     * Copies the map into an immutable snapshot O(n), whose lookups run a
+     * branchless descent over the keys laid out in Eytzinger order (see
+     * frozen_bst.cpp, to be included).
+     * @return      The snapshot
+     */
+    template<typename Frozen = frozen_bst<K, V, Compare, size_type>>
+    Frozen freeze() { // ✓ testing
+        return Frozen{sorted_unique, begin(), end(), compare};
+    }
+
+    /**
+     * Returns the size of the map O(1), the first call after split()
+     * counts the nodes O(n)
      * @return      The size of the map
      */
-    size_type size() noexcept { return _size; }
+    size_type size() noexcept {
+        if (!_counted) {
+            _size = static_cast<size_type>(__count(root));
+            _counted = true;
+        }
+        return _size;
+    }
 
     /**
      * Check weather the map is empty O(1)
      * @return      True if the map is empty
      */
-    bool empty() noexcept { return _size == 0; }
+    bool empty() noexcept { return _counted ? _size == 0 : root == nullptr; }
 
     /**
      * Returns the current depth of the map O(1)
@@ -587,20 +3411,23 @@ public:
      * Allows for easy lookup with the subscript ( @c [] ) operator.  Returns
      * data associated with the key specified in subscript.  If the key does
      * not exist, a pair with that key is created using default values, which
-     * is then returned.
+     * is then returned. With inline nodes (Inline > 0) the reference is
+     * invalidated by the next insertion or erasure.
      *
      * @param k     The key for which data should be retrieved
      * @return      A reference to the data related to the key
      */
-    V& operator[](const K& k) { // ✓ testing
-        node* found = __find_key(root, k, EXACT);
+    template<typename U = V>
+    typename std::enable_if<!std::is_void<U>::value, U&>::type operator[](const K& k) { // ✓ testing
+        node* found = __lookup(k);
         if (found == nullptr) {
             found = __insert(pair_type{k, V{}});
         }
         return found->data.second;
     }
-    V& operator[](K&& k) { // ✓ testing
-        node* found = __find_key(root, k, EXACT);
+    template<typename U = V>
+    typename std::enable_if<!std::is_void<U>::value, U&>::type operator[](K&& k) { // ✓ testing
+        node* found = __lookup(k);
         if (found == nullptr) {
             found = __insert(pair_type{std::move(k), V{}});
         }
@@ -610,31 +3437,30 @@ public:
     /**
      * Returns an iterator to a slice of the map. The slice will start
      * at the first key greater or equal to lower and will end with the
-     * last key lower or equal to upper.
+     * last key lower or equal to upper. Bounds may be of any comparable
+     * type with a transparent comparator (see erase()).
      *
      * @param lower     The lower inclusive bound
      * @param upper     The upper inclusive bound
      * @return          The iterator
      */
     iterator operator()(const K& lower, const K& upper) noexcept {
-        if (compare(upper, lower)) return end();
-        // Check that the RIGHT neighbour is not greater than upper
-        node* lower_node = __find_key(root, lower, RIGHT);
-        if (compare(upper, lower_node->data.first)) return end();
-        // Check that the LEFT neighbour is not lower than lower
-        node* upper_node = __find_key(root, upper, LEFT);
-        if (compare(upper_node->data.first, lower)) return end();
-        // Ok
-        return iterator{root, lower_node, upper_node};
+        node *first, *last;
+        return __slice(lower, upper, first, last) ? iterator{root, first, last} : end();
+    }
+    template <typename L, typename U, typename C = Compare, typename = typename C::is_transparent>
+    iterator operator()(const L& lower, const U& upper) noexcept {
+        node *first, *last;
+        return __slice(lower, upper, first, last) ? iterator{root, first, last} : end();
     }
     const_iterator operator()(const K& lower, const K& upper) const noexcept {
-        if (compare(upper, lower)) return cend();
+        if (_less(compare, upper, lower)) return cend();
         // Check that the RIGHT neighbour is not greater than upper
         node* lower_node = __find_key(root, lower, RIGHT);
-        if (compare(upper, lower_node->data.first)) return cend();
+        if (lower_node == nullptr || _less(compare, upper, traits::key(lower_node->data))) return cend();
         // Check that the LEFT neighbour is not lower than lower
         node* upper_node = __find_key(root, upper, LEFT);
-        if (compare(upper_node->data.first, lower)) return cend();
+        if (upper_node == nullptr || _less(compare, traits::key(upper_node->data), lower)) return cend();
         // Ok
         return iterator{root, lower_node, upper_node};
     }
@@ -699,6 +3525,15 @@ public:
 
     // DEBUG
 
+    /**
+     * Checks the links, the depths and the invariants of the balancing
+     * policy (DEBUG) O(n log n)
+     * @return      True if they hold
+     */
+    bool check_tree() const noexcept {
+        return small.active() || core::__valid();
+    }
+
 private:
 
     void __print_tree(std::ostream& os, std::string&& pref, std::string&& pref_rest, node* from);
@@ -728,56 +3563,482 @@ public:
 };
 
 
+/**
+ * What the nodes hold: a pair<const K, V> for maps, the sole key for
+ * sets (V = void).
+ */
 template <typename K, typename V>
-struct _node {
+struct _value_traits {
+
+    using value_type = std::pair<const K, V>;
+    using stored_type = std::pair<const K, V>;
+
+    static const K& key(const value_type& x) noexcept { return x.first; }
+
+    static void print(std::ostream& os, const stored_type& x) {
+        os << x.first << ":" << x.second;
+    }
+};
+
+template <typename K>
+struct _value_traits<K, void> {
+
+    using value_type = K;
+    using stored_type = const K;
+
+    static const K& key(const K& x) noexcept { return x; }
+
+    static void print(std::ostream& os, const stored_type& x) {
+        os << x;
+    }
+};
+
+
+/**
+ * The cached key prefix of a node (see _key_prefix), none by default.
+ */
+template <typename Prefix>
+struct _node_prefix {
+    std::uint64_t prefix;
+};
+
+template <>
+struct _node_prefix<void> {};
+
+template <typename K, typename V, typename Prefix>
+struct _node: _node_prefix<Prefix> {
 
     _node* parent{nullptr};
     _node* left{nullptr};
     _node* right{nullptr};
     unsigned char depth;
-    std::pair<const K, V> data;
+    unsigned char mark;     // owned by the balancing policy
+    typename _value_traits<K, V>::stored_type data;
 
-    explicit _node(_node* parent, std::pair<const K, V>& pair) noexcept:
+    template<typename P>
+    explicit _node(_node* parent, P&& value) noexcept:
             parent{parent},
             depth{0},
-            data{pair}
+            mark{0},
+            data{std::forward<P>(value)}
     {
+        if constexpr (!std::is_void<Prefix>::value) {
+            this->prefix = Prefix::prefix(_value_traits<K, V>::key(data));
+        }
 #ifdef __DEBUG_NODE_RAII
-        std::cout << "Allocated: " << pair.first << std::endl;
+        std::cout << "Allocated: " << _value_traits<K, V>::key(data) << std::endl;
 #endif
     };
-    explicit _node(_node* parent, std::pair<const K, V>&& pair) noexcept:
-            parent{parent},
-            depth{0},
-            data{std::move(pair)}
-    {
+
+    // Nodes do not own their children, the tree storage does
 #ifdef __DEBUG_NODE_RAII
-        std::cout << "Allocated: " << pair.first << std::endl;
+    ~_node() {
+        std::cout << "Destroying: " << _value_traits<K, V>::key(data) << std::endl;
+    }
 #endif
+};
+
+
+/**
+ * Node storage that allocates nodes in slabs. Erased nodes are kept in an
+ * intrusive free list (the link lives in the free slot itself) and recycled
+ * by the following allocations. Slabs are only returned on release(), that
+ * frees the whole storage at once without visiting the nodes.
+ * Slabs are obtained from Alloc rebound through std::allocator_traits.
+ * Pools of split trees co-own their slabs through reference counted
+ * groups (see share()), freed by the last pool releasing them.
+ */
+template <typename node, typename Alloc>
+class _node_pool {
+
+    union slot {
+        // First slot of each slab: the slab chain
+        struct { slot* prev; std::size_t capacity; } head;
+        // Free slot: the free list
+        slot* next;
+        alignas(node) unsigned char raw[sizeof(node)];
     };
 
-    explicit _node(_node& src):
-            parent{src.parent},
-            left{src.left == nullptr ? nullptr : new _node{*src.left}},
-            right{src.right == nullptr ? nullptr : new _node{*src.right}},
-            depth{src.depth},
-            data{src.data}
-    {
-#ifdef __DEBUG_NODE_RAII
-        std::cout << "Allocated: copy" << std::endl;
-#endif
+    using node_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<node>;
+    using node_traits = std::allocator_traits<node_alloc>;
+    using slot_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<slot>;
+    using slot_traits = std::allocator_traits<slot_alloc>;
+
+    // Co-owned slabs, along with the groups they were joined from
+    struct group {
+        slot* slabs;
+        group* parents[2];
+        group* next; // groups left without owners, to be freed
+        std::atomic<std::size_t> owners;
+    };
+
+    using group_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<group>;
+    using group_traits = std::allocator_traits<group_alloc>;
+
+    node_alloc alloc;
+    slot* slabs{nullptr};
+    group* shared{nullptr};
+    slot* free_list{nullptr};
+    slot* bump{nullptr};
+    slot* bump_end{nullptr};
+    std::size_t capacity{__POOL_SLAB_FIRST};
+
+    /**
+     * Allocates a new slab and makes it the bump region.
+     */
+    void __grow() {
+        slot_alloc sa{alloc};
+        slot* slab = slot_traits::allocate(sa, capacity + 1);
+        slab->head.prev = slabs;
+        slab->head.capacity = capacity;
+        slabs = slab;
+        bump = slab + 1;
+        bump_end = bump + capacity;
+        if (capacity < __POOL_SLAB_MAX) capacity *= 2;
     }
 
-    ~_node() {
-#ifdef __DEBUG_NODE_RAII
-        std::cout << "Destroying: " << data.first << std::endl;
-#endif
-        // Custom RAII to propagate tree deletion
-        delete this->left;
-        delete this->right;
+    /**
+     * Returns a chain of slabs.
+     * @param s     the last slab of the chain
+     */
+    void __free_slabs(slot* s) noexcept {
+        slot_alloc sa{alloc};
+        while (s != nullptr) {
+            slot* prev = s->head.prev;
+            slot_traits::deallocate(sa, s, s->head.capacity + 1);
+            s = prev;
+        }
+    }
+
+    /**
+     * Allocates a group owned once.
+     * @param s     the slabs of the group
+     * @param a     a group it holds, or nullptr
+     * @param b     another group it holds, or nullptr
+     * @return      the group
+     */
+    group* __group(slot* s, group* a, group* b) {
+        group_alloc ga{alloc};
+        group* g = group_traits::allocate(ga, 1);
+        group_traits::construct(ga, g);
+        g->slabs = s;
+        g->parents[0] = a;
+        g->parents[1] = b;
+        g->next = nullptr;
+        g->owners.store(1, std::memory_order_relaxed);
+        return g;
+    }
+
+    /**
+     * Gives up an ownership of a group. The groups left without owners are
+     * freed along with their slabs, and give up the groups they hold.
+     * @param g     the group, or nullptr
+     */
+    void __unshare(group* g) noexcept {
+        group_alloc ga{alloc};
+        group* dead = nullptr;
+        auto drop = [&dead](group* x) {
+            if (x != nullptr && x->owners.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                x->next = dead;
+                dead = x;
+            }
+        };
+        drop(g);
+        while (dead != nullptr) {
+            group* x = dead;
+            dead = x->next;
+            __free_slabs(x->slabs);
+            drop(x->parents[0]);
+            drop(x->parents[1]);
+            group_traits::destroy(ga, x);
+            group_traits::deallocate(ga, x, 1);
+        }
+    }
+
+    /**
+     * Takes the slabs of another pool, leaving it empty.
+     */
+    void __steal(_node_pool& src) noexcept {
+        slabs = std::exchange(src.slabs, nullptr);
+        shared = std::exchange(src.shared, nullptr);
+        free_list = std::exchange(src.free_list, nullptr);
+        bump = std::exchange(src.bump, nullptr);
+        bump_end = std::exchange(src.bump_end, nullptr);
+        capacity = std::exchange(src.capacity, __POOL_SLAB_FIRST);
+    }
+
+public:
+
+    using allocator_type = Alloc;
+
+    // Whether release() frees all the nodes without drop()
+    static constexpr bool releases_all = true;
+
+    explicit _node_pool(const Alloc& a = Alloc{}) noexcept: alloc{a} {}
+    _node_pool(const _node_pool&) = delete;
+    _node_pool& operator=(const _node_pool&) = delete;
+
+    _node_pool(_node_pool&& src) noexcept: alloc{std::move(src.alloc)} {
+        __steal(src);
+    }
+
+    /**
+     * Takes the slabs of src. The allocator is moved only when it
+     * propagates on move assignment, otherwise it must compare equal.
+     */
+    _node_pool& operator=(_node_pool&& src) noexcept {
+        if (this == &src) return *this;
+        release();
+        if constexpr (node_traits::propagate_on_container_move_assignment::value) {
+            alloc = std::move(src.alloc);
+        }
+        __steal(src);
+        return *this;
+    }
+
+    ~_node_pool() { release(); }
+
+    Alloc get_allocator() const noexcept { return Alloc{alloc}; }
+
+    /**
+     * Releases everything and replaces the allocator.
+     * @param a     the new allocator
+     */
+    void reset(const Alloc& a) noexcept {
+        release();
+        alloc = node_alloc{a};
+    }
+
+    /**
+     * Swaps the slabs, and the allocators if they propagate on swap.
+     */
+    void swap(_node_pool& other) noexcept {
+        if constexpr (node_traits::propagate_on_container_swap::value) {
+            std::swap(alloc, other.alloc);
+        }
+        std::swap(slabs, other.slabs);
+        std::swap(shared, other.shared);
+        std::swap(free_list, other.free_list);
+        std::swap(bump, other.bump);
+        std::swap(bump_end, other.bump_end);
+        std::swap(capacity, other.capacity);
+    }
+
+    /**
+     * Makes room for n nodes in a single slab: as long as no slot is
+     * recycled the following n nodes will be contiguous.
+     * @param n     the number of nodes
+     */
+    void reserve(std::size_t n) {
+        if (static_cast<std::size_t>(bump_end - bump) >= n) return;
+        std::size_t next = capacity;
+        if (capacity < n) capacity = n;
+        __grow();
+        capacity = next;
+    }
+
+    /**
+     * Takes the slabs of another pool sharing the same allocator, along
+     * with the nodes they hold. Its free slots are not recycled. Groups
+     * co-owned by both are joined in a new one (nothing is changed if its
+     * allocation throws).
+     * @param other     the pool to take from, left empty
+     */
+    void adopt(_node_pool& other) {
+        if (other.shared == shared) {
+            // Owned once is enough, other.release() gives up its ownership
+        } else if (shared == nullptr) {
+            shared = std::exchange(other.shared, nullptr);
+        } else if (other.shared != nullptr) {
+            shared = __group(nullptr, shared, other.shared);
+            other.shared = nullptr;
+        }
+        while (other.slabs != nullptr) {
+            slot* s = other.slabs;
+            other.slabs = s->head.prev;
+            s->head.prev = slabs;
+            slabs = s;
+        }
+        other.release();
+    }
+
+    /**
+     * Lets an empty pool sharing the same allocator hold nodes in the slabs
+     * of this one, as the halves of a split tree do: the slabs are moved in
+     * a group co-owned by both, freed once both released it. The free slots
+     * and the current slab stay to this pool (nothing is changed if the
+     * group allocation throws).
+     * @param other     the pool to share with
+     */
+    void share(_node_pool& other) {
+        if (slabs != nullptr) {
+            shared = __group(slabs, shared, nullptr);
+            slabs = nullptr;
+        }
+        if (shared != nullptr) shared->owners.fetch_add(1, std::memory_order_relaxed);
+        other.__unshare(std::exchange(other.shared, shared));
+    }
+
+    /**
+     * Constructs a node in a recycled slot or in the current slab.
+     * @param args      node constructor arguments
+     * @return          the node
+     */
+    template<typename... Args>
+    node* make(Args&&... args) {
+        slot* s;
+        if (free_list != nullptr) {
+            s = free_list;
+            free_list = free_list->next;
+        } else {
+            if (bump == bump_end) __grow();
+            s = bump++;
+        }
+        node* n = reinterpret_cast<node*>(s->raw);
+        node_traits::construct(alloc, n, std::forward<Args>(args)...);
+        return n;
+    }
+
+    /**
+     * Destroys a node and puts its slot in the free list.
+     * @param n     the node
+     */
+    void drop(node* n) noexcept {
+        node_traits::destroy(alloc, n);
+        slot* s = reinterpret_cast<slot*>(n);
+        s->next = free_list;
+        free_list = s;
+    }
+
+    /**
+     * Returns all the slabs (co-owned ones once all their owners released
+     * them). Nodes are NOT destructed.
+     */
+    void release() noexcept {
+        __free_slabs(std::exchange(slabs, nullptr));
+        __unshare(std::exchange(shared, nullptr));
+        free_list = bump = bump_end = nullptr;
+        capacity = __POOL_SLAB_FIRST;
+    }
+};
+
+
+/**
+ * Node storage allocating every node on its own through Alloc
+ * (plain new / delete for std::allocator).
+ */
+template <typename node, typename Alloc>
+class _node_heap {
+
+    using node_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<node>;
+    using node_traits = std::allocator_traits<node_alloc>;
+
+    node_alloc alloc;
+
+public:
+
+    using allocator_type = Alloc;
+
+    // Whether release() frees all the nodes without drop()
+    static constexpr bool releases_all = false;
+
+    explicit _node_heap(const Alloc& a = Alloc{}) noexcept: alloc{a} {}
+    _node_heap(_node_heap&& src) noexcept: alloc{std::move(src.alloc)} {}
+
+    _node_heap& operator=(_node_heap&& src) noexcept {
+        if constexpr (node_traits::propagate_on_container_move_assignment::value) {
+            alloc = std::move(src.alloc);
+        }
+        return *this;
+    }
+
+    Alloc get_allocator() const noexcept { return Alloc{alloc}; }
+
+    void reset(const Alloc& a) noexcept { alloc = node_alloc{a}; }
+
+    void reserve(std::size_t) noexcept { /* nodes are allocated one by one */ }
+
+    void adopt(_node_heap&) noexcept { /* nodes are dropped one by one */ }
+
+    void share(_node_heap&) noexcept { /* nodes are dropped one by one */ }
+
+    void swap(_node_heap& other) noexcept {
+        if constexpr (node_traits::propagate_on_container_swap::value) {
+            std::swap(alloc, other.alloc);
+        }
+    }
+
+    template<typename... Args>
+    node* make(Args&&... args) {
+        node* n = node_traits::allocate(alloc, 1);
+        node_traits::construct(alloc, n, std::forward<Args>(args)...);
+        return n;
+    }
+
+    void drop(node* n) noexcept {
+        node_traits::destroy(alloc, n);
+        node_traits::deallocate(alloc, n, 1);
+    }
+
+    void release() noexcept { /* nodes are dropped one by one */ }
+};
+
+
+/**
+ * Inline nodes of a small map: up to N nodes kept sorted within the map
+ * object itself. They are linked as a right spine (each node is the right
+ * child of the previous one), hence iterators walk them as any other tree.
+ * Values move as the nodes shift, references to them do not follow.
+ */
+template <typename node, std::size_t N>
+class _inline_nodes {
+
+    alignas(node) unsigned char raw[N * sizeof(node)];
+    bool _active{true};
+
+public:
+
+    bool active() const noexcept { return _active; }
+    void activate(bool a) noexcept { _active = a; }
+    static constexpr std::size_t capacity() noexcept { return N; }
+
+    node* data() noexcept { return reinterpret_cast<node*>(raw); }
+    const node* data() const noexcept { return reinterpret_cast<const node*>(raw); }
+
+    /**
+     * Links the first n nodes as a right spine.
+     * @param n     the number of nodes
+     * @return      the first node (the root) or nullptr
+     */
+    node* link(std::size_t n) noexcept {
+        node* d = data();
+        for (std::size_t i = 0; i < n; i++) {
+            d[i].parent = i > 0 ? d + i - 1 : nullptr;
+            d[i].left = nullptr;
+            d[i].right = i + 1 < n ? d + i + 1 : nullptr;
+            d[i].depth = (unsigned char) (n - 1 - i);
+        }
+        return n > 0 ? d : nullptr;
     }
 };
 
+/**
+ * No inline nodes, maps are always trees.
+ */
+template <typename node>
+class _inline_nodes<node, 0> {
+
+public:
+
+    constexpr bool active() const noexcept { return false; }
+    void activate(bool) noexcept {}
+    static constexpr std::size_t capacity() noexcept { return 0; }
+
+    node* data() noexcept { return nullptr; }
+    const node* data() const noexcept { return nullptr; }
+    node* link(std::size_t) noexcept { return nullptr; }
+};
+
 
 template<typename elem_type, typename VT>
 class _iterator {
@@ -802,6 +4063,15 @@ class _iterator {
         return n;
     }
 
+    // Intrusive hooks are a base of the value itself, nodes hold it
+    static VT& __value(elem_type* n) noexcept {
+        if constexpr (std::is_base_of<elem_type, typename std::remove_const<VT>::type>::value) {
+            return static_cast<VT&>(*n);
+        } else {
+            return static_cast<VT&>(n->data);
+        }
+    }
+
 public:
 
     // https://en.cppreference.com/w/cpp/named_req/Iterator
@@ -825,18 +4095,18 @@ public:
         std::cout << "*: " << current << std::endl;
 #endif
 //        assert(current != nullptr, "Can not dereference end iterator");
-        return static_cast<reference>(current->data);
+        return __value(current);
     }
     const VT& operator*() const {
 #ifdef __DEBUG_ITERATOR
         std::cout << "const *: " << current << std::endl;
 #endif
 //        assert(current != nullptr, "Can not dereference end iterator");
-        return const_cast<const VT&>(current->data);
+        return const_cast<const VT&>(__value(current));
     }
 
     pointer operator->() {
-        return &current->data;
+        return &__value(current);
     }
 
     _iterator& operator++() noexcept {
@@ -934,8 +4204,9 @@ public:
 };
 
 
-template <typename K, typename V, typename Compare, typename Size>
-void bst<K, V, Compare, Size>::__print_tree(std::ostream& os, std::string&& pref, std::string&& pref_rest, node* from) {
+template <typename K, typename V, typename Compare, typename Size, typename Allocator,
+          template<typename, typename> class Storage, std::size_t Inline, typename Balance>
+void bst<K, V, Compare, Size, Allocator, Storage, Inline, Balance>::__print_tree(std::ostream& os, std::string&& pref, std::string&& pref_rest, node* from) {
     if (from == nullptr) {
         os << pref << "(empty)\n";
     } else {
@@ -943,7 +4214,9 @@ void bst<K, V, Compare, Size>::__print_tree(std::ostream& os, std::string&& pref
            << from
            << " [depth=" << from->depth
            << ", parent=" << from->parent << ", left=" << from->left << ", right=" << from->right << "]"
-           << " (" << from->data.first << ":" << from->data.second << ")\n";
+           << " (";
+        traits::print(os, from->data);
+        os << ")\n";
 
         std::stringstream ff_s;
         ff_s << pref_rest   << "|->L ";
@@ -959,24 +4232,52 @@ void bst<K, V, Compare, Size>::__print_tree(std::ostream& os, std::string&& pref
     }
 }
 
-template <typename K, typename V, typename Compare, typename Size>
-void bst<K, V, Compare, Size>::print_tree(std::ostream& os) {
+template <typename K, typename V, typename Compare, typename Size, typename Allocator,
+          template<typename, typename> class Storage, std::size_t Inline, typename Balance>
+void bst<K, V, Compare, Size, Allocator, Storage, Inline, Balance>::print_tree(std::ostream& os) {
     os << "Size: " << _size << "\n";
     __print_tree(os, "", "", root);
     os << std::endl;
 }
 
-template <typename K, typename V, typename Compare, typename Size>
-void bst<K, V, Compare, Size>::print_tree() {
+template <typename K, typename V, typename Compare, typename Size, typename Allocator,
+          template<typename, typename> class Storage, std::size_t Inline, typename Balance>
+void bst<K, V, Compare, Size, Allocator, Storage, Inline, Balance>::print_tree() {
     print_tree(std::cout);
 }
 
-template <typename K, typename V, typename Compare, typename Size>
-void bst<K, V, Compare, Size>::tree_info(std::ostream& os) {
+template <typename K, typename V, typename Compare, typename Size, typename Allocator,
+          template<typename, typename> class Storage, std::size_t Inline, typename Balance>
+void bst<K, V, Compare, Size, Allocator, Storage, Inline, Balance>::tree_info(std::ostream& os) {
     os << "bst{size=" << _size << ", root=" << root << "}\n";
 }
 
-template <typename K, typename V, typename Compare, typename Size>
-void bst<K, V, Compare, Size>::tree_info() {
+template <typename K, typename V, typename Compare, typename Size, typename Allocator,
+          template<typename, typename> class Storage, std::size_t Inline, typename Balance>
+void bst<K, V, Compare, Size, Allocator, Storage, Inline, Balance>::tree_info() {
     tree_info(std::cout);
 }
+
+
+// Ordered set: nodes only hold the key (iterators yield const K&)
+template <typename K, typename Compare = std::less<K>, typename size_type = std::size_t,
+          typename Allocator = std::allocator<K>,
+          template<typename, typename> class Storage = _node_pool,
+          std::size_t Inline = 0, typename Balance = balance_default>
+using bst_set = bst<K, void, Compare, size_type, Allocator, Storage, Inline, Balance>;
+
+// Small map: up to N pairs kept inline before materializing the tree.
+// While small, insertions and erasures shift the pairs, and the tree takes
+// them out: iterators, references and pointers to values are invalidated
+template <typename K, typename V, std::size_t N = 8, typename Compare = std::less<K>>
+using small_bst = bst<K, V, Compare, std::size_t, std::allocator<std::pair<const K, V>>, _node_pool, N>;
+
+
+namespace pmr {
+    // bst using a polymorphic allocator (as std::pmr::map)
+    template <typename K, typename V, typename Compare = std::less<K>, typename size_type = std::size_t>
+    using bst = ::bst<K, V, Compare, size_type, std::pmr::polymorphic_allocator<std::pair<const K, V>>>;
+
+    template <typename K, typename Compare = std::less<K>, typename size_type = std::size_t>
+    using bst_set = ::bst<K, void, Compare, size_type, std::pmr::polymorphic_allocator<K>>;
+}
@@ -0,0 +1,937 @@
+#pragma once
+
+#include <iostream>
+#include <utility>
+#include <new>
+#include <limits>
+#include <cstdint>
+#include <stdexcept>
+
+#include "bst.cpp"
+
+
+template <typename K, typename V, typename I>
+struct _compact_node;
+
+template <typename K, typename I>
+struct _compact_hot_node;
+
+template<typename storage_type, typename VT, typename I>
+class _compact_iterator;
+
+template <typename T, std::size_t Capacity>
+class _compact_array;
+
+template <typename K, typename V, typename I, std::size_t Capacity>
+class _compact_inline;
+
+template <typename K, typename V, typename I, std::size_t Capacity>
+class _compact_split;
+
+
+/**
+ * A bst variant where all the nodes live in one contiguous array and link
+ * to each other by indices of type size_type (32 bits by default) instead
+ * of pointers. The array is kept dense: erasing a node moves the last node
+ * in its slot. With Capacity > 0 the array is embedded in the object and
+ * no heap allocation is ever performed.
+ *
+ * With Split the nodes only hold the links and a copy of the key (hot),
+ * while the pairs live in a parallel array (cold): descents never touch
+ * the mapped values. The hot/cold layout lives here rather than in bst:
+ * a node and its pair share the index, while bst nodes (allocated one by
+ * one, their pairs never move) would need a pointer and an allocation more
+ * per node. Keys are stored twice, with their own buffers for strings:
+ * Split pays off with small keys and large values.
+ *
+ * Nodes are balanced by the heuristic of balance_heuristic only, there is
+ * no Balance policy: the policies work on the pointer links of _tree_core.
+ * Neither are split, join, insert_batch and the set operations provided.
+ *
+ * Any insertion or erase invalidates the iterators.
+ */
+template <typename K, typename V, typename Compare = std::less<K>, typename size_type = std::uint32_t,
+          std::size_t Capacity = 0, bool Split = false>
+class compact_bst {
+
+// DEFINITIONS
+
+    Compare compare;
+
+    using storage_type = typename std::conditional<Split,
+            _compact_split<K, V, size_type, Capacity>,
+            _compact_inline<K, V, size_type, Capacity>>::type;
+    using node = typename storage_type::node;
+    using pair_type = std::pair<const K, V>;
+    using link = size_type;
+
+    static constexpr link nil = std::numeric_limits<link>::max();
+
+    link root{nil};
+    storage_type storage;
+
+// INTERNAL
+
+    // INNER
+    enum find_method{EXACT, LEFT, RIGHT};
+
+    node* __at(link i) noexcept { return storage.links() + i; }
+    const node* __at(link i) const noexcept { return storage.links() + i; }
+
+    unsigned int __depth_left(link n) const noexcept {
+        link l = __at(n)->left;
+        return l == nil ? 0 : __at(l)->depth + 1;
+    }
+
+    unsigned int __depth_right(link n) const noexcept {
+        link r = __at(n)->right;
+        return r == nil ? 0 : __at(r)->depth + 1;
+    }
+
+    void __refresh_depth(link n) noexcept {
+        __at(n)->depth = MIN(MAX(__depth_left(n), __depth_right(n)), __DEPTH_MAX);
+    }
+
+    // Make the node become the left child of the parent
+    void __child_left(link p, link c) noexcept {
+        if (p != nil) __at(p)->left = c;
+        if (c != nil) __at(c)->parent = p;
+    }
+
+    // Make the node become the right child of the parent
+    void __child_right(link p, link c) noexcept {
+        if (p != nil) __at(p)->right = c;
+        if (c != nil) __at(c)->parent = p;
+    }
+
+    // Replace old_child with new_child to the parent
+    void __child_as(link p, link old_child, link new_child) noexcept {
+        if (p != nil) {
+            if (__at(p)->left == old_child)
+                __at(p)->left = new_child;
+            else if (__at(p)->right == old_child)
+                __at(p)->right = new_child;
+        } else {
+            root = new_child;
+        }
+        if (new_child != nil) __at(new_child)->parent = p;
+    }
+
+    /**
+     * Provided a local root, find a node by key within the downstream tree.
+     * (see bst::__find_key)
+     * @param current   local root to start from
+     * @param k         key to search for
+     * @param method    EXACT, LEFT, RIGHT
+     * @return          the found node or nil
+     */
+    link __find_key(link current, const K& k, const find_method method) const noexcept {
+        link lastl{nil}, lastr{nil}, found{nil};
+
+        while (current != nil && found == nil) {
+            const node* n = __at(current);
+            TRIPLE_COMPARE(compare, k, storage.key(current),
+                           lastr = current; current = n->left,
+                           lastl = current; current = n->right,
+                           found = current
+            );
+        }
+
+        switch (method) {
+            case EXACT: return found;
+            case LEFT: return found != nil ? found : lastl;
+            case RIGHT: return found != nil ? found : lastr;
+            default: return nil;
+        }
+    }
+
+    link __left_most(link n) const noexcept {
+        while (n != nil && __at(n)->left != nil) { n = __at(n)->left; }
+        return n;
+    }
+
+    link __right_most(link n) const noexcept {
+        while (n != nil && __at(n)->right != nil) { n = __at(n)->right; }
+        return n;
+    }
+
+    /**
+     * Given a local-root performs a left rotation of the tree below.
+     * @param n     local root to rotate
+     * @return      return the new local root for this sub tree
+     */
+    link __rotate_left(link n) noexcept {
+        link p = __at(n)->parent;
+        link nnew = __at(n)->right;
+        if (nnew != nil) {
+            __child_right(n, __at(nnew)->left);
+            __child_left(nnew, n);
+            __child_as(p, n, nnew);
+            __refresh_depth(n);
+            __refresh_depth(nnew);
+        }
+        return nnew != nil ? nnew : n;
+    }
+
+    /**
+     * Given a local-root performs a right rotation of the tree below.
+     * @param n     local root to rotate
+     * @return      return the new local root for this sub tree
+     */
+    link __rotate_right(link n) noexcept {
+        link p = __at(n)->parent;
+        link nnew = __at(n)->left;
+        if (nnew != nil) {
+            __child_left(n, __at(nnew)->right);
+            __child_right(nnew, n);
+            __child_as(p, n, nnew);
+            __refresh_depth(n);
+            __refresh_depth(nnew);
+        }
+        return nnew != nil ? nnew : n;
+    }
+
+    /**
+     * Given a local-root performs rotation if required.
+     * (same heuristic as bst::__if_required_rotate)
+     * @param n     local root to rotate
+     * @return      return the new local root for this sub tree
+     */
+    link __if_required_rotate(link n) noexcept {
+        unsigned int dl = __depth_left(n);
+        unsigned int dr = __depth_right(n);
+        link p = __at(n)->parent;
+
+        if ((dl > (dr + 1)) || (dl > dr && p != nil && __at(p)->right == n)) {
+            return __rotate_right(n);
+        } else if (dr > (dl + 1) || (dl < dr && p != nil && __at(p)->left == n)) {
+            return __rotate_left(n);
+        } else {
+            __at(n)->depth = MIN(MAX(dl, dr), __DEPTH_MAX);
+            return n;
+        }
+    }
+
+    /**
+     * Given a node it balances it and its parents up to the first one
+     * neither rotated nor changed in depth (see bst::__balance_node).
+     * @param n     the node to start from
+     */
+    void __balance_node(link n) noexcept {
+        while (n != nil) {
+            unsigned char before = __at(n)->depth;
+            link top = __if_required_rotate(n);
+            if (top == n && __at(n)->depth == before) return;
+            n = __at(top)->parent;
+        }
+    }
+
+    /**
+     * Balances the entire tree (see bst::__balance_tree).
+     */
+    void __balance_tree() noexcept {
+        link current = root;
+        char dir_flag = 0; // 0 = NONE, 1 = UP_FROM_LEFT, 2 = UP_FROM_RIGHT
+
+        while (current != nil) {
+            node* n = __at(current);
+            if (dir_flag == 0 && n->left != nil) {
+                dir_flag = 0;
+                current = n->left;
+            } else if (dir_flag != 2 && n->right != nil) {
+                dir_flag = 0;
+                current = n->right;
+            } else {
+                current = __if_required_rotate(current);
+                link p = __at(current)->parent;
+                dir_flag = p != nil && current == __at(p)->left ? 1 : 2;
+                current = p;
+            }
+        }
+    }
+
+    /**
+     * Inserts a pair in the tree, returning the node.
+     * @param x     pair to be inserted
+     * @return      the inserted node or nil if key already present
+     */
+    link __insert(pair_type&& x) {
+        link parent = nil;
+        link current = root;
+        bool is_left = false;
+
+        while (current != nil) {
+            parent = current;
+            const node* p = __at(parent);
+            TRIPLE_COMPARE(compare, x.first, storage.key(parent),
+                           current = p->left; is_left = true,
+                           current = p->right; is_left = false,
+                           return nil
+            )
+        }
+
+        // If here we have an allocable branch, nil is not an index
+        if (storage.size() == nil) throw std::length_error{"compact_bst: size_type exceeded"};
+        link n = storage.push(parent, std::move(x));
+        if (parent == nil) {
+            root = n;
+        } else if (is_left) {
+            __at(parent)->left = n;
+        } else {
+            __at(parent)->right = n;
+        }
+
+#ifdef __EXPERIMENTAL_AUTO_BALANCE
+        __balance_node(parent);
+#endif
+
+        return n;
+    }
+
+    /**
+     * Extracts a node from the tree by key (see bst::__extract). The node
+     * is detached from the tree but still occupies its slot.
+     * @param k     the key to search for
+     * @return      the node or nil if key was not found
+     */
+    link __extract(const K& k) noexcept {
+        link n = __find_key(root, k, EXACT);
+        if (n == nil) return n;
+
+        node* nn = __at(n);
+        link p = nn->parent;
+
+        if (nn->left != nil && nn->right != nil) {
+            link nnew;
+
+            if (__at(nn->right)->depth > __at(nn->left)->depth) {
+                nnew = __left_most(nn->right);
+                __child_as(__at(nnew)->parent, nnew, __at(nnew)->right);
+            } else {
+                nnew = __right_most(nn->left);
+                __child_as(__at(nnew)->parent, nnew, __at(nnew)->left);
+            }
+
+            link nnew_parent = __at(nnew)->parent;
+
+            __child_left(nnew, nn->left);
+            __child_right(nnew, nn->right);
+            __child_as(p, n, nnew);
+            nn->left = nn->right = nil;
+
+#ifdef __EXPERIMENTAL_AUTO_BALANCE
+            // The implanted node may have been its own parent
+            __balance_node(nnew_parent == n ? nnew : nnew_parent);
+#endif
+        } else {
+            link nnew = nn->left != nil ? nn->left : nn->right;
+            __child_as(p, n, nnew);
+            nn->left = nn->right = nil;
+
+#ifdef __EXPERIMENTAL_AUTO_BALANCE
+            __balance_node(p);
+#endif
+        }
+
+        return n;
+    }
+
+    /**
+     * Frees the slot of a detached node, moving the last node of the
+     * array in its place and re-linking it.
+     * @param n     the detached node
+     */
+    void __remove(link n) noexcept {
+        link last = static_cast<link>(storage.size() - 1);
+        storage.move_last_to(n);
+        if (n == last) return;
+        // Links pointing to `last` shall now point to `n`
+        node* moved = __at(n);
+        __child_as(moved->parent, last, n);
+        if (moved->left != nil) __at(moved->left)->parent = n;
+        if (moved->right != nil) __at(moved->right)->parent = n;
+    }
+
+// API
+
+public:
+
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = pair_type;
+    using key_compare = Compare;
+
+    using iterator = _compact_iterator<storage_type, pair_type, link>;
+    using const_iterator = _compact_iterator<storage_type, const pair_type, link>;
+    using node_type = node;
+
+    // RAII & Copy and move (links are indices, nodes are copied as they are)
+
+    compact_bst() noexcept {}
+
+    /**
+     * Create a map from an iterable iterable source of
+     * pair<K,V> values.
+     * @tparam Iter
+     * @param begin     The iterator
+     * @param end       The end() iterator
+     */
+    template<typename Iter>
+    compact_bst(Iter begin, Iter end) {
+        while(begin != end) {
+            insert(*begin);
+            ++begin;
+        }
+    }
+
+    compact_bst(const compact_bst& src) = default;
+    compact_bst& operator=(const compact_bst& src) = default;
+
+    compact_bst(compact_bst&& src) noexcept:
+        root{std::exchange(src.root, nil)},
+        storage{std::move(src.storage)}
+    { }
+
+    compact_bst& operator=(compact_bst&& src) noexcept {
+        if (this == &src) return *this;
+        root = std::exchange(src.root, nil);
+        storage = std::move(src.storage);
+        return *this;
+    }
+
+// MODIFIERS
+
+    /**
+     * Inserts a pair in the map. If insertion is successful returns an
+     * iterator to the pair and true, else the end() iterator and false.
+     * Throws std::length_error when the fixed capacity is exceeded, or
+     * when the indices would reach nil (the max of size_type).
+     * @param x     The pair to be inserted
+     * @return      a pair<iterator, bool>
+     */
+    std::pair<iterator, bool> insert(const pair_type& x) {
+        link ref = __insert(pair_type{x});
+        return std::pair<iterator, bool>{ iterator{&storage, root, ref}, ref != nil };
+    }
+    std::pair<iterator, bool> insert(pair_type&& x) {
+        link ref = __insert(std::move(x));
+        return std::pair<iterator, bool>{ iterator{&storage, root, ref}, ref != nil };
+    }
+
+    /**
+     * Removes a key from the map.
+     * @param k     The key to remove
+     * @return      The number of values removed
+     */
+    size_type erase(const K& k) noexcept {
+        link n = __extract(k);
+        if (n == nil) return 0;
+        __remove(n);
+        return 1;
+    }
+
+    /**
+     * Pops a value from the map returning the value.
+     * @param k     The key to remove
+     * @return      The value that was associated to the key
+     *              or default value for value_type
+     */
+    value_type pop(const K& k) noexcept {
+        link n = __extract(k);
+        if (n == nil) return value_type{};
+        value_type old = storage.value(n);
+        __remove(n);
+        return old;
+    }
+
+    /**
+     * Removes all the values from the map (capacity is kept)
+     */
+    void clear() noexcept {
+        storage.clear();
+        root = nil;
+    }
+
+    /**
+     * Balances the tree
+     */
+    void balance() noexcept {
+        __balance_tree();
+    }
+
+    /**
+     * Reserves room for at least n nodes (no-op for fixed capacity)
+     * Throws std::length_error past the indices of size_type.
+     * @param n     The number of nodes
+     */
+    void reserve(std::size_t n) {
+        if (n > nil) throw std::length_error{"compact_bst: size_type exceeded"};
+        storage.reserve(n);
+    }
+
+// GETTERS
+
+    bool has(const K& k) const noexcept {
+        return __find_key(root, k, EXACT) != nil;
+    }
+
+    iterator find(const K& k) noexcept {
+        return iterator{&storage, root, __find_key(root, k, EXACT)};
+    }
+    const_iterator find(const K& k) const noexcept {
+        return const_iterator{const_cast<storage_type*>(&storage), root, __find_key(root, k, EXACT)};
+    }
+
+    size_type size() const noexcept { return static_cast<size_type>(storage.size()); }
+
+    bool empty() const noexcept { return storage.size() == 0; }
+
+    std::size_t capacity() const noexcept { return storage.capacity(); }
+
+    unsigned char depth() const noexcept {
+        return root != nil ? __at(root)->depth + 1 : 0;
+    }
+
+    V& operator[](const K& k) {
+        link found = __find_key(root, k, EXACT);
+        if (found == nil) {
+            found = __insert(pair_type{k, V{}});
+        }
+        return storage.value(found).second;
+    }
+    V& operator[](K&& k) {
+        link found = __find_key(root, k, EXACT);
+        if (found == nil) {
+            found = __insert(pair_type{std::move(k), V{}});
+        }
+        return storage.value(found).second;
+    }
+
+    /**
+     * Returns an iterator to a slice of the map. The slice will start
+     * at the first key greater or equal to lower and will end with the
+     * last key lower or equal to upper.
+     *
+     * @param lower     The lower inclusive bound
+     * @param upper     The upper inclusive bound
+     * @return          The iterator
+     */
+    iterator operator()(const K& lower, const K& upper) noexcept {
+        if (_less(compare, upper, lower)) return end();
+        link lower_node = __find_key(root, lower, RIGHT);
+        if (lower_node == nil || _less(compare, upper, storage.key(lower_node))) return end();
+        link upper_node = __find_key(root, upper, LEFT);
+        if (upper_node == nil || _less(compare, storage.key(upper_node), lower)) return end();
+        return iterator{&storage, root, lower_node, upper_node};
+    }
+
+// ITERATORS
+
+    iterator begin() noexcept {
+        return iterator{&storage, root, __left_most(root)};
+    }
+    const_iterator begin() const noexcept {
+        return const_iterator{const_cast<storage_type*>(&storage), root, __left_most(root)};
+    }
+    const_iterator cbegin() const noexcept { return begin(); }
+
+    iterator end() noexcept {
+        return iterator{&storage, root, nil};
+    }
+    const_iterator end() const noexcept {
+        return const_iterator{const_cast<storage_type*>(&storage), root, nil};
+    }
+    const_iterator cend() const noexcept { return end(); }
+
+};
+
+
+template <typename K, typename V, typename I>
+struct _compact_node {
+
+    I parent;
+    I left{std::numeric_limits<I>::max()};
+    I right{std::numeric_limits<I>::max()};
+    unsigned char depth{0};
+    std::pair<const K, V> data;
+
+    template<typename P>
+    explicit _compact_node(I parent, P&& pair): parent{parent}, data{std::forward<P>(pair)} {}
+};
+
+
+template <typename K, typename I>
+struct _compact_hot_node {
+
+    I parent;
+    I left{std::numeric_limits<I>::max()};
+    I right{std::numeric_limits<I>::max()};
+    unsigned char depth{0};
+    K key;
+
+    explicit _compact_hot_node(I parent, const K& key): parent{parent}, key{key} {}
+};
+
+
+/**
+ * Fixed capacity array embedded in the tree (no heap allocation).
+ */
+template <typename node, std::size_t Capacity>
+class _compact_array {
+
+    alignas(node) unsigned char buffer[sizeof(node) * Capacity];
+    std::size_t count{0};
+
+public:
+
+    _compact_array() noexcept {}
+
+    _compact_array(const _compact_array& src): count{0} {
+        for (; count < src.count; count++) new (data() + count) node{src.data()[count]};
+    }
+
+    _compact_array(_compact_array&& src) noexcept: count{0} {
+        for (; count < src.count; count++) new (data() + count) node{std::move(src.data()[count])};
+        src.clear();
+    }
+
+    _compact_array& operator=(const _compact_array& src) {
+        if (this == &src) return *this;
+        clear();
+        for (; count < src.count; count++) new (data() + count) node{src.data()[count]};
+        return *this;
+    }
+
+    _compact_array& operator=(_compact_array&& src) noexcept {
+        if (this == &src) return *this;
+        clear();
+        for (; count < src.count; count++) new (data() + count) node{std::move(src.data()[count])};
+        src.clear();
+        return *this;
+    }
+
+    ~_compact_array() { clear(); }
+
+    node* data() noexcept { return reinterpret_cast<node*>(buffer); }
+    const node* data() const noexcept { return reinterpret_cast<const node*>(buffer); }
+    std::size_t size() const noexcept { return count; }
+    std::size_t capacity() const noexcept { return Capacity; }
+
+    void reserve(std::size_t n) {
+        if (n > Capacity) throw std::length_error{"compact_bst: capacity exceeded"};
+    }
+
+    /**
+     * Constructs an element at the end of the array.
+     * @return      the element index
+     */
+    template<typename... Args>
+    std::size_t push(Args&&... args) {
+        if (count == Capacity) throw std::length_error{"compact_bst: capacity exceeded"};
+        new (data() + count) node{std::forward<Args>(args)...};
+        return count++;
+    }
+
+    /**
+     * Destroys the element at hole and moves the last one in its place.
+     * @param hole      the index to be freed
+     */
+    void move_last_to(std::size_t hole) noexcept {
+        node* nodes = data();
+        nodes[hole].~node();
+        if (hole != --count) {
+            new (nodes + hole) node{std::move(nodes[count])};
+            nodes[count].~node();
+        }
+    }
+
+    void clear() noexcept {
+        for (std::size_t i = 0; i < count; i++) data()[i].~node();
+        count = 0;
+    }
+};
+
+
+/**
+ * Heap allocated array, growing geometrically.
+ */
+template <typename node>
+class _compact_array<node, 0> {
+
+    node* nodes{nullptr};
+    std::size_t count{0};
+    std::size_t cap{0};
+
+public:
+
+    _compact_array() noexcept {}
+
+    _compact_array(const _compact_array& src) {
+        reserve(src.count);
+        for (; count < src.count; count++) new (nodes + count) node{src.nodes[count]};
+    }
+
+    _compact_array(_compact_array&& src) noexcept:
+        nodes{std::exchange(src.nodes, nullptr)},
+        count{std::exchange(src.count, 0)},
+        cap{std::exchange(src.cap, 0)}
+    { }
+
+    _compact_array& operator=(const _compact_array& src) {
+        if (this == &src) return *this;
+        clear();
+        reserve(src.count);
+        for (; count < src.count; count++) new (nodes + count) node{src.nodes[count]};
+        return *this;
+    }
+
+    _compact_array& operator=(_compact_array&& src) noexcept {
+        if (this == &src) return *this;
+        clear();
+        ::operator delete(nodes);
+        nodes = std::exchange(src.nodes, nullptr);
+        count = std::exchange(src.count, 0);
+        cap = std::exchange(src.cap, 0);
+        return *this;
+    }
+
+    ~_compact_array() {
+        clear();
+        ::operator delete(nodes);
+    }
+
+    node* data() noexcept { return nodes; }
+    const node* data() const noexcept { return nodes; }
+    std::size_t size() const noexcept { return count; }
+    std::size_t capacity() const noexcept { return cap; }
+
+    /**
+     * Moves the elements in a new array of at least n elements.
+     * @param n     the requested capacity
+     */
+    void reserve(std::size_t n) {
+        if (n <= cap) return;
+        node* fresh = static_cast<node*>(::operator new(sizeof(node) * n));
+        for (std::size_t i = 0; i < count; i++) {
+            new (fresh + i) node{std::move(nodes[i])};
+            nodes[i].~node();
+        }
+        ::operator delete(nodes);
+        nodes = fresh;
+        cap = n;
+    }
+
+    template<typename... Args>
+    std::size_t push(Args&&... args) {
+        if (count == cap) reserve(cap == 0 ? 16 : cap * 2);
+        new (nodes + count) node{std::forward<Args>(args)...};
+        return count++;
+    }
+
+    void move_last_to(std::size_t hole) noexcept {
+        nodes[hole].~node();
+        if (hole != --count) {
+            new (nodes + hole) node{std::move(nodes[count])};
+            nodes[count].~node();
+        }
+    }
+
+    void clear() noexcept {
+        for (std::size_t i = 0; i < count; i++) nodes[i].~node();
+        count = 0;
+    }
+};
+
+
+/**
+ * Node storage keeping the pairs within the nodes.
+ */
+template <typename K, typename V, typename I, std::size_t Capacity>
+class _compact_inline {
+
+    using pair_type = std::pair<const K, V>;
+
+public:
+
+    using node = _compact_node<K, V, I>;
+
+private:
+
+    _compact_array<node, Capacity> nodes;
+
+public:
+
+    node* links() noexcept { return nodes.data(); }
+    const node* links() const noexcept { return nodes.data(); }
+    const K& key(I i) const noexcept { return nodes.data()[i].data.first; }
+    pair_type& value(I i) noexcept { return nodes.data()[i].data; }
+
+    std::size_t size() const noexcept { return nodes.size(); }
+    std::size_t capacity() const noexcept { return nodes.capacity(); }
+    void reserve(std::size_t n) { nodes.reserve(n); }
+    void clear() noexcept { nodes.clear(); }
+
+    I push(I parent, pair_type&& x) {
+        return static_cast<I>(nodes.push(parent, std::move(x)));
+    }
+
+    void move_last_to(std::size_t hole) noexcept { nodes.move_last_to(hole); }
+};
+
+
+/**
+ * Node storage keeping links and keys (hot) apart from the pairs (cold),
+ * in two parallel arrays sharing the same indices.
+ */
+template <typename K, typename V, typename I, std::size_t Capacity>
+class _compact_split {
+
+    using pair_type = std::pair<const K, V>;
+
+public:
+
+    using node = _compact_hot_node<K, I>;
+
+private:
+
+    _compact_array<node, Capacity> hot;
+    _compact_array<pair_type, Capacity> cold;
+
+public:
+
+    node* links() noexcept { return hot.data(); }
+    const node* links() const noexcept { return hot.data(); }
+    const K& key(I i) const noexcept { return hot.data()[i].key; }
+    pair_type& value(I i) noexcept { return cold.data()[i]; }
+
+    std::size_t size() const noexcept { return hot.size(); }
+    std::size_t capacity() const noexcept { return hot.capacity(); }
+
+    void reserve(std::size_t n) {
+        hot.reserve(n);
+        cold.reserve(n);
+    }
+
+    void clear() noexcept {
+        hot.clear();
+        cold.clear();
+    }
+
+    I push(I parent, pair_type&& x) {
+        std::size_t i = cold.push(std::move(x));
+        try {
+            hot.push(parent, cold.data()[i].first);
+        } catch (...) {
+            cold.move_last_to(i);
+            throw;
+        }
+        return static_cast<I>(i);
+    }
+
+    void move_last_to(std::size_t hole) noexcept {
+        hot.move_last_to(hole);
+        cold.move_last_to(hole);
+    }
+};
+
+
+template<typename storage_type, typename VT, typename I>
+class _compact_iterator {
+
+    static constexpr I nil = std::numeric_limits<I>::max();
+
+    storage_type* storage{nullptr};
+    I root{nil};
+    I current{nil};
+
+    // For range
+    I lower{nil};
+    I upper{nil};
+
+    // Helper methods
+
+    auto __links() const noexcept { return storage->links(); }
+
+    I __left_most(I n) const noexcept {
+        while (n != nil && __links()[n].left != nil) { n = __links()[n].left; }
+        return n;
+    }
+
+    I __right_most(I n) const noexcept {
+        while (n != nil && __links()[n].right != nil) { n = __links()[n].right; }
+        return n;
+    }
+
+public:
+
+    explicit _compact_iterator() noexcept {}
+    _compact_iterator(storage_type* storage, I root, I start) noexcept:
+            storage{storage}, root{root}, current{start} { }
+    _compact_iterator(storage_type* storage, I root, I lower, I upper) noexcept:
+            storage{storage}, root{root}, current{lower}, lower{lower}, upper{upper} {}
+
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = VT;
+    using pointer = VT*;
+    using reference = VT&;
+
+    reference operator*() const { return storage->value(current); }
+
+    pointer operator->() const { return &storage->value(current); }
+
+    _compact_iterator& operator++() noexcept {
+        if (current == nil) {
+#ifdef __ITERATOR_RECOVERABLE
+            current = lower != nil ? lower : __left_most(root);
+#endif
+        } else if (current == upper) {
+            current = nil;
+        } else if (__links()[current].right != nil) {
+            current = __left_most(__links()[current].right);
+        } else {
+            // Traverse upward till we come from a left child
+            I tmp = current;
+            current = __links()[current].parent;
+            while (current != nil && __links()[current].left != tmp) {
+                tmp = current;
+                current = __links()[current].parent;
+            }
+        }
+        return *this;
+    }
+
+    _compact_iterator& operator--() noexcept {
+        if (current == nil) {
+#ifdef __ITERATOR_RECOVERABLE
+            current = upper != nil ? upper : __right_most(root);
+#endif
+        } else if (current == lower) {
+#ifdef __ITERATOR_LOWER_END
+            current = nil;
+#endif
+        } else if (__links()[current].left != nil) {
+            current = __right_most(__links()[current].left);
+        } else {
+            // Traverse upward till we come from a right child
+            I tmp = current, parent = __links()[current].parent;
+            while (parent != nil && __links()[parent].right != tmp) {
+                tmp = parent;
+                parent = __links()[parent].parent;
+            }
+#ifdef __ITERATOR_LOWER_END
+            current = parent;
+#else
+            if (parent != nil) current = parent;
+#endif
+        }
+        return *this;
+    }
+
+    friend bool operator==(const _compact_iterator& a, const _compact_iterator& b) noexcept {
+        return a.current == b.current;
+    }
+    friend bool operator!=(const _compact_iterator& a, const _compact_iterator& b) noexcept {
+        return a.current != b.current;
+    }
+};
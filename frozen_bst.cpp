@@ -0,0 +1,227 @@
+#pragma once
+
+#include <iostream>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <limits>
+#include <stdexcept>
+
+#include "bst.cpp"
+
+
+// Cache line size, descents prefetch the keys of the line this many bytes
+// of descendants below the current key
+#define __FROZEN_CACHE_LINE 64
+
+
+/**
+ * An immutable snapshot of a map, built by bst::freeze() (or from a range
+ * sorted by key without duplicates). The keys are laid out in one array in
+ * Eytzinger order: the root first, then each level left to right (the
+ * children of the key at i are at 2i and 2i + 1, counting from 1). The
+ * values are kept in key order in a parallel array, and the rank of each
+ * key maps its slot to its value (a size_type, as the map's).
+ *
+ * Each key is thus stored twice, packed in the Eytzinger array for the
+ * descents and within its value for the iterators (both arrays hold the
+ * same keys for sets): n * (2 * sizeof(K) + sizeof(size_type)), besides
+ * the mapped values.
+ *
+ * Descents are branchless: each level turns by the result of a comparison,
+ * and prefetches the cache line holding the descendants some levels below,
+ * so that the top levels stay in cache and the next misses are already on
+ * their way. Iterators are plain pointers to the values, iterated in key
+ * order.
+ */
+template <typename K, typename V, typename Compare, typename size_type>
+class frozen_bst {
+
+// DEFINITIONS
+
+    using traits = _value_traits<K, V>;
+
+public:
+
+    using key_type = K;
+    using value_type = typename traits::value_type;
+    using iterator = const value_type*;
+    using const_iterator = const value_type*;
+
+private:
+
+    Compare compare;
+
+    std::vector<K> keys;                // Eytzinger order, key i (from 1) at i - 1
+    std::vector<size_type> ranks;       // of the key in each slot, by slot as keys
+    std::vector<value_type> values;     // in key order
+
+    // Keys of the cache line of descendants prefetched
+    static constexpr std::size_t prefetch_span = MAX(__FROZEN_CACHE_LINE / sizeof(K), std::size_t{1});
+
+// INTERNAL
+
+    /**
+     * The next key of a slot in key order.
+     * @param i     the slot (from 1)
+     * @param n     the number of keys
+     * @return      the slot of the next key, 0 past the greatest one
+     */
+    static std::size_t __next(std::size_t i, std::size_t n) noexcept {
+        if (2 * i + 1 <= n) {
+            i = 2 * i + 1;
+            while (2 * i <= n) i *= 2;
+            return i;
+        }
+        // Climb up to the first parent holding it on its left
+        while (i & 1) i >>= 1;
+        return i >> 1;
+    }
+
+    /**
+     * Turns the slot a descent ended on into the one of its last left turn:
+     * the trailing right turns (ones) and the left one are dropped.
+     * @param i     the slot past the leaves
+     * @return      the slot of the last left turn, 0 if none
+     */
+    static std::size_t __last_left(std::size_t i) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+        return i >> (__builtin_ctzll(~static_cast<unsigned long long>(i)) + 1);
+#else
+        while (i & 1) i >>= 1;
+        return i >> 1;
+#endif
+    }
+
+    /**
+     * Finds the slot of the first key not lower (or greater, Upper) than
+     * a key, branchless.
+     * @param k     the key
+     * @return      the slot, 0 if none
+     */
+    template <bool Upper>
+    std::size_t __bound(const K& k) const noexcept {
+        const K* base = keys.data();
+        std::size_t n = keys.size(), i = 1;
+        while (i <= n) {
+            // Within the keys only, deeper levels have no descendants to fetch
+            if (prefetch_span * i <= n) { PREFETCH(base + prefetch_span * i - 1); }
+            bool right = Upper ? !_less(compare, k, base[i - 1]) : _less(compare, base[i - 1], k);
+            i = 2 * i + right;
+        }
+        return __last_left(i);
+    }
+
+    /**
+     * The value of a slot.
+     * @param i     the slot, 0 for past the end
+     * @return      the iterator
+     */
+    iterator __at(std::size_t i) const noexcept {
+        return values.data() + (i == 0 ? values.size() : ranks[i - 1]);
+    }
+
+public:
+
+// API
+
+    /**
+     * Builds the snapshot of a range sorted by key, without duplicated keys.
+     * Throws std::length_error when the ranks overflow size_type.
+     * @param first     The first value
+     * @param last      The past the last value
+     * @param compare   The comparator the range is sorted by
+     */
+    template <typename Iter>
+    frozen_bst(sorted_unique_t, Iter first, Iter last, const Compare& compare = Compare{}):
+            compare{compare},
+            values(first, last)
+    {
+        std::size_t n = values.size();
+        if (n > 0 && n - 1 > static_cast<std::size_t>(std::numeric_limits<size_type>::max())) {
+            throw std::length_error{"frozen_bst: size_type overflow"};
+        }
+        ranks.resize(n);
+        keys.reserve(n);
+        if (n == 0) return;
+        // In key order through the slots
+        std::size_t i = 1;
+        while (2 * i <= n) i *= 2;
+        for (std::size_t r = 0; r < n; r++, i = __next(i, n)) {
+            ranks[i - 1] = static_cast<size_type>(r);
+        }
+        for (i = 0; i < n; i++) keys.push_back(traits::key(values[ranks[i]]));
+    }
+
+    frozen_bst() = default;
+
+// GETTERS
+
+    /**
+     * Searches for a key
+     * @param k     The key to search for
+     * @return      The iterator to the value, end() if not present
+     */
+    iterator find(const K& k) const noexcept {
+        std::size_t i = __bound<false>(k);
+        return i != 0 && !_less(compare, k, keys[i - 1]) ? __at(i) : end();
+    }
+
+    /**
+     * Weather the snapshot contains a given key
+     * @param k     The key to search for
+     * @return      True if present
+     */
+    bool has(const K& k) const noexcept {
+        std::size_t i = __bound<false>(k);
+        return i != 0 && !_less(compare, k, keys[i - 1]);
+    }
+
+    /**
+     * The first value whose key is not lower than a key
+     * @param k     The key
+     * @return      The iterator, end() if none
+     */
+    iterator lower_bound(const K& k) const noexcept {
+        return __at(__bound<false>(k));
+    }
+
+    /**
+     * The first value whose key is greater than a key
+     * @param k     The key
+     * @return      The iterator, end() if none
+     */
+    iterator upper_bound(const K& k) const noexcept {
+        return __at(__bound<true>(k));
+    }
+
+    /**
+     * The number of values O(1)
+     * @return      The size
+     */
+    std::size_t size() const noexcept { return values.size(); }
+
+    /**
+     * Check weather the snapshot is empty O(1)
+     * @return      True if empty
+     */
+    bool empty() const noexcept { return values.empty(); }
+
+// ITERATORS
+
+    /**
+     * The values in key order, from the lower key
+     * @return      The iterator
+     */
+    iterator begin() const noexcept { return values.data(); }
+    iterator cbegin() const noexcept { return values.data(); }
+
+    /**
+     * Past the greatest key
+     * @return      The iterator
+     */
+    iterator end() const noexcept { return values.data() + values.size(); }
+    iterator cend() const noexcept { return values.data() + values.size(); }
+};
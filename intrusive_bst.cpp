@@ -0,0 +1,295 @@
+#pragma once
+
+#include <iostream>
+#include <utility>
+
+#include "bst.cpp"
+
+
+/**
+ * Links embedded in the objects of an intrusive_bst. The Tag tells apart
+ * the hooks of an object linked to more than one tree.
+ */
+template <typename Tag = void>
+struct bst_hook {
+
+    bst_hook* parent{nullptr};
+    bst_hook* left{nullptr};
+    bst_hook* right{nullptr};
+    unsigned char depth{0};
+    unsigned char mark{0};
+};
+
+
+/**
+ * A bst variant linking objects owned by the user instead of copies of
+ * them. T derives from bst_hook<Tag> and Key is its key member. The tree
+ * neither allocates nor destroys: objects keep their address, shall not
+ * be moved while linked and shall outlive the tree (or be unlinked first).
+ * Links and balancing are the ones of bst (see _tree_core).
+ */
+template <typename T, typename K, K T::*Key, typename Compare = std::less<K>, typename Tag = void,
+          typename Balance = balance_default>
+class intrusive_bst: private _tree_core<bst_hook<Tag>, Balance> {
+
+// DEFINITIONS
+
+    Compare compare;
+
+    using node = bst_hook<Tag>;
+    using core = _tree_core<node, Balance>;
+    using core::root;
+    using core::__left_most;
+    using core::__right_most;
+    using core::__link;
+    using core::__unlink;
+    using core::__accessed;
+    using core::__rebalance;
+    using core::__rebalance_step;
+
+    std::size_t _size{0};
+
+// INTERNAL
+
+    // INNER
+    enum find_method{EXACT, LEFT, RIGHT};
+
+    static const K& __key(const node* n) noexcept { return static_cast<const T*>(n)->*Key; }
+
+    /**
+     * Provided a local root, find a node by key within the downstream tree.
+     * (see bst::__find_key)
+     * @param current   local root to start from
+     * @param k         key to search for
+     * @param method    EXACT, LEFT, RIGHT
+     * @return          the found node or nullptr
+     */
+    node* __find_key(node* current, const K& k, const find_method method) const noexcept {
+        node *lastl{nullptr}, *lastr{nullptr}, *found{nullptr};
+
+        while (current != nullptr && found == nullptr) {
+            TRIPLE_COMPARE(compare, k, __key(current),
+                           lastr = current; current = current->left,
+                           lastl = current; current = current->right,
+                           found = current
+            );
+        }
+
+        switch (method) {
+            case EXACT: return found;
+            case LEFT: return NNL(found, lastl);
+            case RIGHT: return NNL(found, lastr);
+            default: return nullptr;
+        }
+    }
+
+// API
+
+public:
+
+    using key_type = K;
+    using value_type = T;
+    using key_compare = Compare;
+    using size_type = std::size_t;
+
+    using iterator = _iterator<node, T>;
+    using const_iterator = _iterator<node, const T>;
+    using hook_type = node;
+
+    // RAII & Copy and move (objects can be linked to one tree only)
+
+    intrusive_bst() noexcept {}
+
+    /**
+     * Create a tree linking an iterable source of objects.
+     * @tparam Iter
+     * @param begin     The iterator
+     * @param end       The end() iterator
+     */
+    template<typename Iter>
+    intrusive_bst(Iter begin, Iter end) noexcept {
+        while(begin != end) {
+            insert(*begin);
+            ++begin;
+        }
+    }
+
+    intrusive_bst(const intrusive_bst&) = delete;
+    intrusive_bst& operator=(const intrusive_bst&) = delete;
+
+    intrusive_bst(intrusive_bst&& src) noexcept: compare{src.compare} {
+        root = std::exchange(src.root, nullptr);
+        _size = std::exchange(src._size, 0);
+    }
+
+    intrusive_bst& operator=(intrusive_bst&& src) noexcept {
+        if (this == &src) return *this;
+        compare = src.compare;
+        root = std::exchange(src.root, nullptr);
+        _size = std::exchange(src._size, 0);
+        return *this;
+    }
+
+// MODIFIERS
+
+    /**
+     * Links an object in the tree, unless its key is already present.
+     * No allocation nor copy is performed.
+     * @param x     The object to be linked (not linked to this tree)
+     * @return      a pair<iterator, bool>
+     */
+    std::pair<iterator, bool> insert(T& x) noexcept {
+        node* parent = nullptr;
+        node** handle = &root;
+        const K& k = x.*Key;
+
+        while (*handle != nullptr) {
+            parent = *handle;
+            TRIPLE_COMPARE(compare, k, __key(parent),
+                           handle = &(parent->left),
+                           handle = &(parent->right),
+                           return NOINSERT
+            )
+        }
+
+        node* n = &x;
+        n->parent = parent;
+        n->left = n->right = nullptr;
+        n->depth = 0;
+        n->mark = 0;
+        __link(handle, n);
+        _size++;
+        return std::pair<iterator, bool>{ iterator{root, n}, true };
+    }
+
+    /**
+     * Unlinks an object known to be linked to this tree, without searching it.
+     * @param x     The object to be unlinked
+     */
+    void unlink(T& x) noexcept {
+        node* n = &x;
+        __unlink(n);
+        n->parent = nullptr;
+        _size--;
+    }
+
+    /**
+     * Unlinks the object with the given key.
+     * @param k     The key to remove
+     * @return      The number of objects unlinked
+     */
+    size_type erase(const K& k) noexcept {
+        return pop(k) != nullptr ? 1 : 0;
+    }
+
+    /**
+     * Unlinks the object with the given key, returning it.
+     * @param k     The key to remove
+     * @return      The unlinked object or nullptr
+     */
+    T* pop(const K& k) noexcept {
+        node* n = __find_key(root, k, EXACT);
+        if (n == nullptr) return nullptr;
+        T* x = static_cast<T*>(n);
+        unlink(*x);
+        return x;
+    }
+
+    /**
+     * Forgets all the objects O(1), their hooks are left as they are.
+     */
+    void clear() noexcept {
+        root = nullptr;
+        _size = 0;
+    }
+
+    /**
+     * Performs a bounded share of the deferred rebalancing (see bst::rebalance_step).
+     * @param budget    the number of nodes to fix at most
+     * @return          true if some rebalancing is still pending
+     */
+    bool rebalance_step(std::size_t budget = 1) noexcept {
+        return __rebalance_step(budget);
+    }
+
+    /**
+     * Rebuilds the tree in place with the minimum depth, in linear time and
+     * without allocating (treaps keep the shape of their priorities)
+     */
+    void balance() noexcept {
+        __rebalance();
+    }
+
+// GETTERS
+
+    bool has(const K& k) const noexcept {
+        return __find_key(root, k, EXACT) != nullptr;
+    }
+
+    iterator find(const K& k) noexcept {
+        node* found = __find_key(root, k, EXACT);
+        if (found != nullptr) __accessed(found);
+        return found == nullptr ? end() : iterator{root, found};
+    }
+    const_iterator find(const K& k) const noexcept {
+        node* found = __find_key(root, k, EXACT);
+        return found == nullptr ? cend() : const_iterator{root, found};
+    }
+
+    size_type size() const noexcept { return _size; }
+
+    bool empty() const noexcept { return _size == 0; }
+
+    unsigned char depth() const noexcept {
+        return root ? root->depth + 1: 0;
+    }
+
+    /**
+     * Returns an iterator to the objects with keys within [lower, upper].
+     * (see bst::operator())
+     * @param lower     The lower inclusive bound
+     * @param upper     The upper inclusive bound
+     * @return          The iterator
+     */
+    iterator operator()(const K& lower, const K& upper) noexcept {
+        if (_less(compare, upper, lower)) return end();
+        node* lower_node = __find_key(root, lower, RIGHT);
+        if (lower_node == nullptr || _less(compare, upper, __key(lower_node))) return end();
+        node* upper_node = __find_key(root, upper, LEFT);
+        if (upper_node == nullptr || _less(compare, __key(upper_node), lower)) return end();
+        return iterator{root, lower_node, upper_node};
+    }
+
+// ITERATORS
+
+    iterator begin() noexcept {
+        return iterator{root, __left_most(root)};
+    }
+    const_iterator begin() const noexcept {
+        return const_iterator{root, __left_most(root)};
+    }
+    const_iterator cbegin() const noexcept {
+        return const_iterator{root, __left_most(root)};
+    }
+
+    iterator end() noexcept {
+        return iterator{root};
+    }
+    const_iterator end() const noexcept {
+        return const_iterator{root};
+    }
+    const_iterator cend() const noexcept {
+        return const_iterator{root};
+    }
+
+// DEBUG
+
+    /**
+     * Checks the links, the depths and the invariants of the balancing
+     * policy (DEBUG) O(n log n)
+     * @return      True if they hold
+     */
+    bool check_tree() const noexcept {
+        return core::__valid();
+    }
+};
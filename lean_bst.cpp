@@ -0,0 +1,621 @@
+#pragma once
+
+#include <iostream>
+#include <utility>
+#include <memory>
+
+#include "bst.cpp"
+
+// Maximum depth of a lean_bst. An AVL tree of depth 48 holds at least
+// Fib(51) ~ 2e10 nodes, more than any memory can contain.
+#define __STACK_DEPTH 48
+
+
+template <typename K, typename V>
+struct _lean_node;
+
+template<typename elem_type, typename VT>
+class _stack_iterator;
+
+
+/**
+ * A bst variant whose nodes have no parent pointer. Every modification
+ * records its descent path on a fixed size stack and rebalances (AVL) along
+ * it, stopping as soon as a sub tree depth is unchanged. Iterators keep the
+ * stack of the ancestors of the current node.
+ *
+ * Any insertion or erase invalidates the iterators.
+ */
+template <typename K, typename V, typename Compare = std::less<K>, typename size_type = std::size_t,
+          typename Allocator = std::allocator<std::pair<const K, V>>>
+class lean_bst {
+
+// DEFINITIONS
+
+    Compare compare;
+
+    using node = _lean_node<K, V>;
+    using pair_type = std::pair<const K, V>;
+    using storage_type = _node_pool<node, Allocator>;
+    using alloc_traits = std::allocator_traits<Allocator>;
+
+    node* root{nullptr};
+    size_type _size{0};
+    storage_type storage;
+
+// INTERNAL
+
+    enum find_method{EXACT, LEFT, RIGHT};
+
+    /**
+     * Descends from the root to a key, recording the path to the found
+     * node (EXACT) or the closest LEFT / RIGHT node (see bst::__find_key).
+     * @param k         key to search for
+     * @param method    EXACT, LEFT, RIGHT
+     * @param path      the path from the root
+     * @return          the path length, 0 if no node was found
+     */
+    unsigned int __seek(const K& k, find_method method, node** path) const noexcept {
+        unsigned int top = 0, lastl = 0, lastr = 0;
+        node* n = root;
+        while (n != nullptr) {
+            path[top++] = n;
+            TRIPLE_COMPARE(compare, k, n->data.first,
+                           lastr = top; n = n->left,
+                           lastl = top; n = n->right,
+                           return top
+            )
+        }
+        switch (method) {
+            case LEFT: return lastl;
+            case RIGHT: return lastr;
+            default: return 0;
+        }
+    }
+
+    /**
+     * Replaces old_child with new_child in the parent (or in the root).
+     */
+    void __relink(node* p, node* old_child, node* new_child) noexcept {
+        if (p == nullptr) {
+            root = new_child;
+        } else if (p->left == old_child) {
+            p->left = new_child;
+        } else {
+            p->right = new_child;
+        }
+    }
+
+    static node* __rotate_left(node* n) noexcept {
+        node* nnew = n->right;
+        n->right = nnew->left;
+        nnew->left = n;
+        REFRESH_DEPTH(n);
+        REFRESH_DEPTH(nnew);
+        return nnew;
+    }
+
+    static node* __rotate_right(node* n) noexcept {
+        node* nnew = n->left;
+        n->left = nnew->right;
+        nnew->right = n;
+        REFRESH_DEPTH(n);
+        REFRESH_DEPTH(nnew);
+        return nnew;
+    }
+
+    /**
+     * Given a local-root performs an AVL rotation if required.
+     * @param n     local root to rotate
+     * @return      return the new local root for this sub tree
+     */
+    static node* __if_required_rotate(node* n) noexcept {
+        unsigned int dl = DEPTH_LEFT(n);
+        unsigned int dr = DEPTH_RIGHT(n);
+
+        if (dl > dr + 1) {
+            unsigned int cl = DEPTH_LEFT(n->left);
+            unsigned int cr = DEPTH_RIGHT(n->left);
+            if (cr > cl) n->left = __rotate_left(n->left);
+            return __rotate_right(n);
+        } else if (dr > dl + 1) {
+            unsigned int cl = DEPTH_LEFT(n->right);
+            unsigned int cr = DEPTH_RIGHT(n->right);
+            if (cl > cr) n->right = __rotate_right(n->right);
+            return __rotate_left(n);
+        } else {
+            n->depth = MAX(dl, dr);
+            return n;
+        }
+    }
+
+    /**
+     * Rebalances the recorded path bottom-up, stops as soon as
+     * a sub tree keeps its depth. Rotated nodes are replaced in the path.
+     * @param path  the ancestors, from the root
+     * @param top   the path length
+     * @return      the index of the topmost rotated node, top if none
+     */
+    unsigned int __balance_path(node** path, unsigned int top) noexcept {
+        unsigned int kept = top;
+        while (top > 0) {
+            node* n = path[--top];
+            unsigned char before = n->depth;
+            node* local = __if_required_rotate(n);
+            if (local != n) {
+                __relink(top > 0 ? path[top - 1] : nullptr, n, local);
+                path[top] = local;
+                kept = top;
+            }
+            if (local->depth == before) break;
+        }
+        return kept;
+    }
+
+    /**
+     * Inserts a pair in the tree, returning the node.
+     * @param x     pair to be inserted
+     * @return      the inserted node or nullptr if key already present
+     */
+    node* __insert(pair_type&& x) {
+        node* path[__STACK_DEPTH];
+        unsigned int top;
+        return __insert(std::move(x), path, top);
+    }
+
+    /**
+     * Inserts a pair in the tree, returning the node and its path. The
+     * path ends with the node, or with the sub tree holding it when the
+     * rebalancing rotated its ancestors.
+     * @param x     pair to be inserted
+     * @param path  the path from the root
+     * @param top   the path length
+     * @return      the inserted node or nullptr if key already present
+     */
+    node* __insert(pair_type&& x, node** path, unsigned int& top) {
+        top = 0;
+        node** handle = &root;
+
+        while (*handle != nullptr) {
+            node* p = *handle;
+            path[top++] = p;
+            TRIPLE_COMPARE(compare, x.first, p->data.first,
+                           handle = &(p->left),
+                           handle = &(p->right),
+                           return nullptr
+            )
+        }
+
+        node* n = storage.make(std::move(x));
+        *handle = n;
+        path[top] = n;
+        top = __balance_path(path, top) + 1;
+
+        _size++;
+        return n;
+    }
+
+    /**
+     * Extracts a node from the tree by key. The extracted node
+     * is completely detached from the tree.
+     * @param k     the key to search for
+     * @return      the node or nullptr if key was not found
+     */
+    node* __extract(const K& k) noexcept {
+        node* path[__STACK_DEPTH];
+        unsigned int top = 0;
+        node* n = root;
+
+        while (n != nullptr) {
+            TRIPLE_COMPARE(compare, k, n->data.first,
+                           path[top++] = n; n = n->left,
+                           path[top++] = n; n = n->right,
+                           break
+            )
+        }
+        if (n == nullptr) return nullptr;
+
+        node* p = top > 0 ? path[top - 1] : nullptr;
+        node* nnew;
+
+        if (n->left && n->right) {
+            // Replace with the closest node of the deepest branch, the
+            // replacement takes the place of n in the path
+            const unsigned int at = top;
+            path[top++] = n;
+
+            if (n->right->depth > n->left->depth) {
+                // Left-most in right branch
+                nnew = n->right;
+                if (nnew->left) {
+                    while (nnew->left) { path[top++] = nnew; nnew = nnew->left; }
+                    path[top - 1]->left = nnew->right;
+                    nnew->right = n->right;
+                }
+                nnew->left = n->left;
+            } else {
+                // Right-most in left branch
+                nnew = n->left;
+                if (nnew->right) {
+                    while (nnew->right) { path[top++] = nnew; nnew = nnew->right; }
+                    path[top - 1]->right = nnew->left;
+                    nnew->left = n->left;
+                }
+                nnew->right = n->right;
+            }
+
+            nnew->depth = n->depth;
+            path[at] = nnew;
+        } else {
+            // Only one branch present, move it
+            nnew = n->left ? n->left : n->right;
+        }
+
+        __relink(p, n, nnew);
+        DETACH(n);
+        __balance_path(path, top);
+
+        _size--;
+        return n;
+    }
+
+    node* __clone(const node* src) {
+        if (src == nullptr) return nullptr;
+        node* n = storage.make(pair_type{src->data});
+        n->depth = src->depth;
+        n->left = __clone(src->left);
+        n->right = __clone(src->right);
+        return n;
+    }
+
+    void __drop_subtree(node* n) noexcept {
+        if (n == nullptr) return;
+        __drop_subtree(n->left);
+        __drop_subtree(n->right);
+        n->~node();
+    }
+
+    void __drop_tree() noexcept {
+        if (!std::is_trivially_destructible<node>::value) {
+            __drop_subtree(root);
+        }
+        storage.release();
+        root = nullptr;
+    }
+
+// API
+
+public:
+
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = pair_type;
+    using key_compare = Compare;
+
+    using iterator = _stack_iterator<node, pair_type>;
+    using const_iterator = _stack_iterator<node, const pair_type>;
+    using node_type = node;
+
+    // RAII & Copy and move
+
+    lean_bst() noexcept {}
+
+    explicit lean_bst(const Allocator& alloc) noexcept: storage{alloc} {}
+
+    template<typename Iter>
+    lean_bst(Iter begin, Iter end) {
+        while(begin != end) {
+            insert(*begin);
+            ++begin;
+        }
+    }
+
+    lean_bst(const lean_bst& src):
+        compare{src.compare},
+        storage{alloc_traits::select_on_container_copy_construction(src.get_allocator())}
+    {
+        // Storage is constructed after root, clone in the body
+        root = __clone(src.root);
+        _size = src._size;
+    }
+
+    lean_bst& operator=(const lean_bst& src) {
+        if (this == &src) return *this;
+        __drop_tree();
+        if constexpr (alloc_traits::propagate_on_container_copy_assignment::value) {
+            storage.reset(src.get_allocator());
+        }
+        compare = src.compare;
+        root = __clone(src.root);
+        _size = src._size;
+        return *this;
+    }
+
+    lean_bst(lean_bst&& src) noexcept:
+        compare{std::move(src.compare)},
+        root{std::exchange(src.root, nullptr)},
+        _size{std::exchange(src._size, 0)},
+        storage{std::move(src.storage)}
+    { }
+
+    lean_bst& operator=(lean_bst&& src) noexcept {
+        if (this == &src) return *this;
+        __drop_tree();
+        compare = std::move(src.compare);
+        root = std::exchange(src.root, nullptr);
+        _size = std::exchange(src._size, 0);
+        storage = std::move(src.storage);
+        return *this;
+    }
+
+    ~lean_bst() {
+        __drop_tree();
+    }
+
+// MODIFIERS
+
+    std::pair<iterator, bool> insert(const pair_type& x) {
+        return insert(pair_type{x});
+    }
+    std::pair<iterator, bool> insert(pair_type&& x) {
+        node* path[__STACK_DEPTH];
+        unsigned int top;
+        node* ref = __insert(std::move(x), path, top);
+        if (ref == nullptr) return std::pair<iterator, bool>{ end(), false };
+        // Down from the rotated sub tree, if any
+        for (node* p = path[top - 1]; p != ref; path[top++] = p) {
+            p = _less(compare, ref->data.first, p->data.first) ? p->left : p->right;
+        }
+        iterator it{root};
+        it.__path(path, top);
+        return std::pair<iterator, bool>{ it, true };
+    }
+
+    size_type erase(const K& k) noexcept {
+        node* n = __extract(k);
+        if (n == nullptr) return 0;
+        storage.drop(n);
+        return 1;
+    }
+
+    value_type pop(const K& k) noexcept {
+        node* n = __extract(k);
+        if (n == nullptr) return value_type{};
+        value_type old = n->data;
+        storage.drop(n);
+        return old;
+    }
+
+    void clear() noexcept {
+        __drop_tree();
+        _size = 0;
+    }
+
+    /**
+     * The tree is always AVL balanced, kept for API compatibility
+     */
+    void balance() noexcept {}
+
+// GETTERS
+
+    bool has(const K& k) const noexcept {
+        node* n = root;
+        while (n != nullptr) {
+            TRIPLE_COMPARE(compare, k, n->data.first,
+                           n = n->left,
+                           n = n->right,
+                           return true
+            )
+        }
+        return false;
+    }
+
+    iterator find(const K& k) noexcept {
+        node* path[__STACK_DEPTH];
+        iterator it{root};
+        it.__path(path, __seek(k, EXACT, path));
+        return it;
+    }
+    const_iterator find(const K& k) const noexcept {
+        node* path[__STACK_DEPTH];
+        const_iterator it{root};
+        it.__path(path, __seek(k, EXACT, path));
+        return it;
+    }
+
+    size_type size() const noexcept { return _size; }
+
+    Allocator get_allocator() const noexcept { return storage.get_allocator(); }
+
+    bool empty() const noexcept { return _size == 0; }
+
+    unsigned char depth() const noexcept {
+        return root ? root->depth + 1: 0;
+    }
+
+    V& operator[](const K& k) {
+        node* n = root;
+        while (n != nullptr) {
+            TRIPLE_COMPARE(compare, k, n->data.first,
+                           n = n->left,
+                           n = n->right,
+                           return n->data.second
+            )
+        }
+        return __insert(pair_type{k, V{}})->data.second;
+    }
+
+    /**
+     * Returns an iterator to a slice of the map. The slice will start
+     * at the first key greater or equal to lower and will end with the
+     * last key lower or equal to upper.
+     *
+     * @param lower     The lower inclusive bound
+     * @param upper     The upper inclusive bound
+     * @return          The iterator
+     */
+    iterator operator()(const K& lower, const K& upper) noexcept {
+        if (_less(compare, upper, lower)) return end();
+        node* path[__STACK_DEPTH];
+        unsigned int top = __seek(upper, LEFT, path);
+        if (top == 0 || _less(compare, path[top - 1]->data.first, lower)) return end();
+        node* upper_node = path[top - 1];
+        top = __seek(lower, RIGHT, path);
+        if (top == 0 || _less(compare, upper, path[top - 1]->data.first)) return end();
+        iterator it{root};
+        it.__path(path, top);
+        it.__range(path[top - 1], upper_node);
+        return it;
+    }
+
+// ITERATORS
+
+    iterator begin() noexcept {
+        iterator it{root};
+        it.__push_left(root);
+        return it;
+    }
+    const_iterator begin() const noexcept {
+        const_iterator it{root};
+        it.__push_left(root);
+        return it;
+    }
+    const_iterator cbegin() const noexcept { return begin(); }
+
+    iterator end() noexcept { return iterator{root}; }
+    const_iterator end() const noexcept { return const_iterator{root}; }
+    const_iterator cend() const noexcept { return end(); }
+
+};
+
+
+template <typename K, typename V>
+struct _lean_node {
+
+    _lean_node* left{nullptr};
+    _lean_node* right{nullptr};
+    unsigned char depth{0};
+    std::pair<const K, V> data;
+
+    explicit _lean_node(std::pair<const K, V>&& pair) noexcept: data{std::move(pair)} {}
+};
+
+
+/**
+ * Iterator keeping the stack of the ancestors of the current node
+ * (the current node is the top of the stack, end() has an empty stack).
+ * The tree descends to the keys and hands the paths over, the iterator
+ * does not compare keys.
+ */
+template<typename elem_type, typename VT>
+class _stack_iterator {
+
+    using elem_ptr = elem_type*;
+
+    elem_ptr root{nullptr};
+    elem_ptr stack[__STACK_DEPTH]{};
+    unsigned char top{0};
+    unsigned char kept{0};  // stack length at the range boundary left
+
+    // For range
+    elem_ptr lower{nullptr};
+    elem_ptr upper{nullptr};
+
+public:
+
+    explicit _stack_iterator() noexcept {}
+    explicit _stack_iterator(elem_ptr root) noexcept: root{root} {}
+
+    // Tree internals
+
+    elem_ptr __current() const noexcept { return top > 0 ? stack[top - 1] : nullptr; }
+
+    void __range(elem_ptr l, elem_ptr u) noexcept { lower = l; upper = u; }
+
+    void __path(elem_ptr const* path, unsigned int length) noexcept {
+        for (top = 0; top < length; top++) stack[top] = path[top];
+    }
+
+    /**
+     * Gets back from end() to a bound of the range: the stack still holds
+     * the path to the bound left, walked to the other bound if needed.
+     * @param bound     the bound to get to
+     */
+    void __recover(elem_ptr bound) noexcept {
+        top = kept;
+        while (stack[top - 1] != bound) {
+            if (bound == lower) --*this; else ++*this;
+        }
+    }
+
+    void __push_left(elem_ptr n) noexcept {
+        while (n) { stack[top++] = n; n = n->left; }
+    }
+
+    void __push_right(elem_ptr n) noexcept {
+        while (n) { stack[top++] = n; n = n->right; }
+    }
+
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = VT;
+    using pointer = VT*;
+    using reference = VT&;
+
+    reference operator*() const { return stack[top - 1]->data; }
+
+    pointer operator->() const { return &stack[top - 1]->data; }
+
+    _stack_iterator& operator++() noexcept {
+        if (top == 0) {
+#ifdef __ITERATOR_RECOVERABLE
+            if (lower) __recover(lower);
+            else __push_left(root);
+#endif
+        } else if (stack[top - 1] == upper) {
+            // We reached UPPER range boundary
+            kept = top;
+            top = 0;
+        } else if (stack[top - 1]->right) {
+            __push_left(stack[top - 1]->right);
+        } else {
+            // Pop till we come up from a left child
+            while (top > 1 && stack[top - 2]->right == stack[top - 1]) top--;
+            top--;
+        }
+        return *this;
+    }
+
+    _stack_iterator& operator--() noexcept {
+        if (top == 0) {
+#ifdef __ITERATOR_RECOVERABLE
+            if (upper) __recover(upper);
+            else __push_right(root);
+#endif
+        } else if (stack[top - 1] == lower) {
+#ifdef __ITERATOR_LOWER_END
+            kept = top;
+            top = 0;
+#endif
+        } else if (stack[top - 1]->left) {
+            __push_right(stack[top - 1]->left);
+        } else {
+            // Pop till we come up from a right child
+            unsigned char from = top;
+            while (top > 1 && stack[top - 2]->left == stack[top - 1]) top--;
+            top--;
+#ifndef __ITERATOR_LOWER_END
+            if (top == 0) top = from;
+#endif
+            (void) from;
+        }
+        return *this;
+    }
+
+    friend bool operator==(const _stack_iterator& a, const _stack_iterator& b) noexcept {
+        return a.__current() == b.__current();
+    }
+    friend bool operator!=(const _stack_iterator& a, const _stack_iterator& b) noexcept {
+        return a.__current() != b.__current();
+    }
+};
@@ -4,11 +4,17 @@
 #include <iterator>
 #include <string>
 #include <cstring>
+#include <cctype>
+#include <sstream>
 #include <cmath>
 
 #include <iomanip>
 
 #include "bst.cpp"
+#include "compact_bst.cpp"
+#include "lean_bst.cpp"
+#include "intrusive_bst.cpp"
+#include "frozen_bst.cpp"
 
 #include <stdexcept>
 #include <algorithm>
@@ -17,6 +23,9 @@
 
 #include <random>
 #include <limits>
+#include <memory_resource>
+#include <map>
+#include <set>
 
 
 #define TEST(cond, name) \
@@ -206,6 +215,59 @@ unsigned int count_iter(Iter begin, Iter end) {
     return c;
 }
 
+// Allocator tagged with an id, container copies select the opposite one
+template<typename T>
+struct tagged_allocator {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    int tag;
+    explicit tagged_allocator(int tag = 0) noexcept: tag{tag} {}
+    template<typename U>
+    tagged_allocator(const tagged_allocator<U>& other) noexcept: tag{other.tag} {}
+    T* allocate(std::size_t n) { return std::allocator<T>{}.allocate(n); }
+    void deallocate(T* p, std::size_t n) noexcept { std::allocator<T>{}.deallocate(p, n); }
+    tagged_allocator select_on_container_copy_construction() const noexcept { return tagged_allocator{-tag}; }
+    friend bool operator==(const tagged_allocator& a, const tagged_allocator& b) noexcept { return a.tag == b.tag; }
+    friend bool operator!=(const tagged_allocator& a, const tagged_allocator& b) noexcept { return a.tag != b.tag; }
+};
+
+// Memory resource failing past a budget of allocations
+struct budget_resource: std::pmr::memory_resource {
+    std::size_t left;
+    explicit budget_resource(std::size_t left): left{left} {}
+    void* do_allocate(std::size_t bytes, std::size_t align) override {
+        if (left == 0) throw std::bad_alloc{};
+        left--;
+        return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+    void do_deallocate(void* p, std::size_t bytes, std::size_t align) override {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+// Whether a tree holds the invariants of its balancing policy (AVL balance,
+// red-black colours and black heights, treap heap order) with a depth bound
+// by factor * log2(size + 1)
+template<typename Tree>
+bool balanced(Tree& t, double factor) {
+    return t.check_tree() && t.depth() <= (unsigned char) (factor * std::log2(t.size() + 1) + 1);
+}
+
+// The maps the policy checks run on
+template<typename K, typename V, typename Balance, std::size_t Inline = 4>
+using policy_bst = bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>, _node_pool, Inline, Balance>;
+
+// Runs a check on each balancing policy with its name and depth factor
+// (see balanced())
+template<typename Check>
+void for_each_policy(Check&& check) {
+    check(balance_heuristic{}, "Heuristic", 1.5);
+    check(balance_avl{}, "AVL", 1.45);
+    check(balance_red_black{}, "Red-black", 2);
+    check(balance_treap{}, "Treap", 4);
+}
+
 int main(int argc, char *argv[]) {
     std::cout << "Testing bst<K, V>" << std::endl;
 
@@ -217,6 +279,7 @@ int main(int argc, char *argv[]) {
     bool _test_basic{false};
     bool _test_iter{false};
     bool _test_stochastic{false};
+    bool _test_layout{false};
     std::size_t _test_stochastic_map_size = 1000;
 
     if (argc > 1) {
@@ -230,6 +293,7 @@ int main(int argc, char *argv[]) {
                 << "\n-b\tfor basic functional test"
                 << "\n-i\tto test iterators and iterable results of functions"
                 << "\n-s\tto perform a stochastic test (random insert, erase)"
+                << "\n-l\tto test the alternative node layouts"
                 << "\n"
                 << "\n--ms\tto define the map size to be reached in stochastic tests"
                 << std::endl;
@@ -254,6 +318,9 @@ int main(int argc, char *argv[]) {
                         case 's':
                             _test_stochastic = true;
                             break;
+                        case 'l':
+                            _test_layout = true;
+                            break;
                     }
                 }
 
@@ -267,11 +334,12 @@ int main(int argc, char *argv[]) {
 
     }
 
-    if (!_test_assign && !_test_basic && !_test_iter && !_test_stochastic) {
+    if (!_test_assign && !_test_basic && !_test_iter && !_test_stochastic && !_test_layout) {
         _test_assign = true;
         _test_basic = true;
         _test_iter = true;
         _test_stochastic = true;
+        _test_layout = true;
     }
 
     // TEST
@@ -333,6 +401,90 @@ int main(int argc, char *argv[]) {
         ASSERT(map4.size() == 3, "map4 should have 3 elements");
         ASSERT(helper::are_vectors_eq(v, helper::map_to_vector(map4)), "map4 should be equal to source vector");
 
+        // Polymorphic allocator
+        char buffer[4096];
+        std::pmr::monotonic_buffer_resource arena{buffer, sizeof(buffer)};
+        pmr::bst<K, V> map5{v.begin(), v.end(), &arena};
+        ASSERT(map5.get_allocator().resource() == &arena, "map5 should allocate from the arena");
+        pmr::bst<K, V> map6{map5};
+        ASSERT(map6.get_allocator().resource() != &arena, "map6 copy should not propagate the arena");
+        ASSERT(helper::are_vectors_eq(v, helper::vector{map6.begin(), map6.end()}), "map6 should be equal to map5");
+        pmr::bst<K, V> map7{&arena};
+        map7 = std::move(map6);
+        ASSERT(map7.get_allocator().resource() == &arena, "map7 should keep its arena on move assignment");
+        ASSERT(map7.size() == 3 && map6.size() == 0, "map7 should take map6 values");
+        swap(map5, map7);
+        ASSERT(map5.size() == 3 && map7.size() == 3, "swap() should exchange trees");
+
+    }
+    END_TEST()
+
+    TEST(_test_assign, "Deep copy")
+    {
+        using map = bst<K, std::string>;
+        // The tree structure, without the addresses
+        auto shape = [](map& m) {
+            std::stringstream ss;
+            m.print_tree(ss);
+            std::string out, dump = ss.str();
+            for (std::size_t i = 0; i < dump.size(); i++) {
+                if (dump[i] == '0' && i + 1 < dump.size() && dump[i + 1] == 'x') {
+                    i++;
+                    while (i + 1 < dump.size() && std::isxdigit(dump[i + 1])) i++;
+                    out += '@';
+                } else {
+                    out += dump[i];
+                }
+            }
+            return out;
+        };
+
+        std::default_random_engine generator{0x5151ul};
+        std::uniform_int_distribution<K> distribution;
+        map small, big;
+        for (int i = 0; i < 1000; i++) small[distribution(generator)] = std::to_string(i);
+        for (int i = 0; i < 100000; i++) big[distribution(generator)] = std::to_string(i);
+
+        map small_copy{small};
+        ASSERT(shape(small_copy) == shape(small), "Copy should keep shape and depths");
+        map big_copy{big};
+        ASSERT(big_copy.size() == big.size() && big_copy.depth() == big.depth(), "Parallel copy should keep size and depth");
+        ASSERT(shape(big_copy) == shape(big), "Parallel copy should keep shape and depths");
+        big_copy.erase(big.begin()->first);
+        big_copy = big;
+        ASSERT(shape(big_copy) == shape(big), "Copy assignment should keep shape and depths");
+
+        // Copies throwing halfway leave nothing behind
+        static long live, copies_left;
+        struct counted {
+            int x;
+            explicit counted(int x): x{x} { live++; }
+            counted(const counted& o): x{o.x} {
+                if (copies_left-- == 0) throw std::runtime_error("copy");
+                live++;
+            }
+            counted(counted&& o) noexcept: x{o.x} { live++; }
+            ~counted() { live--; }
+        };
+        auto throwing_copy = [&](auto& m, long at) {
+            long before = live;
+            copies_left = at;
+            bool thrown = false;
+            try {
+                auto c{m};
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            copies_left = -1;
+            return thrown && live == before;
+        };
+        copies_left = -1;
+        bst<K, counted> counted_big;
+        small_bst<K, counted, 8> counted_small;
+        for (K k = 0; k < (1 << 17); k++) counted_big.insert({k, counted{k}});
+        for (K k = 0; k < 6; k++) counted_small.insert({k, counted{k}});
+        ASSERT(throwing_copy(counted_big, 1 << 16) && throwing_copy(counted_small, 3),
+               "Throwing copies should drop the partial clone");
     }
     END_TEST()
 
@@ -416,6 +568,809 @@ int main(int argc, char *argv[]) {
         ASSERT(m.size() == 0, "Size should be 0 after clear");
         ASSERT(m.depth() == 0, "Depth should be 0 after clear");
 
+        // Plain new / delete storage
+        bst<K, V, std::less<K>, std::size_t, std::allocator<pair>, _node_heap> h{};
+        h[1] = 1;
+        h[2] = 2;
+        h.erase(1);
+        auto h2 = h;
+        ASSERT(h2.size() == 1 && h2[2] == 2, "Heap storage should behave as pooled storage");
+
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Compaction")
+    {
+        using V = int;
+        using map = bst<K, V>;
+        using vector = bstHelpers<K, V>::vector;
+
+        // Churn the tree so that nodes get scattered over the slabs
+        const auto v = random_unique_array(2000, 0x11223ul);
+        map m{v.begin(), v.begin() + 1000};
+        std::map<K, V> ref{v.begin(), v.begin() + 1000};
+        for (std::size_t i = 0; i < 1000; i++) {
+            m.erase(v[i].first);
+            ref.erase(v[i].first);
+            m.insert(v[1000 + i]);
+            ref.insert(v[1000 + i]);
+        }
+        const auto _depth = m.depth();
+        m.compact();
+        ASSERT((vector{m.begin(), m.end()} == vector{ref.begin(), ref.end()}), "compact() should preserve the pairs");
+        ASSERT(m.depth() == _depth, "compact() should preserve the shape");
+
+        bool sequential = true;
+        auto prev = m.begin();
+        for (auto it = m.begin(); ++it != m.end(); prev = it) {
+            auto step = reinterpret_cast<const char*>(&*it) - reinterpret_cast<const char*>(&*prev);
+            sequential = sequential && step == (long) sizeof(map::node_type);
+        }
+        ASSERT(sequential, "compact() should lay out the nodes in key order");
+
+        m.insert(v[0]);
+        m.erase(v[1500].first);
+        ASSERT(m.has(v[0].first) && !m.has(v[1500].first), "Compacted map should accept modifications");
+
+        // Plain new / delete storage
+        bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>, _node_heap> h{v.begin(), v.end()};
+        h.compact();
+        ASSERT(h.size() == v.size() && h.find(v[7].first)->second == v[7].second, "Heap storage should compact");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Deferred teardown")
+    {
+        using map = bst<K, std::string>;
+        const auto v = random_unique_array(1000, 0x44556ul);
+
+        // Incremental: later operations free a bounded number of nodes
+        bst_reclaimer r{false, 16};
+        map m;
+        m.set_reclaimer(&r);
+        for (auto&& kv : v) m[kv.first] = std::to_string(kv.second);
+        m.clear();
+        ASSERT(m.empty() && r.pending() == 1, "clear() should hand the tree to the reclaimer");
+        std::size_t ops = 0;
+        for (; r.pending() > 0; ops++) m[(K) ops] = "x";
+        ASSERT(ops >= v.size() / 16 && m.size() == ops, "Operations should free the tree incrementally");
+        {
+            map c{m};
+            c.set_reclaimer(&r);
+            m = c;
+        }
+        ASSERT(r.pending() == 2 && m.size() == ops, "Destructor and assignment should defer the old trees");
+        r.drain();
+        ASSERT(r.pending() == 0, "drain() should free everything");
+
+        // Background thread
+        bst_reclaimer b{true};
+        for (int i = 0; i < 8; i++) {
+            map t;
+            t.set_reclaimer(&b);
+            for (auto&& kv : v) t[kv.first] = std::to_string(kv.second);
+        }
+        b.drain();
+        ASSERT(b.pending() == 0, "Background reclaimer should free the trees");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Balancing policies")
+    {
+        using V = int;
+        const auto v = random_unique_array(5000, 0x1f2e3dul);
+
+        // Checks a policy on random, ascending and descending insertions,
+        // balanced() by factor
+        auto check = [&](auto policy, const std::string& name, double factor) {
+            using map = policy_bst<K, V, decltype(policy), 0>;
+
+            map m{v.begin(), v.end()};
+            std::map<K, V> ref{v.begin(), v.end()};
+            for (std::size_t i = 0; i < v.size(); i += 3) {
+                m.erase(v[i].first);
+                ref.erase(v[i].first);
+            }
+            std::vector<std::pair<K, V>> content{m.begin(), m.end()}, ref_content{ref.begin(), ref.end()};
+            ASSERT(content == ref_content, name + " should keep keys sorted across erasures");
+            ASSERT(balanced(m, factor), name + " should bound the depth of random insertions");
+
+            map a, d;
+            for (K k = 0; k < 4096; k++) a[k] = k;
+            for (K k = 4096; k > 0; k--) d[k] = k;
+            ASSERT(balanced(a, factor) && balanced(d, factor),
+                   name + " should bound the depth of sorted insertions");
+            for (K k = 0; k < 4096; k += 2) a.erase(k);
+            ASSERT(a.size() == 2048 && a.begin()->first == 1 && balanced(a, factor),
+                   name + " should bound the depth after erasures");
+
+            if constexpr (!std::is_same<decltype(policy), balance_treap>::value) {
+                a.balance();
+                ASSERT(a.depth() == 12 && a.size() == 2048 && a.begin()->first == 1,
+                       name + " should be rebuilt with the minimum depth");
+                for (K k = 0; k < 4096; k += 2) a[k] = k;
+                ASSERT(a.size() == 4096 && balanced(a, factor), name + " should stay balanced once rebuilt");
+            }
+        };
+        for_each_policy(check);
+
+        // Treaps are heaps again once linked anew or moved
+        auto heap = [&](auto policy, const std::string& name) {
+            using map = policy_bst<K, V, decltype(policy)>;
+            map s;
+            for (K k = 0; k < 5; k++) s[k] = k;
+            ASSERT(s.size() == 5 && s.check_tree(), name + " should be a heap once out of the inline nodes");
+            std::map<K, V> ref{v.begin(), v.end()};
+            map l{sorted_unique, ref.begin(), ref.end()};
+            ASSERT(l.check_tree(), name + " should be a heap once loaded");
+            map c{l};
+            ASSERT(c.check_tree() && c.size() == l.size(), name + " should be a heap once copied");
+            for (K k = 0; k < 100; k++) c.erase(v[k].first);
+            c.compact();
+            ASSERT(c.check_tree() && c.size() == l.size() - 100, name + " should be a heap once compacted");
+            for (K k = 0; k < 100; k++) c.insert(v[k]);
+            std::vector<std::pair<K, V>> content{c.begin(), c.end()}, ref_content{ref.begin(), ref.end()};
+            ASSERT(content == ref_content && c.check_tree(), name + " should stay a heap");
+        };
+        heap(balance_treap{}, "Treap");
+        heap(balance_adaptive{}, "Adaptive treap");
+
+        // No balancing but on request
+        bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>, _node_pool, 0, balance_none> n;
+        for (K k = 0; k < 200; k++) n[k] = k;
+        ASSERT(n.depth() == 200, "Unbalanced tree should degenerate on sorted insertions");
+        n.balance();
+        ASSERT(n.depth() == 8 && n.size() == 200 && n.begin()->first == 0 && n[199] == 199,
+               "Unbalanced tree should be rebuilt with the minimum depth on balance()");
+        for (K k = 0; k < 200; k += 3) n.erase(k);
+        for (K k = 1000; k < 1200; k++) n[k] = k;
+        n.balance();
+        ASSERT(n.depth() == 9 && n.size() == 333 && n.begin()->first == 1 && n[1199] == 1199,
+               "Rebuilt tree should be rebuilt again");
+        n.clear();
+        n.balance();
+        n[1] = 1;
+        n.balance();
+        ASSERT(n.depth() == 1 && n.size() == 1, "Rebuild should handle trees of one node or none");
+
+        // Intrusive trees take the same policies
+        struct item: bst_hook<> { K id; };
+        std::vector<item> items(1000);
+        for (std::size_t i = 0; i < items.size(); i++) items[i].id = (K) i;
+        intrusive_bst<item, K, &item::id, std::less<K>, void, balance_red_black> t{items.begin(), items.end()};
+        for (std::size_t i = 0; i < items.size(); i += 2) t.unlink(items[i]);
+        ASSERT(t.size() == 500 && t.begin()->id == 1 && balanced(t, 2),
+               "Red-black intrusive tree should stay balanced");
+        t.balance();
+        for (std::size_t i = 0; i < items.size(); i += 4) t.unlink(items[i + 1]);
+        ASSERT(t.size() == 250 && t.begin()->id == 3 && balanced(t, 2),
+               "Red-black intrusive tree should stay balanced once rebuilt");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Adaptive lookups")
+    {
+        using V = int;
+        using map = bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>,
+                        _node_pool, 0, balance_splay>;
+
+        map m;
+        for (K k = 0; k < 100; k++) m[k] = k;
+        ASSERT(m.depth() == 100, "Sorted insertions should chain up");
+        ASSERT(m.find(0)->first == 0 && m.depth() < 60, "find() should splay the key, halving the path");
+        std::stringstream ss;
+        std::string line;
+        m.print_tree(ss);
+        std::getline(ss, line); // Size
+        std::getline(ss, line);
+        ASSERT(line.find("(0:0)") != std::string::npos, "The found key should be the root");
+
+        auto it = m.find(50);
+        ASSERT(m.has(7) && m[93] == 93 && (++it)->first == 51, "Lookups should not invalidate iterators");
+        V sum = 0;
+        for (auto&& kv : m) sum += kv.second;
+        ASSERT(sum == 99 * 100 / 2 && m.size() == 100, "Lookups should keep the content");
+
+        // Random traffic against std::map
+        const auto v = random_unique_array(3000, 0x5a5a5ul);
+        map r;
+        std::map<K, V> ref;
+        for (std::size_t i = 0; i < v.size(); i++) {
+            r.insert(v[i]);
+            ref.insert(v[i]);
+            const K hot = v[i / 7].first;
+            ASSERT_QUIET(r.has(hot) == (ref.count(hot) > 0) && (!r.has(hot) || r[hot] == ref[hot]),
+                         "Hot keys should be found");
+            if (i % 5 == 0) {
+                ASSERT_QUIET(r.erase(v[i / 2].first) == ref.erase(v[i / 2].first), "Erase should match std::map");
+            }
+        }
+        std::vector<std::pair<K, V>> content{r.begin(), r.end()}, ref_content{ref.begin(), ref.end()};
+        ASSERT(content == ref_content, "Splay tree should match std::map");
+
+        map deep;
+        for (K k = 0; k < 1000; k++) deep[k] = k;
+        ASSERT(deep.depth() == 255, "Depth should saturate on degenerate trees");
+        deep.compact();
+        ASSERT(deep.size() == 1000 && deep.begin()->first == 0 && deep[999] == 999, "Degenerate trees should compact");
+
+        // Frequency weighted treap
+        using adaptive_map = bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>,
+                                 _node_pool, 0, balance_adaptive>;
+        adaptive_map a;
+        std::map<K, V> a_ref;
+        for (std::size_t i = 0; i < v.size(); i++) {
+            a.insert(v[i]);
+            a_ref.insert(v[i]);
+            ASSERT_QUIET(a.has(v[i / 50].first) == (a_ref.count(v[i / 50].first) > 0), "Adaptive lookups should match std::map");
+            if (i % 3 == 0) {
+                a.erase(v[i / 3].first);
+                a_ref.erase(v[i / 3].first);
+            }
+        }
+        content.assign(a.begin(), a.end());
+        ref_content.assign(a_ref.begin(), a_ref.end());
+        ASSERT(content == ref_content && balanced(a, 4),
+               "Adaptive tree should match std::map and stay balanced");
+        const K hot = a_ref.rbegin()->first;
+        for (int i = 0; i < 5000; i++) a.find(hot);
+        ss.str("");
+        a.print_tree(ss);
+        std::getline(ss, line); // Size
+        std::getline(ss, line);
+        ASSERT(line.find("(" + std::to_string(hot) + ":") != std::string::npos, "The hot key should climb to the root");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Incremental rebalancing")
+    {
+        using V = int;
+
+        // Deferred until stepped
+        bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>,
+            _node_pool, 0, balance_incremental<>> m;
+        for (K k = 0; k < 4096; k++) m[k] = k;
+        ASSERT(m.depth() == 255, "Sorted insertions should chain up until stepped");
+        std::size_t steps = 0;
+        while (m.rebalance_step(64)) steps++;
+        ASSERT(steps > 10 && balanced(m, 2), "Steps should rebalance a bounded share at a time");
+        ASSERT(!m.rebalance_step(), "Nothing should be pending once stepped through");
+        for (K k = 0; k < 4096; k += 2) m.erase(k);
+        m.balance();
+        ASSERT(!m.rebalance_step() && balanced(m, 2) && m.size() == 2048 && m.begin()->first == 1,
+               "balance() should perform all pending rebalancing");
+
+        // Amortized along operations
+        bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>,
+            _node_pool, 0, balance_incremental<2, 2>> a;
+        for (K k = 4096; k > 0; k--) a[k] = k;
+        ASSERT(balanced(a, 2), "A per operation budget should keep up with sorted insertions");
+
+        const auto v = random_unique_array(5000, 0x1ce1ceul);
+        std::map<K, V> ref;
+        a.clear();
+        for (std::size_t i = 0; i < v.size(); i++) {
+            a.insert(v[i]);
+            ref.insert(v[i]);
+            if (i % 3 == 0) {
+                ASSERT_QUIET(a.erase(v[i / 2].first) == ref.erase(v[i / 2].first), "Erase should match std::map");
+            }
+        }
+        std::vector<std::pair<K, V>> content{a.begin(), a.end()}, ref_content{ref.begin(), ref.end()};
+        ASSERT(content == ref_content && balanced(a, 2),
+               "Incremental tree should match std::map and stay balanced");
+
+        // Intrusive trees step the same way
+        struct item: bst_hook<> { K id; };
+        std::vector<item> items(1000);
+        for (std::size_t i = 0; i < items.size(); i++) items[i].id = (K) i;
+        intrusive_bst<item, K, &item::id, std::less<K>, void, balance_incremental<>> t{items.begin(), items.end()};
+        while (t.rebalance_step(8)) {}
+        ASSERT(t.size() == 1000 && t.begin()->id == 0 && balanced(t, 2),
+               "Intrusive tree should be stepped to balance");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Bulk load")
+    {
+        using V = int;
+        using map = bst<K, V>;
+        auto v = random_unique_array(5000, 0xb01dul);
+        std::map<K, V> ref{v.begin(), v.end()};
+
+        map s{sorted_unique, ref.begin(), ref.end()};
+        std::vector<std::pair<K, V>> content{s.begin(), s.end()}, ref_content{ref.begin(), ref.end()};
+        ASSERT(content == ref_content && s.depth() == 13, "Sorted range should load with the minimum depth");
+        ASSERT(s.has(v[42].first) && s.erase(v[7].first) == 1 && s.insert({v[7].first, 7}).second,
+               "Loaded map should be searchable and updatable");
+
+        // Unsorted, with duplicated keys
+        v.push_back({v[10].first, -1});
+        v.push_back({v[20].first, -1});
+        map u{sorted_unique, v.begin(), v.end()};
+        content.assign(u.begin(), u.end());
+        ASSERT(content == ref_content && u.size() == 5000 && u.depth() == 13,
+               "Unsorted range should be sorted, keeping the first of duplicated keys");
+
+        // Single pass iterators
+        std::stringstream in{"1 2 3 5 8 13 21"};
+        bst_set<K> f{sorted_unique, std::istream_iterator<K>{in}, std::istream_iterator<K>{}};
+        std::vector<K> keys{f.begin(), f.end()};
+        ASSERT((keys == std::vector<K>{1, 2, 3, 5, 8, 13, 21}) && f.depth() == 3, "Input iterators should load");
+
+        map e{sorted_unique, ref.end(), ref.end()};
+        ASSERT(e.size() == 0 && e.begin() == e.end() && e.insert({1, 1}).second, "Empty range should load");
+        // Nothing to allocate for, the inline nodes are kept
+        using null_map = bst<K, V, std::less<K>, std::size_t, std::pmr::polymorphic_allocator<std::pair<const K, V>>,
+                             _node_pool, 4>;
+        null_map ne{sorted_unique, ref.end(), ref.end(), std::pmr::null_memory_resource()};
+        for (K k = 0; k < 4; k++) ne[k] = k;
+        ASSERT(ne.size() == 4 && ne.begin()->first == 0, "Empty range should keep the inline nodes");
+
+        // Policies take the loaded tree over
+        bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>,
+            _node_pool, 4, balance_red_black> r{sorted_unique, ref.begin(), ref.end()};
+        for (auto&& kv : v) r.erase(kv.first + 1);
+        for (K k = 0; k < 2000; k++) r[k] = k;
+        std::map<K, V> r_ref{ref};
+        for (auto&& kv : v) r_ref.erase(kv.first + 1);
+        for (K k = 0; k < 2000; k++) r_ref[k] = k;
+        content.assign(r.begin(), r.end());
+        ref_content.assign(r_ref.begin(), r_ref.end());
+        ASSERT(content == ref_content && balanced(r, 2),
+               "Loaded red-black tree should stay balanced");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Batch insert")
+    {
+        using V = int;
+        const auto v = random_unique_array(6000, 0xba7c4ul);
+
+        // Checks a policy on batches small and large compared to the tree,
+        // balanced() by factor
+        auto check = [&](auto policy, const std::string& name, double factor) {
+            using map = policy_bst<K, V, decltype(policy)>;
+            map m;
+            std::map<K, V> ref;
+            std::vector<std::pair<K, V>> batch{v.begin(), v.begin() + 3};
+            ASSERT(m.insert_batch(batch.begin(), batch.end()) == 3 && m.size() == 3, name + " should batch into a small map");
+            ref.insert(batch.begin(), batch.end());
+            // Fitting the inline nodes, nothing to allocate
+            using null_map = bst<K, V, std::less<K>, std::size_t, std::pmr::polymorphic_allocator<std::pair<const K, V>>,
+                                 _node_pool, 4, decltype(policy)>;
+            null_map n{sorted_unique, batch.end(), batch.end(), std::pmr::null_memory_resource()};
+            ASSERT(n.insert_batch(batch.begin(), batch.end()) == 3 && n.insert_batch(batch.begin(), batch.begin() + 1) == 0,
+                   name + " should batch into the inline nodes");
+            ASSERT((std::vector<std::pair<K, V>>{n.begin(), n.end()} == std::vector<std::pair<K, V>>{ref.begin(), ref.end()}),
+                   name + " should sort the inline batch");
+
+            // Sorted, overlapping the tree
+            batch.assign(v.begin(), v.begin() + 1000);
+            for (auto&& kv : batch) kv.second = -1;
+            std::sort(batch.begin(), batch.end());
+            ASSERT(m.insert_batch(batch.begin(), batch.end()) == 997, name + " should not insert present keys");
+            ref.insert(batch.begin(), batch.end());
+
+            // Small, unsorted with duplicated keys
+            batch.assign(v.begin() + 1000, v.begin() + 1200);
+            batch.push_back({v[1100].first, -2});
+            batch.push_back({v[10].first, -2});
+            ASSERT(m.insert_batch(batch.begin(), batch.end()) == 200, name + " should insert the first of duplicated keys");
+            ref.insert(batch.begin(), batch.end());
+
+            // Large
+            ASSERT(m.insert_batch(v.begin() + 1200, v.end()) == 4800, name + " should insert a large batch");
+            ref.insert(v.begin() + 1200, v.end());
+
+            std::vector<std::pair<K, V>> content{m.begin(), m.end()}, ref_content{ref.begin(), ref.end()};
+            ASSERT(content == ref_content && balanced(m, factor), name + " should merge batches in balance");
+            for (std::size_t i = 0; i < v.size(); i += 2) m.erase(v[i].first);
+            for (K k = 0; k < 1000; k++) m[k] = k;
+            ASSERT(m.size() == 4000 && balanced(m, factor), name + " should stay balanced after batches");
+        };
+        for_each_policy(check);
+
+        bst_set<K> s;
+        std::stringstream in{"8 3 5 3 1"};
+        std::vector<K> none;
+        ASSERT(s.insert_batch(std::istream_iterator<K>{in}, std::istream_iterator<K>{}) == 4 &&
+               s.insert_batch(none.begin(), none.end()) == 0 && s.size() == 4 && *s.begin() == 1,
+               "Input iterators and empty ranges should batch");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Split and join")
+    {
+        using V = int;
+        const auto v = random_unique_array(4000, 0x5b117ul);
+
+        // Checks a policy moving key ranges between two shards,
+        // balanced() by factor
+        auto check = [&](auto policy, const std::string& name, double factor) {
+            using map = policy_bst<K, V, decltype(policy)>;
+            map m;
+            std::map<K, V> ref;
+            for (auto&& kv : v) { m.insert(kv); ref.insert(kv); }
+
+            std::vector<K> keys;
+            for (auto&& kv : ref) keys.push_back(kv.first);
+            K cut = keys[1000];
+            auto [lo, hi] = m.split(cut);
+            ASSERT(m.empty() && m.size() == 0, name + " split should empty the map");
+            ASSERT(lo.size() == 1000 && hi.size() == keys.size() - 1000 && hi.begin()->first == cut,
+                   name + " split should cut at the key");
+            ASSERT(balanced(lo, factor) && balanced(hi, factor), name + " split should keep the balance");
+
+            // Move the range [keys[1000], keys[1500]) from hi to lo
+            auto [mid, rest] = hi.split(keys[1500]);
+            lo = map::join(std::move(lo), std::move(mid));
+            for (std::size_t i = 1500; i < 1510; i++) { rest[keys[i]] = -1; ref[keys[i]] = -1; }
+            for (std::size_t i = 1510; i < 1520; i++) { rest.erase(keys[i]); ref.erase(keys[i]); }
+            ASSERT(lo.size() == 1500 && balanced(lo, factor) && balanced(rest, factor),
+                   name + " join should keep the balance");
+
+            m = map::join(std::move(lo), std::move(rest));
+            std::vector<std::pair<K, V>> content{m.begin(), m.end()}, ref_content{ref.begin(), ref.end()};
+            ASSERT(content == ref_content && m.size() == ref.size() && balanced(m, factor),
+                   name + " should join back all the keys");
+
+            auto [none, all] = m.split(keys[0]);
+            ASSERT(none.empty() && all.size() == ref.size(), name + " split below all the keys");
+            map small;
+            small[keys[0] - 1] = 1;
+            m = map::join(std::move(small), std::move(all));
+            ASSERT(m.size() == ref.size() + 1 && m.begin()->first == keys[0] - 1, name + " should join a small map");
+        };
+        for_each_policy(check);
+
+
+        bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>, _node_heap> h;
+        for (auto&& kv : v) h.insert(kv);
+        auto [a, b] = h.split(v[7].first);
+        h = decltype(h)::join(std::move(a), std::move(b));
+        ASSERT(h.size() == v.size(), "Split and join should work with a node heap");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Set operations")
+    {
+        using V = int;
+
+        // Checks a policy against std::map, n keys in each map (parallel above 1 << 16)
+        std::size_t n = 3000;
+        auto check = [&](auto policy, const std::string& name, double factor) {
+            using map = policy_bst<K, V, decltype(policy)>;
+            std::mt19937 rng(0x5e7ul);
+            auto fill = [&](V tag, map& m, std::map<K, V>& ref) {
+                ref.clear();
+                for (std::size_t i = 0; i < n; i++) {
+                    K k = rng() % (3 * n);
+                    m.insert({k, tag});
+                    ref.insert({k, tag});
+                }
+            };
+            auto same = [](map& m, const std::map<K, V>& ref) {
+                std::vector<std::pair<K, V>> content{m.begin(), m.end()}, ref_content{ref.begin(), ref.end()};
+                return content == ref_content && m.size() == ref.size();
+            };
+
+            map a, b;
+            std::map<K, V> ra, rb, ref;
+            fill(1, a, ra); fill(2, b, rb);
+            ref = rb;
+            for (auto&& kv : ra) ref[kv.first] = kv.second;
+            map u = map::set_union(std::move(a), std::move(b));
+            ASSERT(a.empty() && b.empty() && same(u, ref) && balanced(u, factor),
+                   name + " union should merge the keys, left wins");
+
+            fill(1, a, ra); fill(2, b, rb);
+            ref.clear();
+            for (auto&& kv : rb) if (ra.count(kv.first)) ref.insert(kv);
+            map i = map::set_intersection(std::move(a), std::move(b), bst_keep::right);
+            ASSERT(same(i, ref) && balanced(i, factor), name + " intersection should keep the common keys, right wins");
+
+            fill(1, a, ra); fill(2, b, rb);
+            ref.clear();
+            for (auto&& kv : ra) if (!rb.count(kv.first)) ref.insert(kv);
+            map d = map::set_difference(std::move(a), std::move(b));
+            ASSERT(same(d, ref) && balanced(d, factor), name + " difference should keep the left only keys");
+
+            d = map::set_union(std::move(d), map::set_intersection(std::move(u), std::move(i)));
+            d[-1] = 0;
+            ASSERT(d.size() > ref.size() && d.begin()->first == -1, name + " results should stay usable");
+        };
+        for_each_policy(check);
+        n = 50000;
+        check(balance_avl{}, "Large AVL", 1.45);
+
+        bst_set<K> s, t;
+        s.insert(1); s.insert(2); t.insert(2); t.insert(3);
+        auto [lo, hi] = s.split(2);
+        s = bst_set<K>::set_union(std::move(lo), std::move(hi));
+        s = bst_set<K>::set_intersection(std::move(s), std::move(t));
+        ASSERT(s.size() == 1 && *s.begin() == 2, "Set operations should work on sets and uncounted sizes");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Range erase")
+    {
+        using V = int;
+        const auto v = random_unique_array(4000, 0xe4a5eul);
+
+        // Checks a policy evicting sliding windows of keys against std::map
+        auto check = [&](auto policy, const std::string& name, double factor) {
+            using map = policy_bst<K, V, decltype(policy)>;
+            map m;
+            std::map<K, V> ref;
+            for (auto&& kv : v) { m.insert(kv); ref.insert(kv); }
+
+            std::vector<K> keys;
+            for (auto&& kv : ref) keys.push_back(kv.first);
+            bool same = true;
+            for (std::size_t i = 0; i + 400 < keys.size(); i += 500) {
+                auto a = ref.lower_bound(keys[i]), b = ref.upper_bound(keys[i + 300]);
+                std::size_t expected = std::distance(a, b);
+                ref.erase(a, b);
+                same = same && m.erase(keys[i], keys[i + 300]) == expected;
+            }
+            std::vector<std::pair<K, V>> content{m.begin(), m.end()}, ref_content{ref.begin(), ref.end()};
+            ASSERT(same && content == ref_content && m.size() == ref.size(), name + " should erase the ranges");
+            ASSERT(balanced(m, factor), name + " should keep the balance");
+            ASSERT(m.erase(keys[1], keys[0]) == 0 && m.erase(keys[1], keys[1]) == 0 && m.size() == ref.size(),
+                   name + " should skip empty ranges");
+            ASSERT(m.erase(keys.front(), keys.back()) == ref.size() && m.empty() && m.begin() == m.end(),
+                   name + " should erase all the keys");
+        };
+        for_each_policy(check);
+
+        bst<K, V, std::less<K>, std::size_t, std::allocator<std::pair<const K, V>>, _node_pool, 8> small;
+        for (K k = 0; k < 6; k++) small[k] = k;
+        ASSERT(small.erase(1, 3) == 3 && small.size() == 3 && small.begin()->first == 0 && small.has(4),
+               "Range erase should shift the inline nodes");
+        ASSERT(small(10, 20) == small.end() && small(-20, -10) == small.end(),
+               "Slices out of the keys should be empty");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Erase if")
+    {
+        using V = int;
+        const auto v = random_unique_array(4000, 0xe1f5ul);
+
+        // Checks a policy purging a share of the keys against std::map
+        auto check = [&](auto policy, const std::string& name, double factor) {
+            using map = policy_bst<K, V, decltype(policy)>;
+            map m;
+            std::map<K, V> ref;
+            for (auto&& kv : v) { m.insert(kv); ref.insert(kv); }
+
+            for (K mod : {7, 3, 2}) {
+                auto pred = [mod](const std::pair<const K, V>& kv) { return kv.first % mod == 0; };
+                std::size_t expected = 0;
+                for (auto it = ref.begin(); it != ref.end();) {
+                    if (pred(*it)) { it = ref.erase(it); expected++; } else ++it;
+                }
+                ASSERT(erase_if(m, pred) == expected, name + " should count the removed values");
+            }
+            std::vector<std::pair<K, V>> content{m.begin(), m.end()}, ref_content{ref.begin(), ref.end()};
+            ASSERT(content == ref_content && m.size() == ref.size() && balanced(m, factor),
+                   name + " should keep the others balanced");
+            m[1] = 1;
+            ASSERT(erase_if(m, [](auto&&) { return false; }) == 0 && erase_if(m, [](auto&&) { return true; }) == ref.size() + 1 &&
+                   m.empty() && m.begin() == m.end(), name + " should erase none or all the values");
+        };
+        for_each_policy(check);
+
+        small_bst<K, V> small;
+        for (K k = 0; k < 6; k++) small[k] = k;
+        ASSERT(erase_if(small, [](auto&& kv) { return kv.first % 2 == 1; }) == 3 && small.size() == 3 &&
+               small.begin()->first == 0 && small.has(4) && !small.has(5), "Erase if should compact the inline nodes");
+        bst_set<K> s;
+        for (K k = 0; k < 100; k++) s.insert(k);
+        ASSERT(erase_if(s, [](K k) { return k >= 10; }) == 90 && s.size() == 10, "Erase if should work on sets");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Find many")
+    {
+        using V = int;
+        const auto v = random_unique_array(3000, 0xf1d5ul);
+
+        // Checks a policy against one find() / has() per key
+        auto check = [&](auto policy, const std::string& name, double) {
+            using map = policy_bst<K, V, decltype(policy)>;
+            map m;
+            std::vector<K> keys;
+            for (std::size_t i = 0; i < v.size(); i++) {
+                if (i % 2 == 0) m.insert(v[i]);
+                keys.push_back(v[i].first);
+            }
+            keys.push_back(v[0].first);
+
+            std::vector<typename map::iterator> found;
+            std::vector<bool> has;
+            std::size_t n = m.find_many(keys.begin(), keys.end(), std::back_inserter(found));
+            bool same = found.size() == keys.size() && n == v.size() / 2 + 1;
+            for (std::size_t i = 0; i < keys.size() && same; i++) {
+                same = found[i] == m.find(keys[i]) && (found[i] == m.end() || found[i]->first == keys[i]);
+            }
+            ASSERT(same, name + " find_many should find each key");
+            ASSERT(m.has_many(keys.begin(), keys.end(), std::back_inserter(has)) == n && has.size() == keys.size() &&
+                   has[0] && !has[1] && has.back(), name + " has_many should tell each key");
+            ASSERT(m.find_many(keys.end(), keys.end(), found.begin()) == 0, name + " should accept no keys");
+        };
+        for_each_policy(check);
+        check(balance_splay{}, "Splay", 0);
+
+        small_bst<K, V> small;
+        small[1] = 1; small[3] = 3;
+        std::vector<K> keys{3, 2, 1};
+        bool has[3];
+        ASSERT(small.has_many(keys.begin(), keys.end(), has) == 2 && has[0] && !has[1] && has[2],
+               "has_many should look up inline nodes");
+        bst<K, V> empty;
+        ASSERT(empty.has_many(keys.begin(), keys.end(), has) == 0 && !has[0], "has_many should work on empty maps");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Three-way comparators")
+    {
+        // Counts the calls, less or three-way
+        static std::size_t calls;
+        struct less_counting {
+            bool operator()(const std::string& a, const std::string& b) const { calls++; return a < b; }
+        };
+        struct three_way_counting {
+            using is_three_way [[maybe_unused]] = void;
+            int operator()(const std::string& a, const std::string& b) const { calls++; return a.compare(b); }
+        };
+        const auto v = random_unique_array(2000, 0x3a7ul);
+        bst<std::string, int, less_counting> less_map;
+        bst<std::string, int, three_way_counting> three_way_map;
+        std::map<std::string, int> ref;
+        for (auto&& kv : v) {
+            less_map.insert({std::to_string(kv.first), kv.second});
+            three_way_map.insert({std::to_string(kv.first), kv.second});
+            ref.insert({std::to_string(kv.first), kv.second});
+        }
+        std::vector<std::pair<std::string, int>> content{three_way_map.begin(), three_way_map.end()},
+                ref_content{ref.begin(), ref.end()};
+        ASSERT(content == ref_content, "Three-way comparators should order the keys");
+
+        calls = 0;
+        for (auto&& kv : ref) less_map.find(kv.first);
+        std::size_t less_calls = calls;
+        calls = 0;
+        for (auto&& kv : ref) three_way_map.find(kv.first);
+        ASSERT(calls < less_calls && calls <= ref.size() * three_way_map.depth(),
+               "Three-way comparators should compare once per level");
+
+        auto key = ref.begin()->first;
+        ASSERT(three_way_map.erase(key) == 1 && !three_way_map.has(key) && three_way_map.size() == ref.size() - 1,
+               "Three-way comparators should erase");
+        auto [lo, hi] = three_way_map.split(std::next(ref.begin(), 100)->first);
+        ASSERT(lo.size() == 99 && hi.begin()->first == std::next(ref.begin(), 100)->first,
+               "Three-way comparators should split");
+
+        // Less comparators returning an int are not three-way
+        struct int_less {
+            int operator()(int a, int b) const { return a < b; }
+        };
+        bst<int, int, int_less> int_map;
+        for (int i = 0; i < 10; i++) int_map.insert({i, i});
+        std::vector<std::pair<int, int>> ints{int_map.begin(), int_map.end()};
+        ASSERT(int_map.size() == 10 && ints.front().first == 0 && ints.back().first == 9 && int_map.has(5),
+               "Less comparators returning an int should stay less comparators");
+
+        // Transparent lookups
+        bst<std::string, int, bst_string_compare> m;
+        for (auto&& kv : ref) m.insert(kv);
+        std::string_view view{key};
+        ASSERT(m.has(view) && m.find(view)->first == key && m.has(key.c_str()) && !m.has(std::string_view{"x"}),
+               "Transparent lookups should find string views");
+        auto slice = m(std::string_view{"1"}, "2");
+        ASSERT(slice != m.end() && slice->first.front() == '1', "Transparent slices should take any bounds");
+        ASSERT(m.erase(view) == 1 && m.erase(view) == 0 && m.size() == ref.size() - 1,
+               "Transparent erase should take string views");
+        std::vector<std::string_view> views{view, std::next(ref.begin(), 5)->first};
+        bool found[2];
+        ASSERT(m.has_many(views.begin(), views.end(), found) == 1 && !found[0] && found[1],
+               "Transparent batches should take string views");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Key prefixes")
+    {
+        std::vector<std::string> keys{"", "a", "ab", std::string("ab\0", 3), std::string("ab\0\0", 4), "abcdefgh",
+                                      "abcdefgh0", "abcdefgh1", "abcdefg\xff", "https://a", "https://b", "\xff"};
+        bool ordered = true;
+        for (auto&& a : keys) {
+            for (auto&& b : keys) {
+                auto pa = bst_prefix_compare::prefix(a), pb = bst_prefix_compare::prefix(b);
+                ordered = ordered && (pa == pb || (pa < pb) == (a < b));
+            }
+        }
+        ASSERT(ordered, "Distinct prefixes should order the keys");
+
+        using map = bst<std::string, int, bst_prefix_compare>;
+        ASSERT(sizeof(map::node_type) == sizeof(bst<std::string, int>::node_type) + sizeof(std::uint64_t),
+               "Nodes should cache the prefix");
+        map m;
+        std::map<std::string, int> ref;
+        std::mt19937 generator(0x9e7ul);
+        for (int i = 0; i < 4000; i++) {
+            std::string k = keys[generator() % keys.size()] + std::to_string(generator() % 300);
+            m[k] = i;
+            ref[k] = i;
+            if (i % 5 == 0) {
+                k = keys[generator() % keys.size()];
+                ASSERT_QUIET(m.erase(std::string_view{k}) == ref.erase(k), "Prefixed erase");
+            }
+        }
+        std::vector<std::pair<std::string, int>> content{m.begin(), m.end()}, ref_content{ref.begin(), ref.end()};
+        ASSERT(content == ref_content, "Prefixed nodes should keep the order");
+        bool all = true;
+        for (auto&& kv : ref) all = all && m.find(kv.first)->second == kv.second && m.has(std::string_view{kv.first});
+        ASSERT(all && !m.has("abcdefgh") && !m.has(std::string("ab\0\0\0", 5)), "Prefixed lookups should break ties by key");
+    }
+    END_TEST()
+
+    TEST(_test_basic, "Frozen")
+    {
+        using map = bst<K, int>;
+        map empty;
+        auto none = empty.freeze();
+        ASSERT(none.empty() && none.begin() == none.end() && none.find(1) == none.end() && !none.has(1)
+               && none.lower_bound(1) == none.end(), "Freezing an empty map");
+
+        std::mt19937 generator(0xf0ul);
+        for (std::size_t n : {1, 2, 3, 7, 8, 100, 1023, 1024, 1025, 3000}) {
+            map m;
+            std::map<K, int> ref;
+            while (ref.size() < n) {
+                K k = static_cast<K>(generator() % (4 * n) * 2);
+                m[k] = static_cast<int>(k) + 1;
+                ref[k] = static_cast<int>(k) + 1;
+            }
+            auto f = m.freeze();
+            std::vector<std::pair<K, int>> content{f.begin(), f.end()}, ref_content{ref.begin(), ref.end()};
+            ASSERT_QUIET(f.size() == n && content == ref_content, "Frozen values should be in key order");
+            bool all = true;
+            for (K k = 0; k < static_cast<K>(8 * n + 3); k++) {
+                auto it = f.find(k);
+                auto rit = ref.find(k);
+                all = all && (it == f.end() ? rit == ref.end() : rit != ref.end() && it->second == rit->second)
+                      && f.has(k) == (rit != ref.end())
+                      && f.lower_bound(k) - f.begin() == std::distance(ref.begin(), ref.lower_bound(k))
+                      && f.upper_bound(k) - f.begin() == std::distance(ref.begin(), ref.upper_bound(k));
+            }
+            ASSERT_QUIET(all, "Frozen lookups should match std::map");
+            bool reverse = true;
+            auto rit = ref.rbegin();
+            for (auto it = f.end(); it != f.begin(); ++rit) reverse = reverse && (--it)->first == rit->first;
+            ASSERT_QUIET(reverse, "Frozen values should iterate backwards");
+        }
+        ASSERT(true, "Frozen lookups and bounds should match std::map");
+
+        bst_set<std::string, bst_string_compare> s;
+        for (auto k : {"pear", "apple", "fig", "kiwi", "banana"}) s.insert(k);
+        auto fs = s.freeze();
+        std::vector<std::string> words{fs.begin(), fs.end()};
+        ASSERT(words == (std::vector<std::string>{"apple", "banana", "fig", "kiwi", "pear"}) && fs.has("fig")
+               && *fs.lower_bound("c") == "fig" && fs.upper_bound("pear") == fs.end(), "Freezing a set");
+
+        // Ranks in the map's size_type
+        static_assert(std::is_same<decltype(bst<K, int, std::less<K>, std::uint16_t>{}.freeze()),
+                                   frozen_bst<K, int, std::less<K>, std::uint16_t>>::value);
+        std::vector<std::pair<K, int>> pairs;
+        for (K k = 0; k < 256; k++) pairs.emplace_back(k, (int) k);
+        frozen_bst<K, int, std::less<K>, std::uint8_t> full{sorted_unique, pairs.begin(), pairs.end()};
+        pairs.emplace_back(256, 256);
+        bool thrown = false;
+        try { frozen_bst<K, int, std::less<K>, std::uint8_t> over{sorted_unique, pairs.begin(), pairs.end()}; }
+        catch (const std::length_error&) { thrown = true; }
+        ASSERT(thrown && full.size() == 256 && full.find(255)->second == 255, "Ranks should not overflow size_type");
     }
     END_TEST()
 
@@ -638,5 +1593,298 @@ int main(int argc, char *argv[]) {
     }
     END_TEST()
 
+    TEST(_test_layout, "Compact layout")
+    {
+        using V = int;
+        using map = compact_bst<K, V>;
+        using vector = bstHelpers<K, V>::vector;
+
+        ASSERT(sizeof(map::node_type) < sizeof(bst<K, V>::node_type), "Compact nodes should be smaller");
+
+        const auto v = random_unique_array(1000, 0x123456ul);
+        map m{v.begin(), v.end()};
+        std::map<K, V> ref{v.begin(), v.end()};
+        ASSERT(m.size() == ref.size(), "Compact map should hold all the inserted pairs");
+        ASSERT((vector{m.begin(), m.end()} == vector{ref.begin(), ref.end()}), "Compact map should be sorted");
+        auto _max_depth = (unsigned char)(std::log2(m.size()) * 1.5);
+        ASSERT(m.depth() <= _max_depth, "Compact map should be balanced");
+
+        // Erase moves nodes around the array
+        for (std::size_t i = 0; i < v.size(); i += 2) {
+            if (i % 4 == 0) {
+                ASSERT_QUIET(m.erase(v[i].first) == 1, "erase() should remove the key");
+            } else {
+                ASSERT_QUIET(m.pop(v[i].first).second == v[i].second, "pop() should return the value");
+            }
+            ref.erase(v[i].first);
+        }
+        ASSERT((vector{m.begin(), m.end()} == vector{ref.begin(), ref.end()}), "Compact map should survive erase()");
+        ASSERT(m.find(v[1].first)->second == v[1].second, "find() should return the value");
+        ASSERT(!m.has(v[0].first), "Erased keys should not be found");
+
+        // Copies are independent
+        map c = m;
+        c[v[0].first] = 1;
+        ASSERT(c.size() == m.size() + 1 && !m.has(v[0].first), "Copy should be independent");
+
+        // Fixed capacity
+        compact_bst<K, V, std::less<K>, std::uint16_t, 8> f;
+        for (int i = 0; i < 8; i++) f[i] = i;
+        bool thrown = false;
+        try { f[8] = 8; } catch (const std::length_error&) { thrown = true; }
+        ASSERT(thrown && f.size() == 8, "Fixed capacity map should refuse the 9th key");
+        f.erase(3);
+        f[8] = 8;
+        ASSERT(f.has(8) && !f.has(3) && f.size() == 8, "Fixed capacity map should reuse erased slots");
+
+        // Indices stop short of nil, the max of size_type
+        compact_bst<K, V, std::less<K>, std::uint8_t> b;
+        for (int i = 0; i < 255; i++) b[i] = i;
+        thrown = false;
+        try { b[255] = 255; } catch (const std::length_error&) { thrown = true; }
+        ASSERT(thrown && b.size() == 255 && b.has(254) && !b.has(255),
+               "Growing map should refuse the key past its indices");
+        thrown = false;
+        try { b.reserve(256); } catch (const std::length_error&) { thrown = true; }
+        ASSERT(thrown, "reserve() should refuse a size past the indices");
+
+        // Hot/cold split
+        using split = compact_bst<K, V, std::less<K>, std::uint32_t, 0, true>;
+        ASSERT(sizeof(split::node_type) < sizeof(map::node_type), "Hot nodes should not hold the values");
+        split s{v.begin(), v.end()};
+        ref = std::map<K, V>{v.begin(), v.end()};
+        for (std::size_t i = 0; i < v.size(); i += 3) {
+            ASSERT_QUIET(s.erase(v[i].first) == 1, "erase() should remove the key");
+            ref.erase(v[i].first);
+        }
+        ASSERT((vector{s.begin(), s.end()} == vector{ref.begin(), ref.end()}), "Split map should keep keys and values paired");
+        s[v[0].first] = 7;
+        ASSERT(s.find(v[0].first)->second == 7 && s.find(v[1].first)->second == v[1].second, "find() should reach the cold value");
+    }
+    END_TEST()
+
+    TEST(_test_layout, "Lean layout")
+    {
+        using V = int;
+        using map = lean_bst<K, V>;
+        using vector = bstHelpers<K, V>::vector;
+
+        ASSERT(sizeof(map::node_type) < sizeof(bst<K, V>::node_type), "Lean nodes should be smaller");
+
+        const auto v = random_unique_array(1000, 0x654321ul);
+        map m{v.begin(), v.end()};
+        std::map<K, V> ref{v.begin(), v.end()};
+        ASSERT((vector{m.begin(), m.end()} == vector{ref.begin(), ref.end()}), "Lean map should be sorted");
+        auto _max_depth = (unsigned char)(std::log2(m.size()) * 1.5);
+        ASSERT(m.depth() <= _max_depth, "Lean map should be balanced");
+
+        for (std::size_t i = 0; i < v.size(); i += 2) {
+            ASSERT_QUIET(m.erase(v[i].first) == 1, "erase() should remove the key");
+            ref.erase(v[i].first);
+        }
+        ASSERT((vector{m.begin(), m.end()} == vector{ref.begin(), ref.end()}), "Lean map should survive erase()");
+        ASSERT(m.depth() <= _max_depth, "Lean map should stay balanced");
+
+        // insert() iterators come from the descent path, rotations included
+        bool walks = true;
+        for (std::size_t i = 0; i < v.size(); i += 2) {
+            auto ins = m.insert(v[i]);
+            auto next = ref.upper_bound(ref.insert(v[i]).first->first);
+            walks = walks && ins.second && ins.first->first == v[i].first
+                    && (++ins.first == m.end() ? next == ref.end() : next != ref.end() && ins.first->first == next->first);
+        }
+        ASSERT(walks && !m.insert(v[0]).second, "insert() should return an iterator walking to the next key");
+
+        // Iterators walk back and forth on the ancestors stack
+        auto it = m.find(v[1].first);
+        auto r = ref.find(v[1].first);
+        ++it; ++it; --it;
+        ++r;
+        ASSERT(it->first == r->first, "Iterator should move on the stack");
+        map::iterator _end = m.end();
+        --_end;
+        ASSERT(_end->first == ref.rbegin()->first, "--end() should be the last element");
+
+        const auto _l = ref.begin()->first / 2, _u = ref.rbegin()->first / 2;
+        vector slc{m(_l, _u), m.end()};
+        ASSERT((slc == vector{ref.lower_bound(_l), ref.upper_bound(_u)}), "Range should return keys >= lower and <= upper");
+
+        // Copies select and propagate the allocator as bst does
+        using tagged_map = lean_bst<K, V, std::less<K>, std::size_t, tagged_allocator<std::pair<const K, V>>>;
+        tagged_map p{tagged_allocator<std::pair<const K, V>>{3}}, q{tagged_allocator<std::pair<const K, V>>{5}};
+        for (auto&& kv : v) p.insert(kv);
+        tagged_map pc{p};
+        q = p;
+        ASSERT(pc.get_allocator().tag == -3 && pc.size() == p.size() && q.get_allocator().tag == 3 && q.size() == p.size(),
+               "Copies should select the allocator");
+
+        // Past the bounds the stack is walked back, without comparing keys
+        struct heavy_less: std::less<K> { char state[64]{}; };
+        ASSERT(sizeof(lean_bst<K, V, heavy_less>::iterator) == sizeof(map::iterator), "Iterators should not hold the comparator");
+        auto rng = m(_l, _u);
+        while (rng != m.end()) ++rng;
+        ++rng;
+        ASSERT(rng->first == slc.front().first, "Range should recover at the lower bound");
+        while (rng != m.end()) --rng;
+        --rng;
+        ASSERT(rng->first == slc.back().first, "Range should recover at the upper bound");
+    }
+    END_TEST()
+
+    TEST(_test_layout, "Key-only set")
+    {
+        using set = bst_set<K>;
+        using vector = std::vector<K>;
+
+        ASSERT(sizeof(set::node_type) < sizeof(bst<K, char>::node_type), "Set nodes should only hold the key");
+
+        const auto v = random_unique_array(1000, 0x2468aul);
+        set s;
+        std::set<K> ref;
+        for (auto&& kv : v) {
+            ASSERT_QUIET(s.insert(kv.first).second, "insert() should accept a new key");
+            ref.insert(kv.first);
+        }
+        ASSERT(!s.insert(v[0].first).second, "insert() should refuse a duplicated key");
+        ASSERT((vector{s.begin(), s.end()} == vector{ref.begin(), ref.end()}), "Set should be sorted");
+        ASSERT(s.has(v[1].first) && *s.find(v[1].first) == v[1].first, "find() should return the key");
+
+        for (std::size_t i = 0; i < v.size(); i += 2) {
+            ASSERT_QUIET(s.erase(v[i].first) == 1, "erase() should remove the key");
+            ref.erase(v[i].first);
+        }
+        ASSERT(s.pop(v[1].first) == v[1].first && !s.has(v[1].first), "pop() should return the key");
+        ref.erase(v[1].first);
+        ASSERT((vector{s.begin(), s.end()} == vector{ref.begin(), ref.end()}), "Set should survive erase()");
+
+        const auto _l = *ref.begin() / 2, _u = *ref.rbegin() / 2;
+        vector slc{s(_l, _u), s.end()};
+        ASSERT((slc == vector{ref.lower_bound(_l), ref.upper_bound(_u)}), "Range should return keys >= lower and <= upper");
+
+        set c = s;
+        c.insert(v[0].first);
+        ASSERT(c.size() == s.size() + 1, "Copy should be independent");
+
+        std::pmr::monotonic_buffer_resource arena;
+        pmr::bst_set<K> p{&arena};
+        p.insert(v[0].first);
+        ASSERT(p.has(v[0].first), "pmr set should allocate from the resource");
+    }
+    END_TEST()
+
+    TEST(_test_layout, "Small map")
+    {
+        using V = int;
+        using map = small_bst<K, V, 8>;
+        using vector = bstHelpers<K, V>::vector;
+
+        const auto v = random_unique_array(20, 0x13579ul);
+        map m;
+        std::map<K, V> ref;
+        for (std::size_t i = 0; i < 8; i++) {
+            ASSERT_QUIET(m.insert(v[i]).second, "insert() should accept a new key");
+            ref.insert(v[i]);
+        }
+        ASSERT(!m.insert(v[0]).second && m.size() == 8, "insert() should refuse a duplicated key");
+        ASSERT((vector{m.begin(), m.end()} == vector{ref.begin(), ref.end()}), "Inline pairs should be sorted");
+        ASSERT(m.find(v[3].first)->second == v[3].second, "find() should scan the inline pairs");
+        ASSERT(m.pop(v[3].first).second == v[3].second && !m.has(v[3].first), "pop() should remove an inline pair");
+        ref.erase(v[3].first);
+        const auto _l = ref.begin()->first / 2, _u = ref.rbegin()->first / 2;
+        ASSERT((vector{m(_l, _u), m.end()} == vector{ref.lower_bound(_l), ref.upper_bound(_u)}), "Range should work on inline pairs");
+
+        // Copies and swaps across representations
+        map c = m;
+        map t;
+        for (std::size_t i = 8; i < 20; i++) t[v[i].first] = v[i].second;
+        ASSERT(t.depth() < t.size(), "Growing past N should materialize a tree");
+        std::map<K, V> tref{v.begin() + 8, v.end()};
+        c.swap(t);
+        ASSERT((vector{c.begin(), c.end()} == vector{tref.begin(), tref.end()}), "swap() should move the tree");
+        ASSERT((vector{t.begin(), t.end()} == vector{ref.begin(), ref.end()}), "swap() should move the inline pairs");
+        map mv{std::move(t)};
+        ASSERT(t.empty() && (vector{mv.begin(), mv.end()} == vector{ref.begin(), ref.end()}), "Move should take the inline pairs");
+        t = std::move(c);
+        ASSERT(c.empty() && t.size() == tref.size(), "Move should take the tree");
+
+        for (std::size_t i = 8; i < 20; i += 2) {
+            ASSERT_QUIET(t.erase(v[i].first) == 1, "erase() should remove the key");
+            tref.erase(v[i].first);
+        }
+        ASSERT((vector{t.begin(), t.end()} == vector{tref.begin(), tref.end()}), "Materialized map should survive erase()");
+        t.clear();
+        t[1] = 1;
+        ASSERT(t.size() == 1 && t.depth() == 1 && t[1] == 1, "Cleared map should start small again");
+
+        // Allocations failing while materializing leave the pairs inline
+        using heap_map = bst<K, std::string, std::less<K>, std::size_t,
+                             std::pmr::polymorphic_allocator<std::pair<const K, std::string>>, _node_heap, 8>;
+        std::map<K, std::string> first;
+        for (std::size_t i = 0; i < 8; i++) first[v[i].first] = std::string(32, 'a' + (char) i);
+        bool kept = true;
+        for (std::size_t budget = 0; budget < 8; budget++) {
+            budget_resource r{budget};
+            heap_map h{&r};
+            for (auto&& kv : first) h.insert(kv);
+            bool thrown = false;
+            try { h[v[8].first] = "new"; } catch (const std::bad_alloc&) { thrown = true; }
+            kept = kept && thrown && h.depth() == 8
+                   && (std::map<K, std::string>{h.begin(), h.end()} == first);
+            r.left = 9;
+            kept = kept && h.insert({v[8].first, "new"}).second && h.size() == 9 && h.depth() < 9 && h.check_tree();
+        }
+        ASSERT(kept, "Failed materialization should keep the inline pairs");
+    }
+    END_TEST()
+
+    TEST(_test_layout, "Intrusive tree")
+    {
+        struct by_qty {};
+        struct order: bst_hook<>, bst_hook<by_qty> {
+            K id;
+            int qty;
+        };
+        using tree = intrusive_bst<order, K, &order::id>;
+        using qty_tree = intrusive_bst<order, int, &order::qty, std::less<int>, by_qty>;
+
+        const auto v = random_unique_array(1000, 0x97531ul);
+        std::vector<order> orders(v.size());
+        for (std::size_t i = 0; i < v.size(); i++) {
+            orders[i].id = v[i].first;
+            orders[i].qty = (int) i;
+        }
+
+        tree t{orders.begin(), orders.end()};
+        qty_tree q{orders.begin(), orders.end()};
+        std::map<K, int> ref{v.begin(), v.end()};
+        std::vector<K> keys, ref_keys;
+        for (auto&& o : t) keys.push_back(o.id);
+        for (auto&& kv : ref) ref_keys.push_back(kv.first);
+        ASSERT(t.size() == orders.size() && keys == ref_keys, "Intrusive tree should be sorted");
+        ASSERT(&*t.find(v[7].first) == &orders[7], "find() should return the linked object itself");
+        ASSERT(&*q.find(7) == &orders[7], "An object should be linked to a tree per hook");
+
+        order dup = orders[3];
+        ASSERT(!t.insert(dup).second, "insert() should refuse a duplicated key");
+
+        for (std::size_t i = 0; i < orders.size(); i += 2) {
+            if (i % 4 == 0) {
+                ASSERT_QUIET(t.erase(orders[i].id) == 1, "erase() should unlink the key");
+            } else {
+                t.unlink(orders[i]);
+            }
+            ref.erase(orders[i].id);
+        }
+        keys.clear();
+        ref_keys.clear();
+        for (auto&& o : t) keys.push_back(o.id);
+        for (auto&& kv : ref) ref_keys.push_back(kv.first);
+        ASSERT(keys == ref_keys && t.size() == ref.size(), "Intrusive tree should survive unlinking");
+        auto _max_depth = (unsigned char)(std::log2(t.size()) * 1.5);
+        ASSERT(t.depth() <= _max_depth, "Intrusive tree should be balanced");
+        ASSERT(t.pop(orders[1].id) == &orders[1] && q.size() == orders.size(), "pop() should return the unlinked object");
+    }
+    END_TEST()
+
     return 0;
 }